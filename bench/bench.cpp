@@ -0,0 +1,911 @@
+/*
+ *      SimString benchmarks.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif/*_WIN32*/
+
+#include <simstring/simstring.h>
+#include <simstring/async.h>
+
+/*
+ * This program measures the building and retrieval speed of SimString on
+ * synthetic corpora and writes the results in JSON, so that the results
+ * of different revisions or machines can be compared by scripts. The
+ * corpora and queries are generated from a seed, and are the same for
+ * the same options on any platform.
+ *
+ * The micro-benchmarks measure the components of a query: the n-gram
+ * generation, the look-ups of the hash tables (cdbpp), and the steps of
+ * the overlap join. The macro-benchmarks build a database for each size
+ * of corpora, and measure the latencies of queries for every similarity
+ * measure and threshold.
+ */
+
+typedef std::chrono::steady_clock clock_type;
+
+static double elapsed(const clock_type::time_point& begin, const clock_type::time_point& end)
+{
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+struct option
+{
+    std::vector<int> sizes;
+    int num_queries;
+    int ngram_size;
+    bool be;
+    int store_flags;
+    unsigned long seed;
+    std::string dir;
+    bool micro;
+    bool macro;
+
+    option() :
+        num_queries(1000), ngram_size(3), be(false), store_flags(0),
+        seed(1), dir("."), micro(true), macro(true)
+    {
+        sizes.push_back(10000);
+        sizes.push_back(100000);
+    }
+};
+
+/**
+ * A generator of synthetic strings resembling names.
+ *  A string consists of words of random syllables, and a query is a string
+ *  of the corpus with a few random edits. The generator uses the raw
+ *  output of std::mt19937_64, whose sequence is defined by the standard,
+ *  so that the strings do not depend on the implementation.
+ */
+class corpus_generator
+{
+protected:
+    std::mt19937_64 m_rng;
+
+    size_t uniform(size_t n)
+    {
+        return (size_t)(m_rng() % n);
+    }
+
+public:
+    corpus_generator(unsigned long seed) : m_rng(seed)
+    {
+    }
+
+    std::string word()
+    {
+        static const char *syllables[] = {
+            "a", "i", "u", "e", "o", "ka", "ki", "ku", "ke", "ko", "sa",
+            "shi", "su", "se", "so", "ta", "chi", "tsu", "te", "to", "na",
+            "ni", "nu", "ne", "no", "ha", "hi", "fu", "he", "ho", "ma",
+            "mi", "mu", "me", "mo", "ya", "yu", "yo", "ra", "ri", "ru",
+            "re", "ro", "wa", "n", "ga", "gi", "da", "de", "ba", "bi",
+            "po", "son", "ton", "ler", "man", "berg", "ville", "ston",
+        };
+        const size_t num = sizeof(syllables) / sizeof(syllables[0]);
+
+        std::string str;
+        const size_t n = 2 + uniform(3);
+        for (size_t i = 0;i < n;++i) {
+            str += syllables[uniform(num)];
+        }
+        return str;
+    }
+
+    std::string string()
+    {
+        std::string str = word();
+        const size_t n = uniform(3);
+        for (size_t i = 0;i < n;++i) {
+            str += ' ';
+            str += word();
+        }
+        return str;
+    }
+
+    std::string edit(const std::string& src)
+    {
+        std::string str = src;
+        const size_t n = uniform(3);
+        for (size_t i = 0;i < n && !str.empty();++i) {
+            const size_t pos = uniform(str.size());
+            const char c = (char)('a' + uniform(26));
+            switch (uniform(3)) {
+            case 0:
+                str[pos] = c;
+                break;
+            case 1:
+                str.insert(str.begin() + pos, c);
+                break;
+            case 2:
+                str.erase(str.begin() + pos);
+                break;
+            }
+        }
+        return str.empty() ? src : str;
+    }
+
+    void corpus(std::vector<std::string>& strs, size_t n)
+    {
+        strs.resize(n);
+        for (size_t i = 0;i < n;++i) {
+            strs[i] = string();
+        }
+    }
+
+    void queries(std::vector<std::string>& qs, const std::vector<std::string>& strs, size_t n)
+    {
+        qs.resize(n);
+        for (size_t i = 0;i < n;++i) {
+            qs[i] = edit(strs[uniform(strs.size())]);
+        }
+    }
+};
+
+/**
+ * A reader exposing the steps of the overlap join.
+ */
+class bench_reader : public simstring::reader
+{
+public:
+    /**
+     * Runs the look-ups and Step 1 of the overlap join for a query, and
+     * accumulates their time in seconds.
+     */
+    template <class measure_type, class query_type>
+    void steps(
+        const query_type& query,
+        double alpha,
+        double& fetch_time,
+        double& merge_time,
+        size_t& num_candidates
+        )
+    {
+        context_type& ctx = thread_context();
+        const int qsize = (int)query.size();
+        const int xmin = std::max(measure_type::min_size(qsize, alpha), 1);
+        const int xmax = std::min(measure_type::max_size(qsize, alpha), m_max_size);
+        ctx.posts.resize(qsize);
+
+        for (int xsize = xmin;xsize <= xmax;++xsize) {
+            const int mmin = measure_type::min_match(qsize, xsize, alpha);
+            clock_type::time_point t0 = clock_type::now();
+            if (!this->fetch<simstring::no_stats>(query, NULL, xsize, mmin, ctx)) {
+                continue;
+            }
+            clock_type::time_point t1 = clock_type::now();
+            this->merge(ctx, qsize - mmin + 1);
+            clock_type::time_point t2 = clock_type::now();
+
+            fetch_time += elapsed(t0, t1);
+            merge_time += elapsed(t1, t2);
+            num_candidates += ctx.cands.size();
+        }
+    }
+
+    /**
+     * Runs the whole overlap join for a query.
+     */
+    template <class measure_type, class query_type>
+    size_t join(const query_type& query, double alpha, std::vector<uint32_t>& results)
+    {
+        results.clear();
+        this->overlapjoin<measure_type>(query, alpha, results, false);
+        return results.size();
+    }
+};
+
+/**
+ * A writer of JSON values.
+ *  The writer inserts commas between the members of objects and arrays,
+ *  and indents the members by their depths.
+ */
+class json_writer
+{
+protected:
+    std::ostream& m_os;
+    // Whether no member has been written, for each open object or array.
+    std::vector<bool> m_first;
+    // Whether a key has been written, and its value follows.
+    bool m_key;
+
+    void separate()
+    {
+        if (m_key) {
+            m_key = false;
+        } else if (!m_first.empty()) {
+            if (!m_first.back()) {
+                m_os << ',';
+            }
+            m_first.back() = false;
+            m_os << std::endl << std::string(2 * m_first.size(), ' ');
+        }
+    }
+
+public:
+    json_writer(std::ostream& os) : m_os(os), m_key(false)
+    {
+        m_os.precision(6);
+    }
+
+    json_writer& key(const char *name)
+    {
+        separate();
+        m_os << '"' << name << "\": ";
+        m_key = true;
+        return *this;
+    }
+
+    json_writer& begin(char c)
+    {
+        separate();
+        m_os << c;
+        m_first.push_back(true);
+        return *this;
+    }
+
+    json_writer& end(char c)
+    {
+        const bool empty = m_first.back();
+        m_first.pop_back();
+        if (!empty) {
+            m_os << std::endl << std::string(2 * m_first.size(), ' ');
+        }
+        m_os << c;
+        if (m_first.empty()) {
+            m_os << std::endl;
+        }
+        return *this;
+    }
+
+    template <class value_type>
+    json_writer& value(const value_type& v)
+    {
+        separate();
+        m_os << v;
+        return *this;
+    }
+
+    json_writer& value(const std::string& v)
+    {
+        // The strings written by this program need no escapes.
+        return value<std::string>('"' + v + '"');
+    }
+
+    json_writer& value(const char *v)
+    {
+        return value(std::string(v));
+    }
+
+    json_writer& value(bool v)
+    {
+        return value<const char*>(v ? "true" : "false");
+    }
+
+    template <class value_type>
+    json_writer& member(const char *name, const value_type& v)
+    {
+        return key(name).value(v);
+    }
+};
+
+static long peak_rss_kb()
+{
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+#ifdef  __APPLE__
+        return (long)(ru.ru_maxrss / 1024);
+#else
+        return (long)ru.ru_maxrss;
+#endif/*__APPLE__*/
+    }
+#endif/*_WIN32*/
+    return -1;
+}
+
+static long long file_size(const std::string& path)
+{
+    std::ifstream ifs(path.c_str(), std::ios::binary | std::ios::ate);
+    return ifs.fail() ? -1 : (long long)(std::streamoff)ifs.tellg();
+}
+
+// The indices of a database are named by the sizes of strings in n-grams;
+// the maximum size of a string in the synthetic corpora is much smaller.
+enum { MAX_INDEX_SIZE = 256 };
+
+static long long database_size(const std::string& name)
+{
+    long long total = file_size(name);
+    for (int i = 1;i <= MAX_INDEX_SIZE;++i) {
+        std::stringstream ss;
+        ss << name << '.' << i << ".cdb";
+        const long long size = file_size(ss.str());
+        if (0 < size) {
+            total += size;
+        }
+    }
+    return total;
+}
+
+static void remove_database(const std::string& name)
+{
+    std::remove(name.c_str());
+    for (int i = 1;i <= MAX_INDEX_SIZE;++i) {
+        std::stringstream ss;
+        ss << name << '.' << i << ".cdb";
+        std::remove(ss.str().c_str());
+    }
+}
+
+/**
+ * Writes the percentiles of latencies in microseconds.
+ */
+static void write_latencies(json_writer& json, std::vector<double>& latencies, double total)
+{
+    std::sort(latencies.begin(), latencies.end());
+    const size_t n = latencies.size();
+    const double ps[] = {50., 90., 99.};
+    const char *names[] = {"p50_us", "p90_us", "p99_us"};
+    for (size_t i = 0;i < 3;++i) {
+        // The nearest-rank percentile.
+        size_t rank = (size_t)std::ceil(ps[i] / 100. * n);
+        rank = std::min(std::max(rank, (size_t)1), n);
+        json.member(names[i], latencies[rank-1] * 1e6);
+    }
+    json.member("max_us", latencies.back() * 1e6);
+    json.member("qps", total <= 0. ? 0. : n / total);
+}
+
+/**
+ * Measures the generation of n-grams through an insert iterator and into
+ * a reused vector.
+ */
+static void bench_ngrams(json_writer& json, const option& opt, const std::vector<std::string>& strs)
+{
+    simstring::ngram_generator gen(opt.ngram_size, opt.be);
+    size_t total = 0;
+
+    clock_type::time_point t0 = clock_type::now();
+    for (size_t i = 0;i < strs.size();++i) {
+        std::vector<std::string> ngrams;
+        gen(strs[i], std::back_inserter(ngrams));
+        total += ngrams.size();
+    }
+    clock_type::time_point t1 = clock_type::now();
+    std::vector<std::string> ngrams;
+    for (size_t i = 0;i < strs.size();++i) {
+        gen.generate(strs[i], ngrams);
+        total -= ngrams.size();
+    }
+    clock_type::time_point t2 = clock_type::now();
+
+    json.key("ngrams").begin('{');
+    json.member("strings", strs.size());
+    json.member("iterator_ns_per_string", elapsed(t0, t1) * 1e9 / strs.size());
+    json.member("vector_ns_per_string", elapsed(t1, t2) * 1e9 / strs.size());
+    json.member("consistent", total == 0);
+    json.end('}');
+}
+
+/**
+ * Measures the look-ups of a hash table whose keys are the n-grams of the
+ * strings.
+ */
+static void bench_cdbpp(json_writer& json, const option& opt, const std::vector<std::string>& strs, bool inline_keys)
+{
+    simstring::ngram_generator gen(opt.ngram_size, opt.be);
+    std::set<std::string> uniq;
+    std::vector<std::string> ngrams;
+    for (size_t i = 0;i < strs.size();++i) {
+        gen.generate(strs[i], ngrams);
+        uniq.insert(ngrams.begin(), ngrams.end());
+    }
+    std::vector<std::string> keys(uniq.begin(), uniq.end());
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(opt.seed));
+
+    // Build a hash table in a temporary file and read it into memory.
+    const std::string path = opt.dir + "/simstring-bench.cdb";
+    {
+        std::ofstream ofs(path.c_str(), std::ios::binary);
+        cdbpp::builder dbw(ofs, inline_keys);
+        for (size_t i = 0;i < keys.size();++i) {
+            const uint32_t v = (uint32_t)i;
+            dbw.put(keys[i].c_str(), keys[i].size() + 1, &v, sizeof(v));
+        }
+    }
+    std::vector<char> image;
+    {
+        std::ifstream ifs(path.c_str(), std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    }
+    std::remove(path.c_str());
+
+    cdbpp::cdbpp dbr;
+    if (image.empty() || dbr.open(&image[0], image.size()) == 0) {
+        return;
+    }
+
+    // Keys absent from the table.
+    std::vector<std::string> misses(keys.size());
+    for (size_t i = 0;i < keys.size();++i) {
+        misses[i] = keys[i] + '#';
+    }
+
+    size_t vsize, found = 0;
+    clock_type::time_point t0 = clock_type::now();
+    for (size_t i = 0;i < keys.size();++i) {
+        found += (dbr.get(keys[i].c_str(), keys[i].size() + 1, &vsize) != NULL);
+    }
+    clock_type::time_point t1 = clock_type::now();
+    for (size_t i = 0;i < misses.size();++i) {
+        found += (dbr.get(misses[i].c_str(), misses[i].size() + 1, &vsize) != NULL);
+    }
+    clock_type::time_point t2 = clock_type::now();
+
+    // Batches of the size of typical queries.
+    enum { BATCH = 16 };
+    const void* kp[BATCH];
+    const void* vp[BATCH];
+    size_t ks[BATCH], vs[BATCH];
+    for (size_t i = 0;i < keys.size();i += BATCH) {
+        const size_t n = std::min((size_t)BATCH, keys.size() - i);
+        for (size_t j = 0;j < n;++j) {
+            kp[j] = keys[i+j].c_str();
+            ks[j] = keys[i+j].size() + 1;
+        }
+        dbr.get_many(n, kp, ks, vp, vs);
+        for (size_t j = 0;j < n;++j) {
+            found -= (vp[j] != NULL);
+        }
+    }
+    clock_type::time_point t3 = clock_type::now();
+
+    json.key(inline_keys ? "cdbpp_inline_keys" : "cdbpp").begin('{');
+    json.member("keys", keys.size());
+    json.member("table_bytes", image.size());
+    json.member("get_hit_ns", elapsed(t0, t1) * 1e9 / keys.size());
+    json.member("get_miss_ns", elapsed(t1, t2) * 1e9 / keys.size());
+    json.member("get_many_ns_per_key", elapsed(t2, t3) * 1e9 / keys.size());
+    json.member("consistent", found == 0);
+    json.end('}');
+}
+
+/**
+ * Measures the look-ups, Step 1 (merging the postings into candidates),
+ * and Step 2 (verifying the candidates) of the overlap join.
+ */
+template <class measure_type>
+static void bench_overlapjoin(
+    json_writer& json,
+    bench_reader& dbr,
+    const option& opt,
+    const std::vector<std::string>& queries,
+    const char *name,
+    double alpha
+    )
+{
+    simstring::ngram_generator gen(opt.ngram_size, opt.be);
+    std::vector<std::vector<std::string> > ngrams(queries.size());
+    for (size_t i = 0;i < queries.size();++i) {
+        gen.generate(queries[i], ngrams[i]);
+    }
+
+    // Warm up the page cache and the context of the thread.
+    std::vector<uint32_t> results;
+    for (size_t i = 0;i < ngrams.size();++i) {
+        dbr.join<measure_type>(ngrams[i], alpha, results);
+    }
+
+    double fetch_time = 0., merge_time = 0.;
+    size_t num_candidates = 0, num_results = 0;
+    for (size_t i = 0;i < ngrams.size();++i) {
+        dbr.steps<measure_type>(ngrams[i], alpha, fetch_time, merge_time, num_candidates);
+    }
+
+    clock_type::time_point t0 = clock_type::now();
+    for (size_t i = 0;i < ngrams.size();++i) {
+        num_results += dbr.join<measure_type>(ngrams[i], alpha, results);
+    }
+    const double total = elapsed(t0, clock_type::now());
+    const size_t n = queries.size();
+
+    json.key("overlapjoin").begin('{');
+    json.member("measure", name);
+    json.member("threshold", alpha);
+    json.member("queries", n);
+    json.member("fetch_us", fetch_time * 1e6 / n);
+    json.member("step1_us", merge_time * 1e6 / n);
+    json.member("step2_us", std::max(total - fetch_time - merge_time, 0.) * 1e6 / n);
+    json.member("total_us", total * 1e6 / n);
+    json.member("mean_candidates", (double)num_candidates / n);
+    json.member("mean_results", (double)num_results / n);
+    json.end('}');
+}
+
+/**
+ * Measures the latencies of queries for a similarity measure and threshold.
+ */
+static void bench_retrieve(
+    json_writer& json,
+    bench_reader& dbr,
+    const std::vector<std::string>& queries,
+    int measure,
+    const char *name,
+    double alpha
+    )
+{
+    std::vector<double> latencies(queries.size());
+    std::vector<std::string> xstrs;
+    size_t num_results = 0;
+
+    // Warm up the page cache and the context of the thread.
+    for (size_t i = 0;i < queries.size() && i < 100;++i) {
+        xstrs.clear();
+        dbr.retrieve(queries[i], measure, alpha, std::back_inserter(xstrs));
+    }
+
+    clock_type::time_point begin = clock_type::now();
+    for (size_t i = 0;i < queries.size();++i) {
+        xstrs.clear();
+        clock_type::time_point t0 = clock_type::now();
+        dbr.retrieve(queries[i], measure, alpha, std::back_inserter(xstrs));
+        latencies[i] = elapsed(t0, clock_type::now());
+        num_results += xstrs.size();
+    }
+    const double total = elapsed(begin, clock_type::now());
+
+    json.begin('{');
+    json.member("measure", name);
+    json.member("threshold", alpha);
+    json.member("queries", queries.size());
+    write_latencies(json, latencies, total);
+    json.member("mean_results", (double)num_results / queries.size());
+    json.end('}');
+}
+
+/**
+ * Measures the latencies of top-k queries.
+ */
+static void bench_retrieve_topk(
+    json_writer& json,
+    bench_reader& dbr,
+    const std::vector<std::string>& queries,
+    int k
+    )
+{
+    std::vector<double> latencies(queries.size());
+    std::vector<std::pair<std::string, double> > xstrs;
+
+    clock_type::time_point begin = clock_type::now();
+    for (size_t i = 0;i < queries.size();++i) {
+        xstrs.clear();
+        clock_type::time_point t0 = clock_type::now();
+        dbr.retrieve_topk(queries[i], simstring::cosine, k, std::back_inserter(xstrs));
+        latencies[i] = elapsed(t0, clock_type::now());
+    }
+    const double total = elapsed(begin, clock_type::now());
+
+    json.begin('{');
+    json.member("measure", "cosine");
+    json.member("k", k);
+    json.member("queries", queries.size());
+    write_latencies(json, latencies, total);
+    json.end('}');
+}
+
+/**
+ * Measures the throughput of asynchronous queries on the thread pool that
+ * also searches the size buckets of the queries, and checks that the
+ * results of these queries and of a batch on the same pool match the
+ * sequential queries.
+ */
+static bool bench_async(
+    json_writer& json,
+    bench_reader& dbr,
+    const std::string& name,
+    const std::vector<std::string>& queries,
+    double alpha
+    )
+{
+    typedef std::vector<std::string> strings_type;
+
+    // Several workers, so that queries and buckets interleave on any machine.
+    simstring::thread_pool pool(4);
+    simstring::reader dba;
+    if (!dba.open(name, simstring::open_eager)) {
+        std::cerr << "ERROR: " << dba.error() << std::endl;
+        return false;
+    }
+    dba.set_thread_pool(&pool);
+
+    std::vector<std::future<strings_type> > futures;
+    futures.reserve(queries.size());
+    clock_type::time_point begin = clock_type::now();
+    {
+        simstring::async_reader<> ar(dba, pool);
+        for (size_t i = 0;i < queries.size();++i) {
+            futures.push_back(ar.retrieve(queries[i], simstring::cosine, alpha));
+        }
+        ar.wait();
+    }
+    const double total = elapsed(begin, clock_type::now());
+
+    // A batch of queries also shares the pool with the buckets.
+    std::vector<strings_type> batch;
+    dba.retrieve_batch(queries, simstring::cosine, alpha, batch, pool);
+
+    // The SIDs of a split bucket are ordered by the ranges.
+    size_t mismatches = 0;
+    strings_type xstrs;
+    for (size_t i = 0;i < queries.size();++i) {
+        strings_type ystrs = futures[i].get();
+        xstrs.clear();
+        dbr.retrieve(queries[i], simstring::cosine, alpha, std::back_inserter(xstrs));
+        std::sort(xstrs.begin(), xstrs.end());
+        std::sort(ystrs.begin(), ystrs.end());
+        std::sort(batch[i].begin(), batch[i].end());
+        if (xstrs != ystrs || xstrs != batch[i]) {
+            ++mismatches;
+        }
+    }
+
+    json.begin('{');
+    json.member("measure", "cosine");
+    json.member("threshold", alpha);
+    json.member("queries", queries.size());
+    json.member("threads", pool.size());
+    json.member("queries_per_second", total <= 0. ? 0. : queries.size() / total);
+    json.member("mismatches", mismatches);
+    json.end('}');
+
+    if (0 < mismatches) {
+        std::cerr << "ERROR: " << mismatches << " asynchronous queries differ from sequential ones" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool bench_size(json_writer& json, const option& opt, int size)
+{
+    typedef simstring::writer_base<std::string> writer_type;
+
+    corpus_generator cg(opt.seed + (unsigned long)size);
+    std::vector<std::string> strs, queries;
+    cg.corpus(strs, size);
+    cg.queries(queries, strs, opt.num_queries);
+
+    std::stringstream ss;
+    ss << opt.dir << "/simstring-bench-" << size << ".db";
+    const std::string name = ss.str();
+
+    // Build a database.
+    clock_type::time_point t0 = clock_type::now();
+    {
+        simstring::ngram_generator gen(opt.ngram_size, opt.be);
+        writer_type dbw(gen, name, opt.store_flags);
+        for (size_t i = 0;i < strs.size() && !dbw.fail();++i) {
+            dbw.insert(strs[i]);
+        }
+        dbw.close();
+        if (dbw.fail()) {
+            std::cerr << "ERROR: " << dbw.error() << std::endl;
+            remove_database(name);
+            return false;
+        }
+    }
+    const double build_time = elapsed(t0, clock_type::now());
+
+    bench_reader dbr;
+    if (!dbr.open(name)) {
+        std::cerr << "ERROR: " << dbr.error() << std::endl;
+        remove_database(name);
+        return false;
+    }
+
+    json.begin('{');
+    json.member("strings", size);
+    json.key("build").begin('{');
+    json.member("seconds", build_time);
+    json.member("strings_per_second", build_time <= 0. ? 0. : size / build_time);
+    json.member("database_bytes", database_size(name));
+    json.end('}');
+
+    if (opt.micro) {
+        json.key("micro").begin('{');
+        bench_ngrams(json, opt, strs);
+        bench_cdbpp(json, opt, strs, false);
+        bench_cdbpp(json, opt, strs, true);
+        bench_overlapjoin<simstring::measure::cosine>(json, dbr, opt, queries, "cosine", 0.7);
+        json.end('}');
+    }
+
+    if (opt.macro) {
+        static const struct {
+            int measure;
+            const char *name;
+        } measures[] = {
+            {simstring::exact, "exact"},
+            {simstring::dice, "dice"},
+            {simstring::cosine, "cosine"},
+            {simstring::jaccard, "jaccard"},
+            {simstring::overlap, "overlap"},
+        };
+        static const double thresholds[] = {0.5, 0.7, 0.9};
+
+        json.key("retrieve").begin('[');
+        for (size_t i = 0;i < sizeof(measures) / sizeof(measures[0]);++i) {
+            for (size_t j = 0;j < sizeof(thresholds) / sizeof(thresholds[0]);++j) {
+                // The exact match does not use the threshold.
+                if (measures[i].measure == simstring::exact && 0 < j) {
+                    break;
+                }
+                bench_retrieve(json, dbr, queries, measures[i].measure, measures[i].name, thresholds[j]);
+            }
+        }
+        json.end(']');
+
+        json.key("retrieve_topk").begin('[');
+        bench_retrieve_topk(json, dbr, queries, 1);
+        bench_retrieve_topk(json, dbr, queries, 10);
+        json.end(']');
+
+        json.key("async").begin('[');
+        const bool b = bench_async(json, dbr, name, queries, 0.3);
+        json.end(']');
+        if (!b) {
+            dbr.close();
+            remove_database(name);
+            return false;
+        }
+    }
+
+    dbr.close();
+    remove_database(name);
+
+    json.member("peak_rss_kb", peak_rss_kb());
+    json.end('}');
+    return true;
+}
+
+static void usage(std::ostream& os, const char *argv0)
+{
+    os << "USAGE: " << argv0 << " [OPTIONS]" << std::endl;
+    os << "Measure the speed of SimString on synthetic corpora, and write the results in JSON." << std::endl;
+    os << std::endl;
+    os << "OPTIONS:" << std::endl;
+    os << "  --sizes=N[,N...]      numbers of strings in corpora (DEFAULT=10000,100000)" << std::endl;
+    os << "  --queries=N           number of queries (DEFAULT=1000)" << std::endl;
+    os << "  --ngram=N             unit of n-grams (DEFAULT=3)" << std::endl;
+    os << "  --mark                include marks for begins and ends of strings" << std::endl;
+    os << "  --compress            build databases with compressed postings" << std::endl;
+    os << "  --inline-keys         build databases with inline keys" << std::endl;
+    os << "  --single-file         build databases in single files" << std::endl;
+    os << "  --filters             build databases with filters of n-grams" << std::endl;
+    os << "  --seed=N              seed of the corpus generator (DEFAULT=1)" << std::endl;
+    os << "  --dir=DIR             directory for temporary databases (DEFAULT=.)" << std::endl;
+    os << "  --micro               run the micro-benchmarks only" << std::endl;
+    os << "  --macro               run the macro-benchmarks only" << std::endl;
+    os << "  --help                show this help message and exit" << std::endl;
+}
+
+static bool parse_options(option& opt, int argc, char *argv[])
+{
+    for (int i = 1;i < argc;++i) {
+        const std::string arg = argv[i];
+        const std::string::size_type eq = arg.find('=');
+        const std::string name = arg.substr(0, eq);
+        const std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+
+        if (name == "--sizes") {
+            opt.sizes.clear();
+            std::stringstream ss(value);
+            std::string token;
+            while (std::getline(ss, token, ',')) {
+                const int size = std::atoi(token.c_str());
+                if (size <= 0) {
+                    return false;
+                }
+                opt.sizes.push_back(size);
+            }
+        } else if (name == "--queries") {
+            opt.num_queries = std::atoi(value.c_str());
+        } else if (name == "--ngram") {
+            opt.ngram_size = std::atoi(value.c_str());
+        } else if (name == "--mark") {
+            opt.be = true;
+        } else if (name == "--compress") {
+            opt.store_flags |= simstring::store_compressed;
+        } else if (name == "--inline-keys") {
+            opt.store_flags |= simstring::store_inline_keys;
+        } else if (name == "--single-file") {
+            opt.store_flags |= simstring::store_single_file;
+        } else if (name == "--filters") {
+            opt.store_flags |= simstring::store_ngram_filters;
+        } else if (name == "--seed") {
+            opt.seed = std::strtoul(value.c_str(), NULL, 10);
+        } else if (name == "--dir") {
+            opt.dir = value;
+        } else if (name == "--micro") {
+            opt.macro = false;
+        } else if (name == "--macro") {
+            opt.micro = false;
+        } else {
+            return false;
+        }
+    }
+    return (!opt.sizes.empty() && 0 < opt.num_queries && 0 < opt.ngram_size);
+}
+
+int main(int argc, char *argv[])
+{
+    option opt;
+    if (!parse_options(opt, argc, argv)) {
+        usage(std::cerr, argv[0]);
+        return 1;
+    }
+
+    json_writer json(std::cout);
+    json.begin('{');
+    std::stringstream version;
+    version << SIMSTRING_MAJOR_VERSION << '.' << SIMSTRING_MINOR_VERSION;
+    json.member("version", version.str());
+    json.member("seed", opt.seed);
+    json.member("ngram", opt.ngram_size);
+    json.member("mark", opt.be);
+    json.member("store_flags", opt.store_flags);
+    json.key("corpora").begin('[');
+    for (size_t i = 0;i < opt.sizes.size();++i) {
+        if (!bench_size(json, opt, opt.sizes[i])) {
+            return 1;
+        }
+    }
+    json.end(']');
+    json.member("peak_rss_kb", peak_rss_kb());
+    json.end('}');
+    return 0;
+}
@@ -30,19 +30,24 @@
 
 /* $Id$ */
 
+#include <chrono>
 #include <cstdlib>
 #include <ctime>
+#include <future>
 #include <ios>
 #include <iostream>
 #include <iterator>
 #include <locale>
 #include <locale.h>
+#include <memory>
 #include <string>
+#include <thread>
 #include <typeinfo>
 #include <vector>
 #include <simstring/simstring.h>
 
 #include "optparse.h"
+#include "pipeline.h"
 
 class option
 {
@@ -50,6 +55,7 @@ public:
     enum {
         MODE_RETRIEVE = 0,
         MODE_BUILD,
+        MODE_COMPACT,
         MODE_HELP,
         MODE_VERSION,
     };
@@ -57,6 +63,7 @@ public:
     enum {
         CC_CHAR = 0,    // char
         CC_WCHAR,       // wchar_t
+        CC_UTF8,        // char (UTF-8) with n-grams of code points
     };
 
     int mode;
@@ -70,6 +77,20 @@ public:
     bool echo_back;
     bool quiet;
     bool benchmark;
+    int memory;
+    bool compress;
+    bool large;
+    bool inline_keys;
+    bool single_file;
+    bool filters;
+    bool append;
+    bool remove;
+    int topk;
+    bool scores;
+    bool rank;
+    int threads;
+    bool buckets;
+    bool warmup;
 
 public:
     option() :
@@ -82,7 +103,21 @@ public:
         threshold(0.7),
         echo_back(false),
         quiet(false),
-        benchmark(false)
+        benchmark(false),
+        memory(0),
+        compress(false),
+        large(false),
+        inline_keys(false),
+        single_file(false),
+        filters(false),
+        append(false),
+        remove(false),
+        topk(0),
+        scores(false),
+        rank(false),
+        threads(1),
+        buckets(false),
+        warmup(false)
     {
     }
 };
@@ -95,18 +130,51 @@ class option_parser :
         ON_OPTION(SHORTOPT('b') || LONGOPT("build"))
             mode = MODE_BUILD;
 
+        ON_OPTION(SHORTOPT('a') || LONGOPT("append"))
+            mode = MODE_BUILD;
+            append = true;
+
+        ON_OPTION(SHORTOPT('D') || LONGOPT("delete"))
+            mode = MODE_BUILD;
+            append = true;
+            remove = true;
+
+        ON_OPTION(SHORTOPT('C') || LONGOPT("compact"))
+            mode = MODE_COMPACT;
+
         ON_OPTION_WITH_ARG(SHORTOPT('d') || LONGOPT("database"))
             name = arg;
 
         ON_OPTION(SHORTOPT('u') || LONGOPT("unicode"))
             code = CC_WCHAR;
 
+        ON_OPTION(SHORTOPT('U') || LONGOPT("utf8"))
+            code = CC_UTF8;
+
         ON_OPTION_WITH_ARG(SHORTOPT('n') || LONGOPT("ngram"))
             ngram_size = std::atoi(arg);
 
         ON_OPTION(SHORTOPT('m') || LONGOPT("mark"))
             be = true;
 
+        ON_OPTION_WITH_ARG(SHORTOPT('M') || LONGOPT("memory"))
+            memory = std::atoi(arg);
+
+        ON_OPTION(SHORTOPT('c') || LONGOPT("compress"))
+            compress = true;
+
+        ON_OPTION(SHORTOPT('L') || LONGOPT("large"))
+            large = true;
+
+        ON_OPTION(SHORTOPT('i') || LONGOPT("inline-keys"))
+            inline_keys = true;
+
+        ON_OPTION(SHORTOPT('S') || LONGOPT("single-file"))
+            single_file = true;
+
+        ON_OPTION(SHORTOPT('F') || LONGOPT("filters"))
+            filters = true;
+
         ON_OPTION_WITH_ARG(SHORTOPT('s') || LONGOPT("similarity"))
             if (std::strcmp(arg, "exact") == 0) {
                 measure = simstring::exact;
@@ -123,6 +191,31 @@ class option_parser :
         ON_OPTION_WITH_ARG(SHORTOPT('t') || LONGOPT("threshold"))
             threshold = std::atof(arg);
 
+        ON_OPTION_WITH_ARG(SHORTOPT('k') || LONGOPT("top"))
+            topk = std::atoi(arg);
+
+        ON_OPTION(SHORTOPT('r') || LONGOPT("scores"))
+            scores = true;
+
+        ON_OPTION(SHORTOPT('R') || LONGOPT("rank"))
+            scores = true;
+            rank = true;
+
+        ON_OPTION_WITH_ARG(SHORTOPT('j') || LONGOPT("threads"))
+            threads = std::atoi(arg);
+            if (threads <= 0) {
+                threads = (int)std::thread::hardware_concurrency();
+            }
+            if (threads <= 0) {
+                threads = 1;
+            }
+
+        ON_OPTION(SHORTOPT('P') || LONGOPT("parallel-buckets"))
+            buckets = true;
+
+        ON_OPTION(SHORTOPT('W') || LONGOPT("warmup"))
+            warmup = true;
+
         ON_OPTION(SHORTOPT('e') || LONGOPT("echo"))
             echo_back = true;
 
@@ -151,10 +244,32 @@ int usage(std::ostream& os, const char *argv0)
     os << std::endl;
     os << "OPTIONS:" << std::endl;
     os << "  -b, --build           build a database for strings read from STDIN" << std::endl;
+    os << "  -a, --append          add strings read from STDIN to the database as a new" << std::endl;
+    os << "                        segment, without rebuilding the database" << std::endl;
+    os << "  -D, --delete          delete strings read from STDIN from the database by" << std::endl;
+    os << "                        appending a new segment" << std::endl;
+    os << "  -C, --compact         merge the segments of the database into one" << std::endl;
     os << "  -d, --database=DB     specify a database file" << std::endl;
     os << "  -u, --unicode         use Unicode (wchar_t) for representing characters" << std::endl;
+    os << "  -U, --utf8            build a database of UTF-8 strings with n-grams of code" << std::endl;
+    os << "                        points (the database cannot be read by SimString 1.0);" << std::endl;
+    os << "                        queries to such a database need no option" << std::endl;
     os << "  -n, --ngram=N         specify the unit of n-grams (DEFAULT=3)" << std::endl;
     os << "  -m, --mark            include marks for begins and ends of strings" << std::endl;
+    os << "  -M, --memory=MB       limit the memory for building indices, spilling sorted" << std::endl;
+    os << "                        runs to temporary files (DEFAULT=0; no limit)" << std::endl;
+    os << "  -c, --compress        compress posting lists in the indices (the database" << std::endl;
+    os << "                        cannot be read by SimString 1.0)" << std::endl;
+    os << "  -L, --large           allow the database to exceed 4 GB (the database cannot" << std::endl;
+    os << "                        be read by SimString 1.0)" << std::endl;
+    os << "  -i, --inline-keys     store short n-grams in the hash tables of the indices" << std::endl;
+    os << "                        for faster look-ups (the database cannot be read by" << std::endl;
+    os << "                        SimString 1.0)" << std::endl;
+    os << "  -S, --single-file     store the indices in the database file instead of a" << std::endl;
+    os << "                        file for every size of strings (the database cannot be" << std::endl;
+    os << "                        read by SimString 1.0)" << std::endl;
+    os << "  -F, --filters         store filters of n-grams in the indices, with which" << std::endl;
+    os << "                        queries skip look-ups of n-grams missing in the indices" << std::endl;
     os << "  -s, --similarity=SIM  specify a similarity measure (DEFAULT='cosine'):" << std::endl;
     os << "      exact                 exact match" << std::endl;
     os << "      dice                  dice coefficient" << std::endl;
@@ -162,9 +277,24 @@ int usage(std::ostream& os, const char *argv0)
     os << "      jaccard               jaccard coefficient" << std::endl;
     os << "      overlap               overlap coefficient" << std::endl;
     os << "  -t, --threshold=TH    specify the threshold (DEFAULT=0.7)" << std::endl;
+    os << "  -k, --top=K           retrieve the K most similar strings with their scores" << std::endl;
+    os << "                        instead of using the threshold (DEFAULT=0; disabled)" << std::endl;
+    os << "  -r, --scores          output the similarity scores of the retrieved strings" << std::endl;
+    os << "  -R, --rank            output the retrieved strings with their scores from the" << std::endl;
+    os << "                        most similar one" << std::endl;
+    os << "  -j, --threads=N       build the database or process queries with N threads;" << std::endl;
+    os << "                        the output keeps the order of queries (DEFAULT=1; 0 for" << std::endl;
+    os << "                        the number of cores)" << std::endl;
+    os << "  -P, --parallel-buckets" << std::endl;
+    os << "                        search the sizes of strings of every query with the" << std::endl;
+    os << "                        threads (-j) instead of processing queries in parallel," << std::endl;
+    os << "                        which reduces the latency of long queries" << std::endl;
+    os << "  -W, --warmup          load the whole database into memory before processing" << std::endl;
+    os << "                        queries" << std::endl;
     os << "  -e, --echo-back       echo back query strings to the output" << std::endl;
     os << "  -q, --quiet           suppress supplemental information from the output" << std::endl;
-    os << "  -p, --benchmark       show benchmark result (retrieved strings are suppressed)" << std::endl;
+    os << "  -p, --benchmark       show benchmark result (retrieved strings are suppressed)," << std::endl;
+    os << "                        including the wall-clock throughput" << std::endl;
     os << "  -v, --version         show this version information and exit" << std::endl;
     os << "  -h, --help            show this help message and exit" << std::endl;
     os << std::endl;
@@ -199,16 +329,64 @@ int build(option& opt, istream_type& is)
     os << "N-gram length: " << opt.ngram_size << std::endl;
     os << "Begin/end marks: " << std::boolalpha << opt.be << std::endl;
     os << "Char type: " << typeid(char_type).name() << " (" << sizeof(char_type) << ")" << std::endl;
+    if (opt.code == option::CC_UTF8) {
+        os << "UTF-8 code points: true" << std::endl;
+    }
+    if (0 < opt.memory) {
+        os << "Memory budget: " << opt.memory << " MB" << std::endl;
+    }
+    if (opt.compress) {
+        os << "Compressed postings: true" << std::endl;
+    }
+    if (opt.large) {
+        os << "Large database: true" << std::endl;
+    }
+    if (opt.inline_keys) {
+        os << "Inline keys: true" << std::endl;
+    }
+    if (opt.single_file) {
+        os << "Single file: true" << std::endl;
+    }
+    if (opt.filters) {
+        os << "N-gram filters: true" << std::endl;
+    }
+    if (opt.append) {
+        os << "Append a segment: true" << std::endl;
+    }
+    if (1 < opt.threads) {
+        os << "Threads: " << opt.threads << std::endl;
+    }
     os.flush();
 
     // Open the database for construction.
-    clock_t clk = std::clock();
-    ngram_generator_type gen(opt.ngram_size, opt.be);
-    writer_type db(gen, opt.name);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ngram_generator_type gen(opt.ngram_size, opt.be, opt.code == option::CC_UTF8);
+    int flags = 0;
+    if (opt.compress) {
+        flags |= simstring::store_compressed;
+    }
+    if (opt.large) {
+        flags |= simstring::store_large;
+    }
+    if (opt.inline_keys) {
+        flags |= simstring::store_inline_keys;
+    }
+    if (opt.single_file) {
+        flags |= simstring::store_single_file;
+    }
+    if (opt.filters) {
+        flags |= simstring::store_ngram_filters;
+    }
+    if (opt.append) {
+        flags |= simstring::store_append;
+    }
+    writer_type db(gen, opt.name, flags);
     if (db.fail()) {
         es << "ERROR: " << db.error() << std::endl;
         return 1;
     }
+    db.set_memory_budget((size_t)opt.memory * 1024 * 1024);
+    db.set_num_threads(opt.threads);
 
     // Insert every string from STDIN into the database.
     int n = 0;
@@ -220,8 +398,8 @@ int build(option& opt, istream_type& is)
             break;
         }
 
-        // Insert the string.
-        if (!db.insert(line)) {
+        // Insert (or delete) the string.
+        if (!(opt.remove ? db.remove(line) : db.insert(line))) {
             es << "ERROR: " << db.error() << std::endl;
             return 1;
         }
@@ -247,13 +425,56 @@ int build(option& opt, istream_type& is)
     // Report the elaped time for construction.
     os << "Total number of strings: " << n << std::endl;
     os << "Seconds required: "
-        << (std::clock() - clk) / (double)CLOCKS_PER_SEC << std::endl;
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+        << std::endl;
     os << std::endl;
     os.flush();
 
     return 0;
 }
 
+template <class char_type>
+int compact(option& opt)
+{
+    typedef std::basic_string<char_type> string_type;
+    typedef simstring::reader reader_type;
+
+    std::ostream& os = std::cout;
+    std::ostream& es = std::cerr;
+
+    // Show the copyright information.
+    version(os);
+
+    os << "Compacting the database" << std::endl;
+    os << "Database name: " << opt.name << std::endl;
+    os.flush();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    reader_type db;
+    if (!db.open(opt.name)) {
+        es << "ERROR: " << db.error() << std::endl;
+        return 1;
+    }
+    if (db.char_size() != sizeof(char_type)) {
+        es << "ERROR: Inconsistent character encoding " <<
+            "(DB:" << db.char_size() << ", " <<
+            "CUR:" << sizeof(char_type) << "): " << std::endl;
+        es << "This problem may be solved by specifying -u (--unicode) option." << std::endl;
+        return 1;
+    }
+    if (!db.compact<string_type>()) {
+        es << "ERROR: " << db.error() << std::endl;
+        return 1;
+    }
+
+    os << "Seconds required: "
+        << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+        << std::endl;
+    os << std::endl;
+    os.flush();
+    return 0;
+}
+
 // widen for strings only with ASCII characters.
 template <class char_type>
 std::basic_string<char_type> widen(const std::string& str)
@@ -266,18 +487,253 @@ std::basic_string<char_type> widen(const std::string& str)
     return dst;
 }
 
-template <class char_type, class istream_type, class ostream_type>
-int retrieve(option& opt, istream_type& is, ostream_type& os)
+/// The results of a query.
+template <class char_type>
+struct query_result
 {
     typedef std::basic_string<char_type> string_type;
     typedef std::vector<string_type> strings_type;
-    typedef simstring::reader reader_type;
+    typedef std::vector<std::pair<string_type, double> > scored_strings_type;
+
+    string_type query;
+    strings_type xstrs;
+    scored_strings_type scored;
+    double seconds;
+};
+
+template <class reader_type, class char_type>
+void issue_query(option& opt, reader_type& db, query_result<char_type>& r)
+{
+    typedef query_result<char_type> result_type;
+
+    if (0 < opt.topk) {
+        db.retrieve_topk(r.query, opt.measure, opt.topk, std::back_inserter(r.scored));
+        typename result_type::scored_strings_type::const_iterator it;
+        for (it = r.scored.begin();it != r.scored.end();++it) {
+            r.xstrs.push_back(it->first);
+        }
+    } else if (opt.scores) {
+        db.retrieve_scored(
+            r.query, opt.measure, opt.threshold, std::back_inserter(r.scored), opt.rank);
+        typename result_type::scored_strings_type::const_iterator it;
+        for (it = r.scored.begin();it != r.scored.end();++it) {
+            r.xstrs.push_back(it->first);
+        }
+    } else {
+        db.retrieve(r.query, opt.measure, opt.threshold, std::back_inserter(r.xstrs));
+    }
+}
+
+template <class char_type, class ostream_type>
+void output_result(option& opt, ostream_type& os, const query_result<char_type>& r)
+{
+    // Do not output results when the benchmarking flag is on.
+    if (!opt.benchmark) {
+        // Output the query string if necessary.
+        if (opt.echo_back) {
+            os << r.query << std::endl;
+        }
+
+        // Output the retrieved strings (and their scores if any).
+        for (size_t i = 0;i < r.xstrs.size();++i) {
+            os << os.widen('\t') << r.xstrs[i];
+            if (0 < opt.topk || opt.scores) {
+                os << os.widen('\t') << r.scored[i].second;
+            }
+            os << std::endl;
+        }
+        os.flush();
+    }
+
+    // Do not output information when the quiet flag is on.
+    if (!opt.quiet) {
+        os <<
+            r.xstrs.size() <<
+            widen<char_type>(" strings retrieved (") <<
+            r.seconds <<
+            widen<char_type>(" sec)") << std::endl;
+    }
+}
+
+/// The statistics of queries.
+struct query_stats
+{
+    int num_queries;
+    int num_retrieved;
+    double seconds;
+
+    query_stats() : num_queries(0), num_retrieved(0), seconds(0.)
+    {
+    }
+};
+
+template <class char_type, class ostream_type>
+void output_stats(
+    ostream_type& os,
+    const query_stats& stats,
+    double elapsed,
+    const simstring::reader_stats& rs
+    )
+{
+    const double n = (double)rs.queries;
+    os <<
+        widen<char_type>("Total number of queries: ") <<
+        stats.num_queries << std::endl;
+    os <<
+        widen<char_type>("Seconds per query: ") <<
+        stats.seconds / stats.num_queries << std::endl;
+    os <<
+        widen<char_type>("Number of retrieved strings per query: ") <<
+        stats.num_retrieved / (double)stats.num_queries << std::endl;
+    os <<
+        widen<char_type>("Elapsed seconds (wall clock): ") <<
+        elapsed << std::endl;
+    os <<
+        widen<char_type>("Queries per second (wall clock): ") <<
+        stats.num_queries / elapsed << std::endl;
+
+    // The statistics of the steps of queries.
+    os <<
+        widen<char_type>("Size buckets searched per query: ") <<
+        rs.buckets / n << std::endl;
+    os <<
+        widen<char_type>("N-gram look-ups per query: ") <<
+        rs.lookups / n << std::endl;
+    os <<
+        widen<char_type>("N-grams rejected by filters per query: ") <<
+        rs.filtered / n << std::endl;
+    os <<
+        widen<char_type>("Size buckets skipped by filters per query: ") <<
+        rs.skipped / n << std::endl;
+    os <<
+        widen<char_type>("Posting SIDs merged per query: ") <<
+        rs.postings / n << std::endl;
+    os <<
+        widen<char_type>("Candidates per query: ") <<
+        rs.candidates / n << std::endl;
+    os <<
+        widen<char_type>("Candidates probed per query: ") <<
+        rs.probes / n << std::endl;
+    os <<
+        widen<char_type>("Candidates pruned per query: ") <<
+        rs.pruned / n << std::endl;
+    os <<
+        widen<char_type>("Seconds per query (n-grams, look-ups, merge, verification): ") <<
+        rs.ngram_seconds / n << widen<char_type>(", ") <<
+        rs.lookup_seconds / n << widen<char_type>(", ") <<
+        rs.merge_seconds / n << widen<char_type>(", ") <<
+        rs.verify_seconds / n << std::endl;
+}
+
+/**
+ * Processes queries with multiple threads.
+ *  The main thread reads queries in batches, the workers process the
+ *  batches, and the writer outputs the batches in the order of the input.
+ *  The number of batches in flight is bounded by the capacity of the queue
+ *  to the writer.
+ */
+template <class char_type, class reader_type, class istream_type, class ostream_type>
+int retrieve_parallel(option& opt, reader_type& db, istream_type& is, ostream_type& os)
+{
+    typedef std::basic_string<char_type> string_type;
+    typedef query_result<char_type> result_type;
+
+    // A batch of queries.
+    struct batch_type
+    {
+        std::vector<result_type> results;
+        std::promise<void> done;
+    };
+    typedef std::shared_ptr<batch_type> batch_ptr;
+
+    const size_t batch_size = 64;
+    bounded_queue<batch_ptr> work(2 * opt.threads);
+    bounded_queue<std::pair<batch_ptr, std::shared_future<void> > > order(4 * opt.threads);
+    query_stats stats;
+
+    // Start the workers.
+    std::vector<std::thread> workers;
+    for (int i = 0;i < opt.threads;++i) {
+        workers.push_back(std::thread([&] {
+            batch_ptr b;
+            while (work.pop(b)) {
+                typename std::vector<result_type>::iterator it;
+                for (it = b->results.begin();it != b->results.end();++it) {
+                    std::chrono::steady_clock::time_point start =
+                        std::chrono::steady_clock::now();
+                    issue_query(opt, db, *it);
+                    it->seconds = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start).count();
+                }
+                b->done.set_value();
+            }
+        }));
+    }
+
+    // Start the writer.
+    std::thread writer([&] {
+        std::pair<batch_ptr, std::shared_future<void> > e;
+        while (order.pop(e)) {
+            e.second.wait();
+            typename std::vector<result_type>::const_iterator it;
+            for (it = e.first->results.begin();it != e.first->results.end();++it) {
+                output_result(opt, os, *it);
+                stats.seconds += it->seconds;
+                stats.num_retrieved += (int)it->xstrs.size();
+                ++stats.num_queries;
+            }
+        }
+    });
+
+    // Read queries.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (bool eof = false;!eof;) {
+        batch_ptr b(new batch_type);
+        while (b->results.size() < batch_size) {
+            string_type line;
+            std::getline(is, line);
+            if (is.eof()) {
+                eof = true;
+                break;
+            }
+            b->results.push_back(result_type());
+            b->results.back().query = line;
+        }
+        order.push(std::make_pair(b, b->done.get_future().share()));
+        work.push(b);
+    }
+    work.close();
+    for (size_t i = 0;i < workers.size();++i) {
+        workers[i].join();
+    }
+    order.close();
+    writer.join();
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    // Output the benchmark information if necessary.
+    if (opt.benchmark) {
+        output_stats<char_type>(os, stats, elapsed, db.stats());
+    }
+
+    return 0;
+}
+
+template <class char_type, class reader_type, class istream_type, class ostream_type>
+int retrieve_with(option& opt, istream_type& is, ostream_type& os)
+{
+    typedef query_result<char_type> result_type;
 
     std::ostream& es = std::cerr;
 
-    // Open the database.
+    // Open the database; queries from multiple threads need all the
+    // indices opened in advance.
     reader_type db;
-    if (!db.open(opt.name)) {
+    int flags = (1 < opt.threads) ? simstring::open_eager : 0;
+    if (opt.warmup) {
+        flags |= (simstring::open_eager | simstring::open_willneed);
+    }
+    if (!db.open(opt.name, flags)) {
         es << "ERROR: " << db.error() << std::endl;
         return 1;
     }
@@ -291,69 +747,72 @@ int retrieve(option& opt, istream_type& is, ostream_type& os)
         return 1;
     }
 
-    int num_queries = 0;
-    int num_retrieved = 0;
-    clock_t clk_total = 0;
+    // Load the database so that the first queries do not wait for disk.
+    if (opt.warmup) {
+        db.warmup(opt.threads);
+    }
+
+    // Search the sizes of strings of every query with the threads.
+    std::unique_ptr<simstring::thread_pool> pool;
+    if (1 < opt.threads && opt.buckets) {
+        pool.reset(new simstring::thread_pool(opt.threads));
+        db.set_thread_pool(pool.get());
+    } else if (1 < opt.threads) {
+        return retrieve_parallel<char_type>(opt, db, is, os);
+    }
+
+    query_stats stats;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
     for (;;) {
         // Read a line.
-        string_type line;
-        std::getline(is, line);
+        result_type r;
+        std::getline(is, r.query);
         if (is.eof()) {
             break;
         }
 
-        // Issue a query.
-        strings_type xstrs;
-        clock_t clk = std::clock();
-        db.retrieve(line, opt.measure, opt.threshold, std::back_inserter(xstrs));
-        clock_t elapsed = (std::clock() - clk);
+        // Issue a query; the processor time would include all the threads.
+        if (pool) {
+            std::chrono::steady_clock::time_point t = std::chrono::steady_clock::now();
+            issue_query(opt, db, r);
+            r.seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - t).count();
+        } else {
+            clock_t clk = std::clock();
+            issue_query(opt, db, r);
+            r.seconds = (std::clock() - clk) / (double)CLOCKS_PER_SEC;
+        }
 
         // Update stats.
-        clk_total += elapsed;
-        num_retrieved += (int)xstrs.size();
-        ++num_queries;
-
-        // Do not output results when the benchmarking flag is on.
-        if (!opt.benchmark) {
-            // Output the query string if necessary.
-            if (opt.echo_back) {
-                os << line << std::endl;
-            }
+        stats.seconds += r.seconds;
+        stats.num_retrieved += (int)r.xstrs.size();
+        ++stats.num_queries;
 
-            // Output the retrieved strings.
-            typename strings_type::const_iterator it;
-            for (it = xstrs.begin();it != xstrs.end();++it) {
-                os << os.widen('\t') << *it << std::endl;
-            }
-            os.flush();
-        }
-
-        // Do not output information when the quiet flag is on.
-        if (!opt.quiet) {
-            os <<
-                xstrs.size() <<
-                widen<char_type>(" strings retrieved (") <<
-                (std::clock() - clk) / (double)CLOCKS_PER_SEC <<
-                widen<char_type>(" sec)") << std::endl;
-        }
+        output_result(opt, os, r);
     }
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
 
     // Output the benchmark information if necessary.
     if (opt.benchmark) {
-        os <<
-            widen<char_type>("Total number of queries: ") <<
-            num_queries << std::endl;
-        os <<
-            widen<char_type>("Seconds per query: ") <<
-            clk_total / (double)CLOCKS_PER_SEC / num_queries << std::endl;
-        os <<
-            widen<char_type>("Number of retrieved strings per query: ") <<
-            num_retrieved / (double)num_queries << std::endl;
+        output_stats<char_type>(os, stats, elapsed, db.stats());
     }
 
     return 0;
 }
 
+template <class char_type, class istream_type, class ostream_type>
+int retrieve(option& opt, istream_type& is, ostream_type& os)
+{
+    typedef simstring::reader_base<simstring::ngram_generator, simstring::collect_stats> stats_reader_type;
+
+    // Collect the statistics of queries only for the benchmark.
+    if (opt.benchmark) {
+        return retrieve_with<char_type, stats_reader_type>(opt, is, os);
+    }
+    return retrieve_with<char_type, simstring::reader>(opt, is, os);
+}
+
 int main(int argc, char *argv[])
 {
     // Parse the command-line options.
@@ -383,14 +842,21 @@ int main(int argc, char *argv[])
     case option::MODE_VERSION:
         return version(std::cout);
     case option::MODE_BUILD:
-        if (opt.code == option::CC_CHAR) {
+        if (opt.code == option::CC_CHAR || opt.code == option::CC_UTF8) {
             return build<char>(opt, std::cin);
         } else if (opt.code == option::CC_WCHAR) {
             return build<wchar_t>(opt, std::wcin);
         }
         break;
+    case option::MODE_COMPACT:
+        if (opt.code == option::CC_CHAR || opt.code == option::CC_UTF8) {
+            return compact<char>(opt);
+        } else if (opt.code == option::CC_WCHAR) {
+            return compact<wchar_t>(opt);
+        }
+        break;
     case option::MODE_RETRIEVE:
-        if (opt.code == option::CC_CHAR) {
+        if (opt.code == option::CC_CHAR || opt.code == option::CC_UTF8) {
             return retrieve<char>(opt, std::cin, std::cout);
         } else if (opt.code == option::CC_WCHAR) {
             return retrieve<wchar_t>(opt, std::wcin, std::wcout);
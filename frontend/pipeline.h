@@ -0,0 +1,104 @@
+/*
+ *      Utilities for the pipelined processing of the frontend.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * A queue with a capacity connecting stages of a pipeline.
+ *  A producer pushing to a full queue waits for consumers, so that a fast
+ *  stage cannot run ahead of slow stages without bound.
+ */
+template <class value_tmpl>
+class bounded_queue
+{
+public:
+    typedef value_tmpl value_type;
+
+protected:
+    std::deque<value_type> m_items;
+    size_t m_capacity;
+    bool m_closed;
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+
+public:
+    explicit bounded_queue(size_t capacity)
+        : m_capacity(capacity), m_closed(false)
+    {
+    }
+
+    /**
+     * Pushes an item, waiting while the queue is full.
+     */
+    void push(const value_type& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this] { return m_items.size() < m_capacity; });
+        m_items.push_back(item);
+        m_not_empty.notify_one();
+    }
+
+    /**
+     * Pops an item, waiting while the queue is empty.
+     *  @return bool    \c false if the queue is closed and empty.
+     */
+    bool pop(value_type& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if (m_items.empty()) {
+            return false;
+        }
+        item = m_items.front();
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    /**
+     * Closes the queue; consumers finish when the queue becomes empty.
+     */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+    }
+};
+
+#endif/*__PIPELINE_H__*/
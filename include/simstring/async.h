@@ -0,0 +1,347 @@
+/*
+ *      Asynchronous queries.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_ASYNC_H__
+#define __SIMSTRING_ASYNC_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "simstring.h"
+#include "thread_pool.h"
+
+namespace simstring
+{
+
+/**
+ * A reader answering queries asynchronously.
+ *
+ *  This class runs the queries to a reader in the tasks of a thread pool,
+ *  and delivers their results through futures or callbacks. A thread
+ *  running an event loop thus submits queries without waiting for page
+ *  faults in the indices or the master file, and may keep many queries in
+ *  flight. A pool with more threads than cores keeps the processors busy
+ *  while some of the queries wait for the disk.
+ *
+ *  The queries are copied into the tasks. The reader must be opened with
+ *  ::simstring::open_eager (so that queries never modify it), and must
+ *  outlive this object. The destructor waits for the submitted queries.
+ *
+ *  @param  reader_tmpl     The type of the reader.
+ */
+template <class reader_tmpl = reader>
+class async_reader
+{
+public:
+    /// The type of the reader.
+    typedef reader_tmpl reader_type;
+
+protected:
+    /// The reader.
+    reader_type& m_reader;
+    /// The thread pool owned by this object, or NULL.
+    std::unique_ptr<thread_pool> m_owned;
+    /// The thread pool running the queries.
+    thread_pool& m_pool;
+    /// The number of queries submitted and not finished.
+    size_t m_pending;
+    /// The mutex and condition variable for the pending queries.
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+public:
+    /**
+     * Constructs an object with worker threads of its own.
+     *  @param  reader      The reader opened with ::simstring::open_eager.
+     *  @param  num_threads The number of worker threads. Zero uses the
+     *                      number of hardware threads.
+     */
+    explicit async_reader(reader_type& reader, int num_threads = 0)
+        : m_reader(reader), m_owned(new thread_pool(num_threads)),
+        m_pool(*m_owned), m_pending(0)
+    {
+    }
+
+    /**
+     * Constructs an object running queries with a thread pool.
+     *  @param  reader      The reader opened with ::simstring::open_eager.
+     *  @param  pool        The thread pool, which may be shared with other
+     *                      readers, including the pool searching the size
+     *                      buckets of the reader (see
+     *                      reader_base::set_thread_pool()), and must
+     *                      outlive this object.
+     */
+    async_reader(reader_type& reader, thread_pool& pool)
+        : m_reader(reader), m_pool(pool), m_pending(0)
+    {
+    }
+
+    /**
+     * Destructs the object after waiting for the submitted queries.
+     */
+    virtual ~async_reader()
+    {
+        wait();
+    }
+
+    /**
+     * Returns the number of queries submitted and not finished.
+     */
+    size_t pending() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_pending;
+    }
+
+    /**
+     * Waits for the submitted queries.
+     *  A thread calling this function must not be a worker of the pool.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this] { return m_pending == 0; });
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @return std::future     The future of the retrieved strings, which
+     *                          receives the exception if the query fails.
+     *  @see    reader_base::retrieve()
+     */
+    template <class string_type>
+    std::future<std::vector<string_type> > retrieve(
+        const string_type& query,
+        int measure,
+        double alpha
+        )
+    {
+        typedef std::vector<string_type> value_type;
+        std::shared_ptr<std::promise<value_type> > promise(new std::promise<value_type>);
+        std::future<value_type> future = promise->get_future();
+        this->retrieve(query, measure, alpha,
+            [promise](value_type& xstrs, std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value(std::move(xstrs));
+                }
+            });
+        return future;
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  callback        The function called by a worker thread with
+     *                          the retrieved strings
+     *                          (std::vector<string_type>&) and the exception
+     *                          thrown by the query (std::exception_ptr,
+     *                          empty on success). The callback must not
+     *                          throw an exception.
+     */
+    template <class string_type, class callback_type>
+    void retrieve(
+        const string_type& query,
+        int measure,
+        double alpha,
+        callback_type callback
+        )
+    {
+        reader_type& reader = m_reader;
+        this->submit<std::vector<string_type> >(
+            [&reader, query, measure, alpha](std::vector<string_type>& xstrs) {
+                reader.retrieve(query, measure, alpha, std::back_inserter(xstrs));
+            }, callback);
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @return std::future     The future of the pairs of a retrieved string
+     *                          and its score, from the most similar one.
+     *  @see    reader_base::retrieve_topk()
+     */
+    template <class string_type>
+    std::future<std::vector<std::pair<string_type, double> > > retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k
+        )
+    {
+        typedef std::vector<std::pair<string_type, double> > value_type;
+        std::shared_ptr<std::promise<value_type> > promise(new std::promise<value_type>);
+        std::future<value_type> future = promise->get_future();
+        this->retrieve_topk(query, measure, k,
+            [promise](value_type& xstrs, std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value(std::move(xstrs));
+                }
+            });
+        return future;
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  callback        The function called by a worker thread with
+     *                          the pairs of a retrieved string and its score
+     *                          (std::vector<std::pair<string_type, double> >&)
+     *                          and the exception thrown by the query
+     *                          (std::exception_ptr).
+     */
+    template <class string_type, class callback_type>
+    void retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        callback_type callback
+        )
+    {
+        typedef std::vector<std::pair<string_type, double> > value_type;
+        reader_type& reader = m_reader;
+        this->submit<value_type>(
+            [&reader, query, measure, k](value_type& xstrs) {
+                reader.retrieve_topk(query, measure, k, std::back_inserter(xstrs));
+            }, callback);
+    }
+
+    /**
+     * Checks whether the database has a string similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @return std::future     The future of the answer.
+     *  @see    reader_base::check()
+     */
+    template <class string_type>
+    std::future<bool> check(
+        const string_type& query,
+        int measure,
+        double alpha
+        )
+    {
+        std::shared_ptr<std::promise<bool> > promise(new std::promise<bool>);
+        std::future<bool> future = promise->get_future();
+        this->check(query, measure, alpha,
+            [promise](bool found, std::exception_ptr error) {
+                if (error) {
+                    promise->set_exception(error);
+                } else {
+                    promise->set_value(found);
+                }
+            });
+        return future;
+    }
+
+    /**
+     * Checks whether the database has a string similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  callback        The function called by a worker thread with
+     *                          the answer (bool&) and the exception thrown by
+     *                          the query (std::exception_ptr).
+     */
+    template <class string_type, class callback_type>
+    void check(
+        const string_type& query,
+        int measure,
+        double alpha,
+        callback_type callback
+        )
+    {
+        reader_type& reader = m_reader;
+        this->submit<bool>(
+            [&reader, query, measure, alpha](bool& found) {
+                found = reader.check(query, measure, alpha);
+            }, callback);
+    }
+
+protected:
+    /**
+     * Submits a query to the thread pool.
+     *  @param  query           The function running the query, which
+     *                          receives the result (value_type&).
+     *  @param  callback        The function receiving the result and the
+     *                          exception thrown by the query.
+     */
+    template <class value_type, class query_type, class callback_type>
+    void submit(query_type query, callback_type callback)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+
+        m_pool.submit([this, query, callback]() mutable {
+            value_type result = value_type();
+            std::exception_ptr error;
+            try {
+                query(result);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            callback(result, error);
+
+            // Notify while holding the lock, since the object may be
+            // destructed as soon as a waiting thread sees no query.
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_pending == 0) {
+                m_cond.notify_all();
+            }
+        });
+    }
+};
+
+};
+
+#endif/*__SIMSTRING_ASYNC_H__*/
@@ -0,0 +1,254 @@
+/*
+ *      Result cache.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_CACHE_H__
+#define __SIMSTRING_CACHE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace simstring
+{
+
+/**
+ * A bounded cache of retrieved results.
+ *
+ *  The cache maps a key (a byte string) to an array of values, and evicts
+ *  the least recently used entries when the estimated memory usage exceeds
+ *  the budget. Entries are distributed to shards by the hash values of
+ *  their keys; every shard has its own lock and a share of the budget, so
+ *  that threads looking up different keys rarely wait for each other.
+ *
+ *  @param  value_tmpl          The type of values.
+ */
+template <class value_tmpl>
+class result_cache
+{
+public:
+    /// The type of a value.
+    typedef value_tmpl value_type;
+    /// The type of an array of values.
+    typedef std::vector<value_type> values_type;
+
+    /// The number of shards.
+    enum { NUM_SHARDS = 16 };
+
+protected:
+    // An entry in the order of recent use.
+    typedef std::pair<std::string, values_type> entry_type;
+    typedef std::list<entry_type> entries_type;
+    typedef std::unordered_map<std::string, typename entries_type::iterator> map_type;
+
+    struct shard_type
+    {
+        std::mutex      mutex;
+        // The entries from the most recently used one.
+        entries_type    entries;
+        map_type        map;
+        // The estimated memory usage in bytes.
+        size_t          used;
+
+        shard_type() : used(0)
+        {
+        }
+    };
+
+    shard_type m_shards[NUM_SHARDS];
+    size_t m_budget;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+
+public:
+    /**
+     * Constructs a cache.
+     *  @param  budget      The memory budget in bytes. Zero disables the
+     *                      cache.
+     */
+    explicit result_cache(size_t budget = 0)
+        : m_budget(budget), m_hits(0), m_misses(0)
+    {
+    }
+
+    /**
+     * Destructs the cache.
+     */
+    virtual ~result_cache()
+    {
+    }
+
+    /**
+     * Checks whether the cache is enabled.
+     *  @return bool        \c true if the memory budget is not zero.
+     */
+    bool enabled() const
+    {
+        return (m_budget != 0);
+    }
+
+    /**
+     * Changes the memory budget.
+     *  This function clears the cache, and must not be called while other
+     *  threads access the cache.
+     *  @param  budget      The memory budget in bytes. Zero disables the
+     *                      cache.
+     */
+    void set_budget(size_t budget)
+    {
+        clear();
+        m_budget = budget;
+    }
+
+    /**
+     * Returns the memory budget.
+     *  @return size_t      The memory budget in bytes.
+     */
+    size_t budget() const
+    {
+        return m_budget;
+    }
+
+    /**
+     * Removes all the entries and resets the counters.
+     */
+    void clear()
+    {
+        for (int i = 0;i < NUM_SHARDS;++i) {
+            shard_type& shard = m_shards[i];
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.entries.clear();
+            shard.map.clear();
+            shard.used = 0;
+        }
+        m_hits = 0;
+        m_misses = 0;
+    }
+
+    /**
+     * Looks up an entry.
+     *  @param  key         The key.
+     *  @param  values      The array receiving the values of the entry.
+     *  @return bool        \c true if the entry is found.
+     */
+    bool find(const std::string& key, values_type& values)
+    {
+        shard_type& shard = get_shard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        typename map_type::iterator it = shard.map.find(key);
+        if (it == shard.map.end()) {
+            ++m_misses;
+            return false;
+        }
+
+        // Move the entry to the front.
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        values = it->second->second;
+        ++m_hits;
+        return true;
+    }
+
+    /**
+     * Inserts an entry.
+     *  An entry larger than the share of a shard is not stored.
+     *  @param  key         The key.
+     *  @param  values      The values of the entry.
+     */
+    void insert(const std::string& key, const values_type& values)
+    {
+        const size_t size = entry_size(key, values);
+        const size_t share = m_budget / NUM_SHARDS;
+        if (share < size) {
+            return;
+        }
+
+        shard_type& shard = get_shard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.map.find(key) != shard.map.end()) {
+            // Another thread has stored the same entry.
+            return;
+        }
+
+        // Evict the least recently used entries.
+        while (!shard.entries.empty() && share < shard.used + size) {
+            const entry_type& e = shard.entries.back();
+            shard.used -= entry_size(e.first, e.second);
+            shard.map.erase(e.first);
+            shard.entries.pop_back();
+        }
+
+        shard.entries.push_front(entry_type(key, values));
+        shard.map[key] = shard.entries.begin();
+        shard.used += size;
+    }
+
+    /**
+     * Returns the number of lookups that found entries.
+     */
+    uint64_t hits() const
+    {
+        return m_hits;
+    }
+
+    /**
+     * Returns the number of lookups that did not find entries.
+     */
+    uint64_t misses() const
+    {
+        return m_misses;
+    }
+
+protected:
+    shard_type& get_shard(const std::string& key)
+    {
+        return m_shards[std::hash<std::string>()(key) % NUM_SHARDS];
+    }
+
+    static size_t entry_size(const std::string& key, const values_type& values)
+    {
+        // The key is stored in the list node and the map node, which
+        // are counted with a few pointers each.
+        return
+            2 * (sizeof(std::string) + key.size()) +
+            sizeof(values_type) + sizeof(value_type) * values.size() +
+            8 * sizeof(void*);
+    }
+};
+
+};
+
+#endif/*__SIMSTRING_CACHE_H__*/
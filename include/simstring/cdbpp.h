@@ -33,6 +33,7 @@
 #ifndef __CDBPP_H__
 #define __CDBPP_H__
 
+#include <algorithm>
 #include <cstring>
 #include <fstream>
 #include <functional>
@@ -55,6 +56,10 @@ namespace cdbpp
 enum {
     // Version number.
     CDBPP_VERSION = 1,
+    // Version number of a database with 64-bit offsets.
+    CDBPP_VERSION_LARGE = 2,
+    // Version number of a database with keys inlined in buckets.
+    CDBPP_VERSION_INLINE = 3,
     // The number of hash tables.
     NUM_TABLES = 256,
     // A constant for byte-order checking.
@@ -155,6 +160,46 @@ static uint32_t get_data_begin()
     return (16 + sizeof(tableref_t) * NUM_TABLES);
 }
 
+/*
+ * A database whose size exceeds 4 GB is written in version 2 with 64-bit
+ * offsets. The header keeps the size of version 1 (so that records start
+ * at the same position), but the region of the table references stores:
+ *
+ *      uint64_t    The size of the chunk.
+ *      uint64_t    Offset to the first hash table.
+ *      uint32_t    Number of elements in each hash table [NUM_TABLES].
+ *
+ * The hash tables are stored contiguously in this order, and each bucket
+ * consists of the hash value and the lower and upper halves of the offset
+ * to the record (12 bytes). The chunk-size field of version 1 is zero.
+ *
+ * Version 3 has the same header, but its hash tables start at a 64-byte
+ * boundary (so that no bucket straddles cache lines) and each bucket
+ * (32 bytes) also stores the size of the key, the
+ * key itself if it is not longer than INLINE_KEY_SIZE, and the size of the
+ * value. A look-up of a short key compares the key in the bucket and
+ * computes the position of the value without reading the record.
+ */
+enum {
+    // The size of a bucket in version 2.
+    BUCKET_SIZE_LARGE = 12,
+    // The size of a bucket in version 3.
+    BUCKET_SIZE_INLINE = 32,
+    // The maximum size of keys stored in buckets in version 3.
+    INLINE_KEY_SIZE = 12,
+    // The number of keys whose buckets get_many() prefetches at a time.
+    PREFETCH_BATCH = 16,
+};
+
+#if     defined(__GNUC__)
+#define CDBPP_PREFETCH(p)   __builtin_prefetch(p)
+#elif   defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define CDBPP_PREFETCH(p)   _mm_prefetch(reinterpret_cast<const char*>(p), _MM_HINT_T0)
+#else
+#define CDBPP_PREFETCH(p)
+#endif
+
 
 
 /**
@@ -182,13 +227,16 @@ protected:
     struct bucket
     {
         uint32_t    hash;       // Hash value of the record.
-        uint32_t    offset;     // Offset address to the actual record.
+        uint64_t    offset;     // Offset address to the actual record.
+        uint32_t    ksize;      // Size of the key (version 3).
+        uint32_t    vsize;      // Size of the value (version 3).
+        uint8_t     key[INLINE_KEY_SIZE];   // Short key (version 3).
 
-        bucket() : hash(0), offset(0)
+        bucket() : hash(0), offset(0), ksize(0), vsize(0), key()
         {
         }
 
-        bucket(uint32_t h, uint32_t o) : hash(h), offset(o)
+        bucket(uint32_t h, uint64_t o) : hash(h), offset(o), ksize(0), vsize(0), key()
         {
         }
     };
@@ -198,9 +246,10 @@ protected:
 
 protected:
     std::ofstream&  m_os;               // Output stream.
-    uint32_t        m_begin;
-    uint32_t        m_cur;
+    uint64_t        m_begin;
+    uint64_t        m_cur;
     hashtable       m_ht[NUM_TABLES];   // Hash tables.
+    bool            m_inline;           // Whether to write version 3.
 
 public:
     /**
@@ -208,10 +257,15 @@ public:
      *  @param  os          The output stream to which this class write the
      *                      database. This stream must be opened in the
      *                      binary mode (\c std::ios_base::binary).
+     *  @param  inline_keys If this is set to \c true, this class writes
+     *                      the database in version 3 storing short keys in
+     *                      the hash tables, which speeds up look-ups but
+     *                      older readers cannot read.
      */
-    builder_base(std::ofstream& os) : m_os(os)
+    builder_base(std::ofstream& os, bool inline_keys = false)
+        : m_os(os), m_inline(inline_keys)
     {
-        m_begin = (uint32_t)m_os.tellp();
+        m_begin = (uint64_t)(std::streamoff)m_os.tellp();
         m_cur = get_data_begin();
         m_os.seekp(m_begin + m_cur);
     }
@@ -248,6 +302,14 @@ public:
 
         // Store the hash value and offset to the hash table.
         ht.push_back(bucket(hv, m_cur));
+        if (m_inline) {
+            bucket& b = ht.back();
+            b.ksize = (uint32_t)ksize;
+            b.vsize = (uint32_t)vsize;
+            if (ksize <= INLINE_KEY_SIZE) {
+                std::memcpy(b.key, key, ksize);
+            }
+        }
 
         // Increment the current position.
         m_cur += sizeof(uint32_t) + ksize + sizeof(uint32_t) + vsize;
@@ -257,10 +319,21 @@ protected:
     void close()
     {
         // Check the consistency of the stream offset.
-        if (m_begin + m_cur != (uint32_t)m_os.tellp()) {
+        if (m_begin + m_cur != (uint64_t)(std::streamoff)m_os.tellp()) {
             throw builder_exception("Inconsistent stream offset");
         }
 
+        // Use 64-bit offsets only when the chunk does not fit in 4 GB, so
+        // that smaller databases remain readable by older readers.
+        uint64_t total = m_cur;
+        for (size_t i = 0;i < NUM_TABLES;++i) {
+            total += sizeof(uint32_t) * 2 * m_ht[i].size() * 2;
+        }
+        if (m_inline || 0xFFFFFFFF < total) {
+            close_large();
+            return;
+        }
+
         // Store the hash tables. At this moment, the file pointer refers to
         // the offset succeeding the last key/value pair.
         for (size_t i = 0;i < NUM_TABLES;++i) {
@@ -293,7 +366,7 @@ protected:
                 // Write out the new table.
                 for (int k = 0;k < n;++k) {
                     write_uint32(dst[k].hash);
-                    write_uint32(dst[k].offset);
+                    write_uint32((uint32_t)dst[k].offset);
                 }
 
                 // Free the table.
@@ -302,7 +375,7 @@ protected:
         }
 
         // Store the current position.
-        uint32_t offset = (uint32_t)m_os.tellp();
+        std::streamoff offset = (std::streamoff)m_os.tellp();
 
         // Rewind the stream position to the beginning.
         m_os.seekp(m_begin);
@@ -310,7 +383,7 @@ protected:
         // Write the file header.
         char chunkid[4] = {'C','D','B','+'};
         m_os.write(chunkid, 4);
-        write_uint32(offset - m_begin);
+        write_uint32((uint32_t)(offset - m_begin));
         write_uint32(CDBPP_VERSION);
         write_uint32(BYTEORDER_CHECK);
 
@@ -318,7 +391,7 @@ protected:
         // to the offset succeeding the last key/data pair. 
         for (size_t i = 0;i < NUM_TABLES;++i) {
             // Offset to the hash table (or zero for non-existent tables).
-            write_uint32(m_ht[i].empty() ? 0 : m_cur);
+            write_uint32(m_ht[i].empty() ? 0 : (uint32_t)m_cur);
             // Bucket size is double to the number of elements.
             write_uint32(m_ht[i].size() * 2);
             // Advance the offset counter.
@@ -329,10 +402,77 @@ protected:
         m_os.seekp(offset);
     }
 
+    void close_large()
+    {
+        // The hash tables follow the last key/value pair.
+        if (m_inline) {
+            while (m_cur % 64 != 0) {
+                m_os.put(0);
+                ++m_cur;
+            }
+        }
+        const uint64_t tables = m_cur;
+        for (size_t i = 0;i < NUM_TABLES;++i) {
+            hashtable& ht = m_ht[i];
+            if (!ht.empty()) {
+                size_t n = ht.size() * 2;
+                std::vector<bucket> dst(n);
+
+                typename hashtable::const_iterator it;
+                for (it = ht.begin();it != ht.end();++it) {
+                    size_t k = (it->hash >> 8) % n;
+                    while (dst[k].offset != 0) {
+                        k = (k+1) % n;
+                    }
+                    dst[k] = *it;
+                }
+
+                for (size_t k = 0;k < n;++k) {
+                    write_uint32(dst[k].hash);
+                    if (m_inline) {
+                        write_uint32(dst[k].ksize);
+                        m_os.write(reinterpret_cast<const char*>(dst[k].key), INLINE_KEY_SIZE);
+                        write_uint32(dst[k].vsize);
+                    }
+                    write_uint32((uint32_t)dst[k].offset);
+                    write_uint32((uint32_t)(dst[k].offset >> 32));
+                }
+                m_cur += (m_inline ? BUCKET_SIZE_INLINE : BUCKET_SIZE_LARGE) * n;
+            }
+        }
+
+        std::streamoff offset = (std::streamoff)m_os.tellp();
+
+        // Write the file header.
+        m_os.seekp(m_begin);
+        char chunkid[4] = {'C','D','B','+'};
+        m_os.write(chunkid, 4);
+        write_uint32(0);
+        write_uint32(m_inline ? CDBPP_VERSION_INLINE : CDBPP_VERSION_LARGE);
+        write_uint32(BYTEORDER_CHECK);
+        write_uint64(m_cur);
+        write_uint64(tables);
+        for (size_t i = 0;i < NUM_TABLES;++i) {
+            write_uint32(m_ht[i].size() * 2);
+        }
+
+        // Clear the remaining region of the header.
+        std::vector<char> zero(
+            sizeof(tableref_t) * NUM_TABLES - 16 - sizeof(uint32_t) * NUM_TABLES);
+        m_os.write(&zero[0], zero.size());
+
+        m_os.seekp(offset);
+    }
+
     inline void write_uint32(uint32_t value)
     {
         m_os.write(reinterpret_cast<const char *>(&value), sizeof(value));
     }
+
+    inline void write_uint64(uint64_t value)
+    {
+        m_os.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
 };
 
 
@@ -360,13 +500,72 @@ protected:
     {
         uint32_t    hash;           // Hash value of the record.
         uint32_t    offset;         // Offset address to the actual record.
+
+        uint64_t get_offset() const
+        {
+            return offset;
+        }
+
+        const uint8_t* match(
+            const uint8_t* buffer, const void *key, size_t ksize, size_t* vsize) const
+        {
+            return match_record(buffer + offset, key, ksize, vsize);
+        }
     };
 
+    // A bucket of version 2.
+    struct bucket_large_t
+    {
+        uint32_t    hash;           // Hash value of the record.
+        uint32_t    offset[2];      // Lower and upper halves of the offset.
+
+        uint64_t get_offset() const
+        {
+            return (uint64_t)offset[0] | ((uint64_t)offset[1] << 32);
+        }
+
+        const uint8_t* match(
+            const uint8_t* buffer, const void *key, size_t ksize, size_t* vsize) const
+        {
+            return match_record(buffer + get_offset(), key, ksize, vsize);
+        }
+    };
+
+    // A bucket of version 3.
+    struct bucket_inline_t
+    {
+        uint32_t    hash;           // Hash value of the record.
+        uint32_t    ksize;          // Size of the key.
+        uint8_t     key[INLINE_KEY_SIZE];   // Key if it is short enough.
+        uint32_t    vsize;          // Size of the value.
+        uint32_t    offset[2];      // Lower and upper halves of the offset.
+
+        uint64_t get_offset() const
+        {
+            return (uint64_t)offset[0] | ((uint64_t)offset[1] << 32);
+        }
+
+        const uint8_t* match(
+            const uint8_t* buffer, const void *key, size_t ksize, size_t* vsize) const
+        {
+            if (this->ksize != ksize) {
+                return NULL;
+            }
+            const uint8_t* q = buffer + get_offset() + sizeof(uint32_t);
+            if (memcmp(key, ksize <= INLINE_KEY_SIZE ? this->key : q, ksize) != 0) {
+                return NULL;
+            }
+            if (vsize != NULL) {
+                *vsize = this->vsize;
+            }
+            return q + ksize + sizeof(uint32_t);
+        }
+    };
 
     struct hashtable_t
     {
         uint32_t        num;            // Number of elements in the table.
-        const bucket_t* buckets;        // Buckets (array of bucket).
+        const void*     buckets;        // Buckets (array of bucket).
     };
 
 
@@ -377,13 +576,14 @@ protected:
 
     hashtable_t     m_ht[NUM_TABLES];   // Hash tables.
     size_t          m_n;
+    uint32_t        m_version;          // Version of the format.
 
 public:
     /**
      * Constructs an object.
      */
     cdbpp_base()
-        : m_buffer(NULL), m_size(0), m_own(false), m_n(0)
+        : m_buffer(NULL), m_size(0), m_own(false), m_n(0), m_version(0)
     {
     }
 
@@ -395,7 +595,7 @@ public:
      *                      delete[] when the database is closed.
      */
     cdbpp_base(const void *buffer, size_t size, bool own)
-        : m_buffer(NULL), m_size(0), m_own(false), m_n(0)
+        : m_buffer(NULL), m_size(0), m_own(false), m_n(0), m_version(0)
     {
         this->open(buffer, size, own);
     }
@@ -406,7 +606,7 @@ public:
      *                      a database.
      */
     cdbpp_base(std::ifstream& ifs)
-        : m_buffer(NULL), m_size(0), m_own(false), m_n(0)
+        : m_buffer(NULL), m_size(0), m_own(false), m_n(0), m_version(0)
     {
         this->open(ifs);
     }
@@ -476,8 +676,18 @@ public:
                 break;
             }
 
+            // Read the 64-bit size of a large chunk.
+            uint64_t chunk_size = read_uint32(reinterpret_cast<uint8_t*>(size));
+            if (chunk_size == 0) {
+                char header[16];
+                ifs.read(header, 16);
+                if (ifs.fail()) {
+                    break;
+                }
+                chunk_size = *reinterpret_cast<const uint64_t*>(header + 8);
+            }
+
             // Allocate a memory block for the chunk.
-            uint32_t chunk_size = read_uint32(reinterpret_cast<uint8_t*>(size));
             uint8_t* block = new uint8_t[chunk_size];
 
             // Read the memory image from the stream.
@@ -521,7 +731,7 @@ public:
         p += 4;
 
         // Read the chunk header.
-        uint32_t csize = read_uint32(p);
+        uint64_t csize = read_uint32(p);
         p += sizeof(uint32_t);
         uint32_t version = read_uint32(p);
         p += sizeof(uint32_t);
@@ -533,9 +743,19 @@ public:
             throw cdbpp_exception("Inconsistent byte order");
         }
         // Check the version number.
-        if (version != CDBPP_VERSION) {
+        if (version != CDBPP_VERSION &&
+            version != CDBPP_VERSION_LARGE &&
+            version != CDBPP_VERSION_INLINE) {
             throw cdbpp_exception("Incompatible CDB++ versions");
         }
+        m_version = version;
+        uint64_t tables = 0;
+        if (version != CDBPP_VERSION) {
+            csize = read_uint64(p);
+            p += sizeof(uint64_t);
+            tables = read_uint64(p);
+            p += sizeof(uint64_t);
+        }
         // Check the chunk size.
         if (size < csize) {
             throw cdbpp_exception("The memory image is smaller than a chunk size.");
@@ -548,11 +768,24 @@ public:
 
         // Set pointers to the hash tables.
         m_n = 0;
+        if (version != CDBPP_VERSION) {
+            const uint64_t bucket_size = (version == CDBPP_VERSION_INLINE) ?
+                BUCKET_SIZE_INLINE : BUCKET_SIZE_LARGE;
+            const uint32_t* num = reinterpret_cast<const uint32_t*>(p);
+            for (size_t i = 0;i < NUM_TABLES;++i) {
+                m_ht[i].buckets = num[i] ? m_buffer + tables : NULL;
+                m_ht[i].num = num[i];
+                tables += bucket_size * num[i];
+                m_n += (num[i] / 2);
+            }
+            return (size_t)csize;
+        }
+
         const tableref_t* ref = reinterpret_cast<const tableref_t*>(p);
         for (size_t i = 0;i < NUM_TABLES;++i) {
             if (ref[i].offset) {
                 // Set the buckets.
-                m_ht[i].buckets = reinterpret_cast<const bucket_t*>(m_buffer + ref[i].offset);
+                m_ht[i].buckets = m_buffer + ref[i].offset;
                 m_ht[i].num = ref[i].num;
             } else {
                 // An empty hash table.
@@ -578,6 +811,7 @@ public:
         m_buffer = NULL;
         m_size = 0;
         m_n = 0;
+        m_version = 0;
     }
 
     /**
@@ -591,23 +825,79 @@ public:
     const void* get(const void *key, size_t ksize, size_t* vsize) const
     {
         uint32_t hv = hash_function()(key, ksize);
+        switch (m_version) {
+        case CDBPP_VERSION_LARGE:
+            return find<bucket_large_t>(hv, key, ksize, vsize);
+        case CDBPP_VERSION_INLINE:
+            return find<bucket_inline_t>(hv, key, ksize, vsize);
+        default:
+            return find<bucket_t>(hv, key, ksize, vsize);
+        }
+    }
+
+    /**
+     * Finds multiple keys in the database.
+     *  This function processes the keys in stages: it prefetches the
+     *  buckets of all the keys, then prefetches the records (or values) of
+     *  the buckets with matching hash values, and finally compares the
+     *  keys. The cache misses for different keys thus overlap with each
+     *  other instead of being serialized.
+     *  @param  n           The number of the keys.
+     *  @param  keys        The pointers to the keys.
+     *  @param  ksizes      The sizes of the keys.
+     *  @param  values      The array receiving the pointers to the values
+     *                      (or \c NULL for the keys not found).
+     *  @param  vsizes      The array receiving the sizes of the values.
+     */
+    void get_many(
+        size_t n,
+        const void* const* keys,
+        const size_t* ksizes,
+        const void** values,
+        size_t* vsizes
+        ) const
+    {
+        switch (m_version) {
+        case CDBPP_VERSION_LARGE:
+            find_many<bucket_large_t>(n, keys, ksizes, values, vsizes);
+            break;
+        case CDBPP_VERSION_INLINE:
+            find_many<bucket_inline_t>(n, keys, ksizes, values, vsizes);
+            break;
+        default:
+            find_many<bucket_t>(n, keys, ksizes, values, vsizes);
+            break;
+        }
+    }
+
+protected:
+    template <class bucket_type>
+    const bucket_type* first_bucket(uint32_t hv) const
+    {
+        const hashtable_t* ht = &m_ht[hv % NUM_TABLES];
+        if (!ht->num || ht->buckets == NULL) {
+            return NULL;
+        }
+        return reinterpret_cast<const bucket_type*>(ht->buckets) + (hv >> 8) % ht->num;
+    }
+
+    template <class bucket_type>
+    const void* find(uint32_t hv, const void *key, size_t ksize, size_t* vsize) const
+    {
         const hashtable_t* ht = &m_ht[hv % NUM_TABLES];
 
         if (ht->num && ht->buckets != NULL) {
+            const bucket_type* buckets =
+                reinterpret_cast<const bucket_type*>(ht->buckets);
             int n = ht->num;
             int k = (hv >> 8) % n;
-            const bucket_t* p = NULL;
+            const bucket_type* p = NULL;
 
-            while (p = &ht->buckets[k], p->offset) {
+            while (p = &buckets[k], p->get_offset()) {
                 if (p->hash == hv) {
-                    const uint8_t *q = m_buffer + p->offset;
-                    if (read_uint32(q) == ksize &&
-                        memcmp(key, q + sizeof(uint32_t), ksize) == 0) {
-                        q += sizeof(uint32_t) + ksize;
-                        if (vsize != NULL) {
-                            *vsize = read_uint32(q);
-                        }
-                        return q + sizeof(uint32_t);
+                    const uint8_t *q = p->match(m_buffer, key, ksize, vsize);
+                    if (q != NULL) {
+                        return q;
                     }
                 }
                 k = (k+1) % n;
@@ -620,11 +910,65 @@ public:
         return NULL;
     }
 
-protected:
+    template <class bucket_type>
+    void find_many(
+        size_t n,
+        const void* const* keys,
+        const size_t* ksizes,
+        const void** values,
+        size_t* vsizes
+        ) const
+    {
+        uint32_t hvs[PREFETCH_BATCH];
+        for (size_t i = 0;i < n;i += PREFETCH_BATCH) {
+            const size_t m = std::min(n - i, (size_t)PREFETCH_BATCH);
+            for (size_t j = 0;j < m;++j) {
+                hvs[j] = hash_function()(keys[i+j], ksizes[i+j]);
+                CDBPP_PREFETCH(first_bucket<bucket_type>(hvs[j]));
+            }
+            for (size_t j = 0;j < m;++j) {
+                const bucket_type* p = first_bucket<bucket_type>(hvs[j]);
+                if (p != NULL) {
+                    const bucket_type* last =
+                        reinterpret_cast<const bucket_type*>(m_ht[hvs[j] % NUM_TABLES].buckets) +
+                        m_ht[hvs[j] % NUM_TABLES].num;
+                    while (p->get_offset() && p->hash != hvs[j] && ++p != last) {
+                    }
+                    if (p != last && p->get_offset()) {
+                        CDBPP_PREFETCH(m_buffer + p->get_offset());
+                    }
+                }
+            }
+            for (size_t j = 0;j < m;++j) {
+                values[i+j] = find<bucket_type>(
+                    hvs[j], keys[i+j], ksizes[i+j], &vsizes[i+j]);
+            }
+        }
+    }
+
+    static const uint8_t* match_record(
+        const uint8_t* q, const void *key, size_t ksize, size_t* vsize)
+    {
+        if (*reinterpret_cast<const uint32_t*>(q) == ksize &&
+            memcmp(key, q + sizeof(uint32_t), ksize) == 0) {
+            q += sizeof(uint32_t) + ksize;
+            if (vsize != NULL) {
+                *vsize = *reinterpret_cast<const uint32_t*>(q);
+            }
+            return q + sizeof(uint32_t);
+        }
+        return NULL;
+    }
+
     inline uint32_t read_uint32(const uint8_t* p) const
     {
         return *reinterpret_cast<const uint32_t*>(p);
     }
+
+    inline uint64_t read_uint64(const uint8_t* p) const
+    {
+        return *reinterpret_cast<const uint64_t*>(p);
+    }
 };
 
 /// CDB++ builder with MurmurHash2.
@@ -650,7 +994,10 @@ between keys and their values. The database provides several features:
   Daniel J. Bernstein.
 - <b>Low footprint.</b> A CDB++ database consists of a chunk header (16 bytes),
   hash tables (2048 bytes and 16 bytes per record), and actual records (8 bytes
-  plus key/value size per record).
+  plus key/value size per record). A database larger than 4 GB uses 64-bit
+  offsets (24 bytes per record in the hash tables). Optionally, keys up to 12
+  bytes can be stored in the hash tables (64 bytes per record) so that a
+  look-up of a short key touches only the bucket and the value.
 - <b>Fast hash function.</b> CDB++ incorporates the fast and
   collision-resistant hash function for strings
   (<a href="http://murmurhash.googlepages.com/">MurmurHash 2.0</a>)
@@ -692,6 +1039,12 @@ CDB++ is distributed under the term of the
 <a href="http://www.opensource.org/licenses/bsd-license.php">modified BSD license</a>.
 
 @section changelog History
+- Version 1.2:
+    - Databases larger than 4 GB are written in format version 2 with 64-bit
+      offsets; smaller databases keep format version 1.
+    - Format version 3 storing short keys in the hash tables
+      (cdbpp::builder_base::builder_base with \c inline_keys).
+    - Added cdbpp::cdbpp_base::get_many() prefetching the buckets of keys.
 - Version 1.1 (2009-07-14):
     - Fixed a compile issue (a patch submitted by Takashi Imamichi).
     - Replaced SuperFastHash with MurmurHash 2.0 (a patch submitted by
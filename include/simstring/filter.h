@@ -0,0 +1,294 @@
+/*
+ *      N-gram filters.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_FILTER_H__
+#define __SIMSTRING_FILTER_H__
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+#if     defined(__GNUC__)
+#define SIMSTRING_FILTER_PREFETCH(p)    __builtin_prefetch(p)
+#elif   defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define SIMSTRING_FILTER_PREFETCH(p)    _mm_prefetch(reinterpret_cast<const char*>(p), _MM_HINT_T0)
+#else
+#define SIMSTRING_FILTER_PREFETCH(p)
+#endif
+
+namespace simstring {
+
+/**
+ * \addtogroup filter N-gram filters
+ * @{
+ *
+ *  An n-gram filter is a blocked Bloom filter over the n-grams of an
+ *  index. Every n-gram sets a few bits in one block of 64 bytes (a cache
+ *  line) chosen by its hash value, so that a test of an n-gram reads a
+ *  single cache line. A filter never rejects an n-gram in the index, and
+ *  accepts about one percent of the others.
+ *
+ *  The byte layout of a filter is:
+ *  - char[4]: the magic string "NGF1".
+ *  - uint32_t: the number of blocks (m).
+ *  - uint32_t: the number of bits set by an n-gram (k).
+ *  - blocks: (64 * m) bytes.
+ */
+
+/// The magic string of a filter.
+#define SIMSTRING_FILTER_MAGIC  "NGF1"
+
+enum {
+    /// The size of the header in bytes.
+    FILTER_HEADER_SIZE = 12,
+    /// The size of a block in bytes.
+    FILTER_BLOCK_SIZE = 64,
+    /// The number of bits per n-gram in a filter.
+    FILTER_BITS_PER_KEY = 12,
+    /// The number of bits set by an n-gram.
+    FILTER_NUM_PROBES = 6,
+};
+
+/**
+ * Computes the hash value of an n-gram for filters.
+ *  @param  key         The pointer to the n-gram.
+ *  @param  size        The size of the n-gram in bytes.
+ *  @return uint64_t    The hash value.
+ */
+inline uint64_t filter_hash(const void* key, size_t size)
+{
+    // FNV-1a followed by the finalizer of MurmurHash3.
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(key);
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0;i < size;++i) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Builds an n-gram filter.
+ */
+class ngram_filter_builder
+{
+protected:
+    std::vector<uint64_t> m_hashes;
+
+public:
+    /**
+     * Adds an n-gram to the filter.
+     *  @param  key         The pointer to the n-gram.
+     *  @param  size        The size of the n-gram in bytes.
+     */
+    void insert(const void* key, size_t size)
+    {
+        m_hashes.push_back(filter_hash(key, size));
+    }
+
+    /**
+     * Returns the number of n-grams added.
+     */
+    size_t size() const
+    {
+        return m_hashes.size();
+    }
+
+    /**
+     * Removes all the n-grams.
+     */
+    void clear()
+    {
+        m_hashes.clear();
+    }
+
+    /**
+     * Writes the filter.
+     *  @param  out         The buffer receiving the filter.
+     */
+    void build(std::vector<char>& out) const
+    {
+        const size_t bits = FILTER_BITS_PER_KEY * m_hashes.size();
+        const uint32_t m = (uint32_t)((bits + 8 * FILTER_BLOCK_SIZE - 1) / (8 * FILTER_BLOCK_SIZE));
+        const uint32_t num_blocks = (m == 0) ? 1 : m;
+        const uint32_t num_probes = FILTER_NUM_PROBES;
+
+        out.assign(FILTER_HEADER_SIZE + (size_t)FILTER_BLOCK_SIZE * num_blocks, 0);
+        std::memcpy(&out[0], SIMSTRING_FILTER_MAGIC, 4);
+        std::memcpy(&out[4], &num_blocks, sizeof(num_blocks));
+        std::memcpy(&out[8], &num_probes, sizeof(num_probes));
+
+        uint8_t* blocks = reinterpret_cast<uint8_t*>(&out[FILTER_HEADER_SIZE]);
+        std::vector<uint64_t>::const_iterator it;
+        for (it = m_hashes.begin();it != m_hashes.end();++it) {
+            uint8_t* block = blocks + FILTER_BLOCK_SIZE * select(*it, num_blocks);
+            uint32_t bit = (uint32_t)*it, step = ((uint32_t)*it >> 16) | 1;
+            for (uint32_t j = 0;j < num_probes;++j, bit += step) {
+                const uint32_t b = bit % (8 * FILTER_BLOCK_SIZE);
+                block[b >> 3] |= (uint8_t)(1 << (b & 7));
+            }
+        }
+    }
+
+    /**
+     * Chooses the block of a hash value.
+     *  @param  h           The hash value.
+     *  @param  num_blocks  The number of blocks.
+     *  @return uint32_t    The block.
+     */
+    static uint32_t select(uint64_t h, uint32_t num_blocks)
+    {
+        return (uint32_t)(((h >> 32) * num_blocks) >> 32);
+    }
+};
+
+/**
+ * An n-gram filter in a memory image.
+ */
+class ngram_filter
+{
+protected:
+    const uint8_t* m_blocks;
+    uint32_t m_num_blocks;
+    uint32_t m_num_probes;
+
+public:
+    /**
+     * Constructs an object.
+     */
+    ngram_filter() : m_blocks(NULL), m_num_blocks(0), m_num_probes(0)
+    {
+    }
+
+    /**
+     * Opens a filter.
+     *  @param  data        The pointer to the memory image of the filter.
+     *  @param  size        The size of the memory image.
+     *  @return bool        \c false if the image is not a filter.
+     */
+    bool open(const void* data, size_t size)
+    {
+        const char* p = reinterpret_cast<const char*>(data);
+        close();
+        if (p == NULL || size < FILTER_HEADER_SIZE ||
+            std::memcmp(p, SIMSTRING_FILTER_MAGIC, 4) != 0) {
+            return false;
+        }
+        uint32_t num_blocks, num_probes;
+        std::memcpy(&num_blocks, p + 4, sizeof(num_blocks));
+        std::memcpy(&num_probes, p + 8, sizeof(num_probes));
+        if (num_blocks == 0 || num_probes == 0 ||
+            size != FILTER_HEADER_SIZE + (size_t)FILTER_BLOCK_SIZE * num_blocks) {
+            return false;
+        }
+        m_blocks = reinterpret_cast<const uint8_t*>(p + FILTER_HEADER_SIZE);
+        m_num_blocks = num_blocks;
+        m_num_probes = num_probes;
+        return true;
+    }
+
+    /**
+     * Closes the filter.
+     */
+    void close()
+    {
+        m_blocks = NULL;
+        m_num_blocks = 0;
+        m_num_probes = 0;
+    }
+
+    /**
+     * Checks whether the filter is open.
+     */
+    bool is_open() const
+    {
+        return m_blocks != NULL;
+    }
+
+    /**
+     * Prefetches the block of an n-gram, so that the tests of n-grams
+     *  overlap their memory accesses.
+     *  @param  h           The hash value of the n-gram (filter_hash()).
+     */
+    void prefetch(uint64_t h) const
+    {
+        SIMSTRING_FILTER_PREFETCH(block(h));
+    }
+
+    /**
+     * Tests an n-gram.
+     *  @param  h           The hash value of the n-gram (filter_hash()).
+     *  @return bool        \c false if the n-gram is not in the index.
+     */
+    bool contains(uint64_t h) const
+    {
+        const uint8_t* block = this->block(h);
+        uint32_t bit = (uint32_t)h, step = ((uint32_t)h >> 16) | 1;
+        for (uint32_t j = 0;j < m_num_probes;++j, bit += step) {
+            const uint32_t b = bit % (8 * FILTER_BLOCK_SIZE);
+            if (!(block[b >> 3] & (1 << (b & 7)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Tests an n-gram.
+     *  @param  key         The pointer to the n-gram.
+     *  @param  size        The size of the n-gram in bytes.
+     *  @return bool        \c false if the n-gram is not in the index.
+     */
+    bool contains(const void* key, size_t size) const
+    {
+        return contains(filter_hash(key, size));
+    }
+
+protected:
+    const uint8_t* block(uint64_t h) const
+    {
+        return m_blocks +
+            FILTER_BLOCK_SIZE * ngram_filter_builder::select(h, m_num_blocks);
+    }
+};
+
+/** @} */
+
+};
+
+#endif/*__SIMSTRING_FILTER_H__*/
@@ -0,0 +1,237 @@
+/*
+ *      Search kernels for sorted posting lists.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_INTERSECT_H__
+#define __SIMSTRING_INTERSECT_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstddef>
+
+#if     defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMSTRING_SSE2
+#include <emmintrin.h>
+#if     defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMSTRING_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#elif   defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SIMSTRING_NEON
+#include <arm_neon.h>
+#endif
+
+namespace simstring { namespace simd {
+
+/**
+ * \addtogroup intersect Search kernels for posting lists
+ * @{
+ *
+ *  Posting lists are sorted arrays of SIDs. The functions in this group
+ *  search them with galloping (exponential) search, and scan the final
+ *  window with SIMD instructions: SSE2 on x86 (with AVX2 selected at run
+ *  time when the compiler supports function multi-versioning), and NEON
+ *  on ARM.
+ */
+
+/// Windows no longer than this are scanned linearly instead of bisected.
+enum { SCAN_WINDOW = 32 };
+
+/**
+ * Counts the elements smaller than a value (portable implementation).
+ *  @param  p       The pointer to the elements.
+ *  @param  n       The number of the elements.
+ *  @param  v       The value.
+ *  @return size_t  The number of elements smaller than \c v.
+ */
+inline size_t count_less_generic(const uint32_t* p, size_t n, uint32_t v)
+{
+    size_t c = 0;
+    for (size_t i = 0;i < n;++i) {
+        c += (p[i] < v);
+    }
+    return c;
+}
+
+#if     defined(SIMSTRING_SSE2)
+
+inline size_t count_less_sse2(const uint32_t* p, size_t n, uint32_t v)
+{
+    // SSE2 has signed comparisons only; flip the sign bits.
+    const __m128i bias = _mm_set1_epi32((int)0x80000000);
+    const __m128i key = _mm_xor_si128(_mm_set1_epi32((int)v), bias);
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (;i + 4 <= n;i += 4) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        // Every lane smaller than the key is -1.
+        acc = _mm_sub_epi32(acc, _mm_cmplt_epi32(_mm_xor_si128(x, bias), key));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (size_t)_mm_cvtsi128_si32(acc) + count_less_generic(p + i, n - i, v);
+}
+
+#if     defined(SIMSTRING_AVX2_DISPATCH)
+
+__attribute__((target("avx2")))
+inline size_t count_less_avx2(const uint32_t* p, size_t n, uint32_t v)
+{
+    const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+    const __m256i key = _mm256_xor_si256(_mm256_set1_epi32((int)v), bias);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (;i + 8 <= n;i += 8) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        acc = _mm256_sub_epi32(acc, _mm256_cmpgt_epi32(key, _mm256_xor_si256(x, bias)));
+    }
+    __m128i s = _mm_add_epi32(
+        _mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (size_t)_mm_cvtsi128_si32(s) + count_less_sse2(p + i, n - i, v);
+}
+
+#endif/*SIMSTRING_AVX2_DISPATCH*/
+
+#elif   defined(SIMSTRING_NEON)
+
+inline size_t count_less_neon(const uint32_t* p, size_t n, uint32_t v)
+{
+    const uint32x4_t key = vdupq_n_u32(v);
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i = 0;
+    for (;i + 4 <= n;i += 4) {
+        // Every lane smaller than the key is 0xFFFFFFFF.
+        acc = vsubq_u32(acc, vcltq_u32(vld1q_u32(p + i), key));
+    }
+    uint32_t lanes[4];
+    vst1q_u32(lanes, acc);
+    return (size_t)(lanes[0] + lanes[1] + lanes[2] + lanes[3]) +
+        count_less_generic(p + i, n - i, v);
+}
+
+#endif
+
+/// The type of a function counting the elements smaller than a value.
+typedef size_t (*count_less_type)(const uint32_t*, size_t, uint32_t);
+
+/**
+ * Chooses the fastest implementation of count_less() for the processor.
+ */
+inline count_less_type select_count_less()
+{
+#if     defined(SIMSTRING_AVX2_DISPATCH)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return count_less_avx2;
+    }
+    return count_less_sse2;
+#elif   defined(SIMSTRING_SSE2)
+    return count_less_sse2;
+#elif   defined(SIMSTRING_NEON)
+    return count_less_neon;
+#else
+    return count_less_generic;
+#endif
+}
+
+/**
+ * Counts the elements smaller than a value.
+ *  @param  p       The pointer to the elements.
+ *  @param  n       The number of the elements.
+ *  @param  v       The value.
+ *  @return size_t  The number of elements smaller than \c v.
+ */
+inline size_t count_less(const uint32_t* p, size_t n, uint32_t v)
+{
+    static const count_less_type func = select_count_less();
+    return func(p, n, v);
+}
+
+/**
+ * Finds the first element not smaller than a value with galloping search.
+ *  The search starts from the beginning of the range and doubles its step
+ *  until it passes the value, so the cost is logarithmic in the distance
+ *  to the result rather than in the length of the range. Scanning sorted
+ *  values in ascending order with this function therefore touches only
+ *  the neighborhood of each result.
+ *  @param  first   The beginning of the sorted range.
+ *  @param  last    The end of the sorted range.
+ *  @param  v       The value.
+ *  @return         The pointer to the first element not smaller than
+ *                  \c v, or \c last if no such element exists.
+ */
+inline const uint32_t* lower_bound(
+    const uint32_t* first, const uint32_t* last, uint32_t v)
+{
+    const size_t n = (size_t)(last - first);
+    if (n == 0 || v <= first[0]) {
+        return first;
+    }
+
+    // Gallop; first[lo] < v holds in the loop.
+    size_t lo = 0, step = 1;
+    while (lo + step < n && first[lo + step] < v) {
+        lo += step;
+        step <<= 1;
+    }
+    size_t hi = std::min(lo + step, n);
+
+    // Bisect (lo, hi] until the window is short.
+    while (SCAN_WINDOW < hi - lo) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (first[mid] < v) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Scan the window.
+    return first + lo + 1 + count_less(first + lo + 1, hi - lo - 1, v);
+}
+
+/**
+ * Finds the first element not smaller than a value (generic types).
+ */
+template <class value_type>
+inline const value_type* lower_bound(
+    const value_type* first, const value_type* last, const value_type& v)
+{
+    return std::lower_bound(first, last, v);
+}
+
+/** @} */
+
+}; };
+
+#endif/*__SIMSTRING_INTERSECT_H__*/
@@ -57,6 +57,11 @@ struct exact
     {
         return qsize;
     }
+
+    inline static double score(int qsize, int rsize, int match)
+    {
+        return (qsize == rsize && match == qsize) ? 1. : 0.;
+    }
 };
 
 /**
@@ -78,6 +83,11 @@ struct dice
     {
         return (int)std::ceil(0.5 * alpha * (qsize + rsize));
     }
+
+    inline static double score(int qsize, int rsize, int match)
+    {
+        return 2. * match / (qsize + rsize);
+    }
 };
 
 /**
@@ -99,6 +109,11 @@ struct cosine
     {
         return (int)std::ceil(alpha * std::sqrt((double)qsize * rsize));
     }
+
+    inline static double score(int qsize, int rsize, int match)
+    {
+        return match / std::sqrt((double)qsize * rsize);
+    }
 };
 
 /**
@@ -120,6 +135,11 @@ struct jaccard
     {
         return (int)std::ceil(alpha * (qsize + rsize) / (1 + alpha));
     }
+
+    inline static double score(int qsize, int rsize, int match)
+    {
+        return (double)match / (qsize + rsize - match);
+    }
 };
 
 /**
@@ -141,6 +161,11 @@ struct overlap
     {
         return (int)std::ceil(alpha * std::min(qsize, rsize));
     }
+
+    inline static double score(int qsize, int rsize, int match)
+    {
+        return (double)match / std::min(qsize, rsize);
+    }
 };
 
 }; };
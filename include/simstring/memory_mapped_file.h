@@ -41,10 +41,29 @@ class memory_mapped_file_base
 public:
     typedef size_t size_type;
 
+    /// Hints on the use of the mapped memory.
+    enum {
+        /// The memory is accessed randomly; the system does not read
+        /// ahead (MADV_RANDOM).
+        advise_random = 0x0001,
+        /// The memory will be accessed soon; the system reads it ahead in
+        /// the background (MADV_WILLNEED, PrefetchVirtualMemory).
+        advise_willneed = 0x0002,
+        /// The memory is loaded before the mapping is used (MAP_POPULATE).
+        advise_populate = 0x0004,
+        /// Huge pages back the memory where the system supports them for
+        /// mapped files (MADV_HUGEPAGE).
+        advise_hugepage = 0x0008,
+        /// The memory is locked in RAM (mlock, VirtualLock).
+        advise_lock = 0x0010,
+    };
+
     memory_mapped_file_base() {}
     virtual ~memory_mapped_file_base() {}
 
-    void open(const std::string& path, std::ios_base::openmode mode) {}
+    void open(const std::string& path, std::ios_base::openmode mode, int advice = 0) {}
+    bool advise(int advice) {return false; }
+    void warmup(size_type begin = 0, size_type end = (size_type)-1) const {}
     bool is_open() const {return false; }
     void close() {}
     void resize(size_type size) {}
@@ -40,6 +40,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 class memory_mapped_file_posix :
     public memory_mapped_file_base
@@ -52,6 +53,7 @@ protected:
     std::ios_base::openmode m_mode;
     void*                   m_data;
     size_type               m_size;
+    int                     m_advice;
 
 public:
     memory_mapped_file_posix()
@@ -60,6 +62,7 @@ public:
         m_mode = std::ios_base::in;
         m_data = NULL;
         m_size = 0;
+        m_advice = 0;
     }
 
     virtual ~memory_mapped_file_posix()
@@ -67,11 +70,14 @@ public:
         close();
     }
 
-    void open(const std::string& path, std::ios_base::openmode mode)
+    void open(const std::string& path, std::ios_base::openmode mode, int advice = 0)
     {
         int flags = 0;
         struct stat buf;
 
+        // The hints are applied whenever the file is mapped.
+        m_advice = advice;
+
         if (mode & std::ios_base::in) {
             flags = O_RDONLY;
         }
@@ -137,18 +143,91 @@ public:
         }
 
         /* Map the file into process memory. */
+        int flags = MAP_SHARED;
+        int advice = m_advice;
+#ifdef  MAP_POPULATE
+        if (advice & advise_populate) {
+            flags |= MAP_POPULATE;
+            advice &= ~advise_populate;
+        }
+#endif/*MAP_POPULATE*/
         m_data = ::mmap(
             NULL,
             size,
             (m_mode & std::ios_base::out) ? (PROT_READ | PROT_WRITE) : PROT_READ,
-            MAP_SHARED,
+            flags,
             m_fd,
             0);
+        if (m_data == MAP_FAILED) {
+            m_data = NULL;
+            return false;
+        }
 
         m_size = size;
+
+        /* The hints are not essential; failures are ignored here. */
+        this->advise(advice);
         return true;
     }
 
+    /**
+     * Gives hints on the use of the mapped memory.
+     *  @param  advice  The hints (advise_random, advise_willneed, ...).
+     *  @return bool    \c false if a hint failed, e.g., when locking the
+     *                  memory exceeds RLIMIT_MEMLOCK.
+     */
+    bool advise(int advice)
+    {
+        bool ret = true;
+        if (m_data == NULL) {
+            return (advice == 0);
+        }
+        if (advice & advise_random) {
+            ret &= (::madvise(m_data, m_size, MADV_RANDOM) == 0);
+        }
+        if (advice & advise_willneed) {
+            ret &= (::madvise(m_data, m_size, MADV_WILLNEED) == 0);
+        }
+        if (advice & advise_hugepage) {
+#ifdef  MADV_HUGEPAGE
+            ret &= (::madvise(m_data, m_size, MADV_HUGEPAGE) == 0);
+#else
+            ret = false;
+#endif/*MADV_HUGEPAGE*/
+        }
+        if (advice & advise_populate) {
+#ifdef  MADV_POPULATE_READ
+            if (::madvise(m_data, m_size, MADV_POPULATE_READ) != 0) {
+                this->warmup();
+            }
+#else
+            this->warmup();
+#endif/*MADV_POPULATE_READ*/
+        }
+        if (advice & advise_lock) {
+            ret &= (::mlock(m_data, m_size) == 0);
+        }
+        return ret;
+    }
+
+    /**
+     * Reads every page in a range of the mapped memory, so that later
+     * accesses do not wait for page faults.
+     *  @param  begin   The offset to the range.
+     *  @param  end     The offset to the end of the range.
+     */
+    void warmup(size_type begin = 0, size_type end = (size_type)-1) const
+    {
+        const size_type page = (size_type)::sysconf(_SC_PAGESIZE);
+        const volatile char* p = reinterpret_cast<const volatile char*>(m_data);
+        char sum = 0;
+        end = (m_size < end) ? m_size : end;
+        for (size_type i = begin;i < end;i += page) {
+            sum ^= p[i];
+        }
+        (void)sum;
+    }
+
     void free()
     {
         if (m_data != NULL) {
@@ -50,6 +50,7 @@ protected:
     std::ios_base::openmode m_mode;
 	char*	                m_data;
 	size_type               m_size;
+    int                     m_advice;
 
 public:
     memory_mapped_file_win32()
@@ -59,6 +60,7 @@ public:
         m_mode = 0;
         m_data = NULL;
         m_size = 0;
+        m_advice = 0;
     }
 
     virtual ~memory_mapped_file_win32()
@@ -66,11 +68,14 @@ public:
         close();
     }
 
-    void open(const std::string& path, std::ios_base::openmode mode)
+    void open(const std::string& path, std::ios_base::openmode mode, int advice = 0)
     {
 		DWORD dwDesiredAccess = 0;
 		DWORD dwCreationDisposition = 0;
 
+        // The hints are applied whenever the file is mapped.
+        m_advice = advice;
+
         if (mode & std::ios_base::in) {
 			dwDesiredAccess |= GENERIC_READ;
 			dwCreationDisposition = OPEN_EXISTING;
@@ -160,9 +165,69 @@ public:
 	    }
 
 	    m_size = size;
+
+        // The hints are not essential; failures are ignored here.
+        this->advise(m_advice);
         return true;
     }
 
+    /**
+     * Gives hints on the use of the mapped memory.
+     *  Windows has no equivalent of advise_random and advise_hugepage for
+     *  mapped files; these hints are ignored.
+     *  @param  advice  The hints (advise_willneed, advise_lock, ...).
+     *  @return bool    \c false if a hint failed, e.g., when locking the
+     *                  memory exceeds the working set of the process.
+     */
+    bool advise(int advice)
+    {
+        bool ret = true;
+        if (m_data == NULL) {
+            return (advice == 0);
+        }
+        if (advice & (advise_willneed | advise_populate)) {
+#if     defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0602
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = m_data;
+            range.NumberOfBytes = m_size;
+            if (!PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                ret = false;
+            }
+#else
+            ret = false;
+#endif/*_WIN32_WINNT*/
+            if (advice & advise_populate) {
+                this->warmup();
+            }
+        }
+        if (advice & advise_lock) {
+            if (!VirtualLock(m_data, m_size)) {
+                ret = false;
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * Reads every page in a range of the mapped memory, so that later
+     * accesses do not wait for page faults.
+     *  @param  begin   The offset to the range.
+     *  @param  end     The offset to the end of the range.
+     */
+    void warmup(size_type begin = 0, size_type end = (size_type)-1) const
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        const size_type page = (size_type)info.dwPageSize;
+        const volatile char* p = m_data;
+        char sum = 0;
+        end = (m_size < end) ? m_size : end;
+        for (size_type i = begin;i < end;i += page) {
+            sum ^= p[i];
+        }
+        (void)sum;
+    }
+
     void free()
     {
 	    if (m_data != NULL) {
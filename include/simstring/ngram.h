@@ -33,13 +33,46 @@
 #ifndef __NGRAM_H__
 #define __NGRAM_H__
 
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
 #include <map>
 #include <sstream>
 #include <string>
+#include <vector>
+
+#include "utf8.h"
 
 namespace simstring
 {
 
+/**
+ * The unsigned type of a character type.
+ */
+template <class char_type>
+struct make_unsigned_char
+{
+    typedef char_type type;
+};
+
+template <>
+struct make_unsigned_char<char>
+{
+    typedef unsigned char type;
+};
+
+template <>
+struct make_unsigned_char<signed char>
+{
+    typedef unsigned char type;
+};
+
+template <>
+struct make_unsigned_char<wchar_t>
+{
+    typedef uint32_t type;
+};
+
 /**
  * Obtain a set of letter n-grams in a string.
  *  @param  str     The string.
@@ -101,6 +134,282 @@ ngrams(
     }
 }
 
+/**
+ * Returns the number of letter n-grams generated from a string.
+ *  This is the size of the buffer required by hashed_ngrams().
+ *  @param  len     The length of the string.
+ *  @param  n       The unit of n-grams.
+ *  @param  be      \c true to generate n-grams that encode begin and end of
+ *                  a string.
+ *  @return size_t  The number of n-grams.
+ */
+inline size_t
+num_ngrams(size_t len, int n, bool be)
+{
+    if (be) {
+        return len + n - 1;
+    } else if (len < (size_t)n) {
+        return 1;
+    } else {
+        return len - n + 1;
+    }
+}
+
+/**
+ * Appends the decimal representation of a number to a string.
+ */
+template <class string_type>
+inline void
+append_number(string_type& str, size_t value)
+{
+    typedef typename string_type::value_type char_type;
+    char_type digits[24];
+    int d = 0;
+    for (;0 < value;value /= 10) {
+        digits[d++] = (char_type)('0' + value % 10);
+    }
+    while (0 < d) {
+        str += digits[--d];
+    }
+}
+
+/**
+ * Letter n-grams of a fixed size packed into integers.
+ *  Every letter of an n-gram occupies a field of an integer, in which the
+ *  first letter is the most significant. The order of the integers is
+ *  thus the order of the n-grams as strings, and the n-grams are sorted
+ *  and counted as integers. The class is defined only for the types of
+ *  letters whose n-grams fit into 64 bits.
+ *  @param  N           The unit of n-grams.
+ *  @param  BE          \c true to generate n-grams that encode begin and
+ *                      end of a string.
+ *  @param  char_type   The type of letters.
+ */
+template <int N, bool BE, class char_type, bool fits = (N * 8 * sizeof(char_type) <= 64)>
+struct packed_ngrams
+{
+    /// Generates nothing; the n-grams do not fit into 64 bits.
+    template <class string_type>
+    static bool generate(const string_type& str, std::vector<string_type>& out)
+    {
+        return false;
+    }
+};
+
+template <int N, bool BE, class char_type>
+struct packed_ngrams<N, BE, char_type, true>
+{
+    enum {
+        /// The number of bits of a letter.
+        BITS = 8 * sizeof(char_type),
+        /// The maximum number of n-grams packed on the stack.
+        MAX_NGRAMS = 256,
+    };
+
+    /**
+     * Obtain a set of letter n-grams in a string into a vector.
+     *  This function generates the same n-grams in the same order as
+     *  ngrams() does.
+     *  @param  str     The string.
+     *  @param  out     The vector that receives the set of n-grams.
+     *  @return bool    \c false if the string is too long to be packed.
+     */
+    template <class string_type>
+    static bool generate(const string_type& str, std::vector<string_type>& out)
+    {
+        typedef typename make_unsigned_char<char_type>::type uchar_type;
+        const uint64_t unit = ((uint64_t)1 << (BITS - 1) << 1) - 1;
+        const uint64_t mask = (N * BITS == 64) ? ~(uint64_t)0 : ((uint64_t)1 << (N * BITS)) - 1;
+        // Letters compared as signed values are offset to be unsigned.
+        const uint64_t sign =
+            std::char_traits<char_type>::lt((char_type)-1, (char_type)0) ?
+            ((uint64_t)1 << (BITS - 1)) : 0;
+        const uint64_t mark = (uint64_t)0x01 ^ sign;
+        const size_t len = str.length();
+        const size_t m = num_ngrams(len, N, BE);
+        const size_t begin = BE ? (size_t)(N-1) : 0;
+        if (MAX_NGRAMS < m) {
+            return false;
+        }
+
+        // Pack the n-grams of the padded string.
+        uint64_t keys[MAX_NGRAMS];
+        uint64_t key = 0;
+        for (size_t k = 0;k < m + N - 1;++k) {
+            uint64_t c = mark;
+            if (begin <= k && k < begin + len) {
+                c = ((uint64_t)(uchar_type)str[k-begin] & unit) ^ sign;
+            }
+            key = ((key << (BITS - 1) << 1) | c) & mask;
+            if (N - 1 <= (int)k) {
+                keys[k - (N - 1)] = key;
+            }
+        }
+        std::sort(keys, keys + m);
+
+        // Unpack the n-grams, appending numbers to repeated ones.
+        out.resize(m);
+        for (size_t i = 0;i < m;) {
+            size_t j = i;
+            for (;j < m && keys[j] == keys[i];++j) {
+                string_type& ngram = out[j];
+                ngram.resize(N);
+                for (int l = 0;l < N;++l) {
+                    uint64_t c = ((keys[j] >> (BITS * (N - 1 - l))) & unit) ^ sign;
+                    ngram[l] = (char_type)(uchar_type)c;
+                }
+                if (i < j) {
+                    append_number(ngram, j - i + 1);
+                }
+            }
+            i = j;
+        }
+        return true;
+    }
+};
+
+/**
+ * Obtain a set of letter n-grams in a string into a vector.
+ *  This function generates the same set of n-grams as ngrams() does, in
+ *  the same order, but reuses the strings in the vector. Generating
+ *  n-grams for similar strings into the same vector thus allocates no
+ *  memory once the strings in the vector have enough capacity.
+ *  @param  str     The string.
+ *  @param  out     The vector that receives the set of n-grams.
+ *  @param  n       The unit of n-grams.
+ *  @param  be      \c true to generate n-grams that encode begin and end of
+ *                  a string.
+ */
+template <class string_type>
+static void
+ngrams(
+    const string_type& str,
+    std::vector<string_type>& out,
+    int n,
+    bool be
+    )
+{
+    typedef typename string_type::value_type char_type;
+    const char_type mark = (char_type)0x01;
+    const size_t len = str.length();
+    const size_t m = num_ngrams(len, n, be);
+    // The offset of the string in the padded string.
+    const size_t begin = be ? (size_t)(n-1) : 0;
+
+    // Generate n-grams of the common sizes with the packed kernels.
+    bool done = false;
+    switch (be ? -n : n) {
+    case 2:
+        done = packed_ngrams<2, false, char_type>::generate(str, out);
+        break;
+    case 3:
+        done = packed_ngrams<3, false, char_type>::generate(str, out);
+        break;
+    case 4:
+        done = packed_ngrams<4, false, char_type>::generate(str, out);
+        break;
+    case -2:
+        done = packed_ngrams<2, true, char_type>::generate(str, out);
+        break;
+    case -3:
+        done = packed_ngrams<3, true, char_type>::generate(str, out);
+        break;
+    case -4:
+        done = packed_ngrams<4, true, char_type>::generate(str, out);
+        break;
+    }
+    if (done) {
+        return;
+    }
+
+    out.resize(m);
+    for (size_t i = 0;i < m;++i) {
+        string_type& ngram = out[i];
+        ngram.assign(n, mark);
+        for (int j = 0;j < n;++j) {
+            size_t k = i + j;
+            if (begin <= k && k < begin + len) {
+                ngram[j] = str[k-begin];
+            }
+        }
+    }
+
+    // Append numbers if the same n-gram occurs more than once.
+    std::sort(out.begin(), out.end());
+    for (size_t i = 0;i < m;) {
+        size_t j = i + 1;
+        for (;j < m && out[j] == out[i];++j) {
+            append_number(out[j], j - i + 1);
+        }
+        i = j;
+    }
+}
+
+/**
+ * Obtain a set of code-point n-grams in a UTF-8 string into a vector.
+ *  Every n-gram consists of the UTF-8 sequences of n code points (see
+ *  utf8_decode()), and is padded with the same marks as ngrams(). The
+ *  n-grams of an ASCII string are thus identical to the letter n-grams.
+ *  @param  str     The string in UTF-8.
+ *  @param  out     The vector that receives the set of n-grams.
+ *  @param  n       The unit of n-grams.
+ *  @param  be      \c true to generate n-grams that encode begin and end of
+ *                  a string.
+ */
+inline void
+utf8_ngrams(
+    const std::string& str,
+    std::vector<std::string>& out,
+    int n,
+    bool be
+    )
+{
+    const char mark = (char)0x01;
+    const size_t len = str.length();
+    if (utf8_ascii_prefix(str.c_str(), len) == len) {
+        ngrams(str, out, n, be);
+        return;
+    }
+
+    // Decode the offsets of the code points in the string.
+    size_t buffer[256];
+    std::vector<size_t> heap;
+    size_t* offsets = buffer;
+    if (sizeof(buffer) / sizeof(buffer[0]) < len + 1) {
+        heap.resize(len + 1);
+        offsets = &heap[0];
+    }
+    const size_t num = utf8_decode(str.c_str(), len, NULL, offsets);
+    const size_t m = num_ngrams(num, n, be);
+    // The offset of the string in the padded string.
+    const size_t begin = be ? (size_t)(n-1) : 0;
+
+    out.resize(m);
+    for (size_t i = 0;i < m;++i) {
+        std::string& ngram = out[i];
+        ngram.clear();
+        for (int j = 0;j < n;++j) {
+            size_t k = i + j;
+            if (begin <= k && k < begin + num) {
+                const size_t b = offsets[k-begin], e = offsets[k-begin+1];
+                ngram.append(str, b, e - b);
+            } else {
+                ngram += mark;
+            }
+        }
+    }
+
+    // Append numbers if the same n-gram occurs more than once.
+    std::sort(out.begin(), out.end());
+    for (size_t i = 0;i < m;) {
+        size_t j = i + 1;
+        for (;j < m && out[j] == out[i];++j) {
+            append_number(out[j], j - i + 1);
+        }
+        i = j;
+    }
+}
+
 /**
  * N-gram generator.
  *
@@ -111,12 +420,13 @@ class ngram_generator
 protected:
     int m_n;            ///< The unit of n-grams.
     bool m_be;          ///< The flag for begin/end of tokens.
+    bool m_utf8;        ///< The flag for code points of UTF-8 strings.
 
 public:
     /**
      * Constructs an instance as a tri-gram generator.
      */
-    ngram_generator() : m_n(3), m_be(false)
+    ngram_generator() : m_n(3), m_be(false), m_utf8(false)
     {
     }
 
@@ -125,8 +435,11 @@ public:
      *  @param  n       The unit of n-grams.
      *  @param  be      \c true to generate n-grams that encode begin and
      *                  end of a string.
+     *  @param  utf8    \c true to generate n-grams of code points from
+     *                  strings in UTF-8 (see utf8_ngrams()).
      */
-    ngram_generator(int n, bool be=false) : m_n(n), m_be(be)
+    ngram_generator(int n, bool be=false, bool utf8=false)
+        : m_n(n), m_be(be), m_utf8(utf8)
     {
     }
 
@@ -135,11 +448,14 @@ public:
      *  @param  n       The unit of n-grams.
      *  @param  be      \c true to generate n-grams that encode begin and
      *                  end of a string.
+     *  @param  utf8    \c true to generate n-grams of code points from
+     *                  strings in UTF-8.
      */
-    void set(int n, bool be=false)
+    void set(int n, bool be=false, bool utf8=false)
     {
         m_n = n;
         m_be = be;
+        m_utf8 = utf8;
     }
 
     /**
@@ -161,6 +477,16 @@ public:
         return m_be;
     }
 
+    /**
+     * Gets the flag for code-point n-grams of UTF-8 strings.
+     *  @return bool    \c true if n-grams of code points are generated from
+     *                  strings in UTF-8.
+     */
+    bool get_utf8() const
+    {
+        return m_utf8;
+    }
+
     /**
      * Obtain a set of letter n-grams in a string.
      *  @param  str     The string.
@@ -171,8 +497,309 @@ public:
     {
         ngrams(str, ins, m_n, m_be);
     }
+
+    /**
+     * Obtain a set of letter n-grams in a string of bytes.
+     *  @param  str     The string.
+     *  @param  ins     The insert iterator that receives the set of n-grams.
+     */
+    template <class insert_iterator>
+    void operator()(const std::string& str, insert_iterator ins) const
+    {
+        if (m_utf8) {
+            std::vector<std::string> out;
+            utf8_ngrams(str, out, m_n, m_be);
+            std::copy(out.begin(), out.end(), ins);
+        } else {
+            ngrams(str, ins, m_n, m_be);
+        }
+    }
+
+    /**
+     * Obtain a set of letter n-grams in a string into a vector, reusing
+     * the memory of the vector.
+     *  @param  str     The string.
+     *  @param  out     The vector that receives the set of n-grams.
+     */
+    template <class string_type>
+    void generate(const string_type& str, std::vector<string_type>& out) const
+    {
+        ngrams(str, out, m_n, m_be);
+    }
+
+    /**
+     * Obtain a set of letter n-grams in a string of bytes into a vector,
+     * reusing the memory of the vector.
+     *  @param  str     The string.
+     *  @param  out     The vector that receives the set of n-grams.
+     */
+    void generate(const std::string& str, std::vector<std::string>& out) const
+    {
+        if (m_utf8) {
+            utf8_ngrams(str, out, m_n, m_be);
+        } else {
+            ngrams(str, out, m_n, m_be);
+        }
+    }
 };
 
+/**
+ * Obtain a set of hashed letter n-grams in a string.
+ *  This function generates the same set of n-grams as ngrams() does, but
+ *  represents every n-gram by a 64-bit hash value of its letters. Instead
+ *  of appending a number to an n-gram occurring more than once, the k-th
+ *  occurrence (k >= 2) is represented by a hash value mixed with k. This
+ *  function does not allocate memory; the order of n-grams in the buffer
+ *  is unspecified.
+ *  @param  str     The pointer to the string.
+ *  @param  len     The length of the string.
+ *  @param  out     The buffer that receives the set of n-grams. The buffer
+ *                  must have space for num_ngrams(len, n, be) elements.
+ *  @param  n       The unit of n-grams.
+ *  @param  be      \c true to generate n-grams that encode begin and end of
+ *                  a string.
+ *  @return size_t  The number of n-grams.
+ */
+template <class char_type>
+static size_t
+hashed_ngrams(
+    const char_type* str,
+    size_t len,
+    uint64_t* out,
+    int n,
+    bool be
+    )
+{
+    const uint64_t mark = 0x01;
+    const size_t m = num_ngrams(len, n, be);
+    // The offset of the string in the padded string.
+    const size_t begin = be ? (size_t)(n-1) : 0;
+
+    // Compute FNV-1a hash values of the n-grams in the padded string.
+    for (size_t i = 0;i < m;++i) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (int j = 0;j < n;++j) {
+            size_t k = i + j;
+            uint64_t c = (begin <= k && k < begin + len) ?
+                (uint64_t)(typename make_unsigned_char<char_type>::type)str[k-begin] :
+                mark;
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+        out[i] = h;
+    }
+
+    // Distinguish multiple occurrences of the same n-gram.
+    std::sort(out, out + m);
+    for (size_t i = 0;i < m;) {
+        size_t j = i + 1;
+        while (j < m && out[j] == out[i]) {
+            // The (j-i+1)-th occurrence of the n-gram.
+            uint64_t h = out[i] ^ ((uint64_t)(j - i + 1) * 0x9e3779b97f4a7c15ULL);
+            h ^= h >> 33;
+            h *= 0xff51afd7ed558ccdULL;
+            h ^= h >> 33;
+            out[j++] = h;
+        }
+        i = j;
+    }
+
+    return m;
+}
+
+/**
+ * Hashed n-gram generator.
+ *
+ *  This class generates n-grams represented by 64-bit hash values (see
+ *  hashed_ngrams()). A database built with this generator must be
+ *  read by a reader using this generator.
+ */
+class hashed_ngram_generator : public ngram_generator
+{
+public:
+    /// The type of an n-gram.
+    typedef uint64_t key_type;
+
+    /**
+     * Constructs an instance as a tri-gram generator.
+     */
+    hashed_ngram_generator() : ngram_generator()
+    {
+    }
+
+    /**
+     * Constructs an instance as an n-gram generator.
+     *  @param  n       The unit of n-grams.
+     *  @param  be      \c true to generate n-grams that encode begin and
+     *                  end of a string.
+     *  @param  utf8    \c true to generate n-grams of code points from
+     *                  strings in UTF-8.
+     */
+    hashed_ngram_generator(int n, bool be=false, bool utf8=false)
+        : ngram_generator(n, be, utf8)
+    {
+    }
+
+    /**
+     * Obtain a set of hashed n-grams in a string without allocating memory.
+     *  @param  str     The pointer to the string.
+     *  @param  len     The length of the string.
+     *  @param  out     The buffer that receives the set of n-grams. The
+     *                  buffer must have space for size(len) elements.
+     *  @return size_t  The number of n-grams.
+     */
+    template <class char_type>
+    size_t operator()(const char_type* str, size_t len, key_type* out) const
+    {
+        return hashed_ngrams(str, len, out, m_n, m_be);
+    }
+
+    /**
+     * Obtain a set of hashed n-grams in a string of bytes without
+     * allocating memory for a short string.
+     *  The n-grams of code points hash the code points decoded from the
+     *  string, and are identical to the letter n-grams of an ASCII string.
+     *  @param  str     The pointer to the string.
+     *  @param  len     The length of the string in bytes.
+     *  @param  out     The buffer that receives the set of n-grams. The
+     *                  buffer must have space for size(len) elements.
+     *  @return size_t  The number of n-grams.
+     */
+    size_t operator()(const char* str, size_t len, key_type* out) const
+    {
+        if (!m_utf8 || utf8_ascii_prefix(str, len) == len) {
+            return hashed_ngrams(str, len, out, m_n, m_be);
+        }
+
+        uint32_t buffer[256];
+        std::vector<uint32_t> heap;
+        uint32_t* cps = buffer;
+        if (sizeof(buffer) / sizeof(buffer[0]) < len) {
+            heap.resize(len);
+            cps = &heap[0];
+        }
+        const size_t num = utf8_decode(str, len, cps, NULL);
+        return hashed_ngrams(cps, num, out, m_n, m_be);
+    }
+
+    /**
+     * Returns the number of n-grams generated from a string.
+     *  @param  len     The length of the string.
+     *  @return size_t  The number of n-grams.
+     */
+    size_t size(size_t len) const
+    {
+        return num_ngrams(len, m_n, m_be);
+    }
+
+    /**
+     * Obtain a set of hashed n-grams in a string.
+     *  @param  str     The string.
+     *  @param  ins     The insert iterator that receives the set of n-grams.
+     */
+    template <class string_type, class insert_iterator>
+    void operator()(const string_type& str, insert_iterator ins) const
+    {
+        key_type buffer[256];
+        const size_t m = size(str.length());
+        if (m <= sizeof(buffer) / sizeof(buffer[0])) {
+            size_t k = (*this)(str.c_str(), str.length(), buffer);
+            std::copy(buffer, buffer + k, ins);
+        } else {
+            std::vector<key_type> keys(m);
+            size_t k = (*this)(str.c_str(), str.length(), &keys[0]);
+            std::copy(keys.begin(), keys.begin() + k, ins);
+        }
+    }
+
+    /**
+     * Obtain a set of hashed n-grams in a string into a vector, reusing
+     * the memory of the vector.
+     *  @param  str     The string.
+     *  @param  out     The vector that receives the set of n-grams.
+     */
+    template <class string_type>
+    void generate(const string_type& str, std::vector<key_type>& out) const
+    {
+        out.resize(size(str.length()));
+        out.resize((*this)(str.c_str(), str.length(), &out[0]));
+    }
+};
+
+/**
+ * Traits of n-grams generated by an n-gram generator.
+ *  @param  ngram_generator_type    The type of an n-gram generator.
+ *  @param  string_type             The type of a string.
+ */
+template <class ngram_generator_type, class string_type>
+struct ngram_traits
+{
+    /// The type of an n-gram.
+    typedef string_type ngram_type;
+    /// Whether n-grams are hashed.
+    enum { hashed = 0 };
+};
+
+template <class string_type>
+struct ngram_traits<hashed_ngram_generator, string_type>
+{
+    typedef hashed_ngram_generator::key_type ngram_type;
+    enum { hashed = 1 };
+};
+
+/**
+ * Returns the pointer to the key of an n-gram in a database.
+ */
+template <class char_type, class traits_type, class alloc_type>
+inline const void*
+ngram_key_data(const std::basic_string<char_type, traits_type, alloc_type>& ngram)
+{
+    return ngram.c_str();
+}
+
+/**
+ * Returns the size in bytes of the key of an n-gram in a database.
+ */
+template <class char_type, class traits_type, class alloc_type>
+inline size_t
+ngram_key_size(const std::basic_string<char_type, traits_type, alloc_type>& ngram)
+{
+    return sizeof(char_type) * ngram.length();
+}
+
+/**
+ * Sets an n-gram from its key in a database.
+ */
+template <class char_type, class traits_type, class alloc_type>
+inline void
+ngram_key_assign(
+    std::basic_string<char_type, traits_type, alloc_type>& ngram,
+    const void* data,
+    size_t size
+    )
+{
+    ngram.assign(
+        reinterpret_cast<const char_type*>(data), size / sizeof(char_type));
+}
+
+inline const void*
+ngram_key_data(const uint64_t& ngram)
+{
+    return &ngram;
+}
+
+inline size_t
+ngram_key_size(const uint64_t& ngram)
+{
+    return sizeof(ngram);
+}
+
+inline void
+ngram_key_assign(uint64_t& ngram, const void* data, size_t size)
+{
+    std::memcpy(&ngram, data, sizeof(ngram));
+}
+
 };
 
 #endif/*__NGRAM_H__*/
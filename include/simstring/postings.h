@@ -0,0 +1,469 @@
+/*
+ *      Compressed posting lists.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_POSTINGS_H__
+#define __SIMSTRING_POSTINGS_H__
+
+#include <stdint.h>
+#include <cstring>
+#include <vector>
+
+#include "intersect.h"
+
+namespace simstring { namespace postings {
+
+/**
+ * \addtogroup postings Compressed posting lists
+ * @{
+ *
+ *  A compressed posting list stores sorted SIDs as differences from their
+ *  predecessors. Every complete block of 128 differences is bit-packed with
+ *  the width of its largest difference, in a vertical layout: the k-th
+ *  difference goes to the 32-bit lane (k % 4), so that four lanes are
+ *  unpacked at a time with 128-bit SIMD instructions. The differences
+ *  after the last complete block (the tail) are stored in variable-byte
+ *  codes.
+ *
+ *  The byte layout of a posting list is:
+ *  - uint32_t: the number of SIDs (n).
+ *  - skip directory: an entry for each of (n / 128) blocks, consisting of
+ *      - uint32_t: the last SID in the block;
+ *      - uint32_t: the offset of the block from the end of the directory;
+ *      - uint32_t: the bit width of the block.
+ *  - blocks: (16 * width) bytes for each block.
+ *  - tail: variable-byte codes of the remaining differences.
+ *
+ *  A reader seeks a SID by searching the skip directory, and decodes only
+ *  the block that may contain the SID.
+ */
+
+/// The number of SIDs in a block.
+enum { BLOCK_SIZE = 128 };
+
+/// The size of the count field in bytes.
+enum { HEADER_SIZE = 4 };
+
+/// The size of a skip directory entry in bytes.
+enum { ENTRY_SIZE = 12 };
+
+inline uint32_t get_uint32(const char* p)
+{
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline void put_uint32(std::vector<char>& out, uint32_t value)
+{
+    const char* p = reinterpret_cast<const char*>(&value);
+    out.insert(out.end(), p, p + sizeof(value));
+}
+
+inline void set_uint32(std::vector<char>& out, size_t offset, uint32_t value)
+{
+    std::memcpy(&out[offset], &value, sizeof(value));
+}
+
+/**
+ * Packs a block of differences.
+ *  @param  deltas  The 128 differences.
+ *  @param  bits    The bit width.
+ *  @param  out     The (4 * bits) words receiving the packed block.
+ */
+inline void pack_block(const uint32_t* deltas, int bits, uint32_t* out)
+{
+    std::memset(out, 0, sizeof(uint32_t) * 4 * bits);
+    for (int lane = 0;lane < 4;++lane) {
+        int w = 0, shift = 0;
+        for (int k = 0;k < BLOCK_SIZE / 4;++k) {
+            const uint32_t x = deltas[4 * k + lane];
+            out[4 * w + lane] |= x << shift;
+            if (32 < shift + bits) {
+                out[4 * (w + 1) + lane] |= x >> (32 - shift);
+            }
+            shift += bits;
+            if (32 <= shift) {
+                shift -= 32;
+                ++w;
+            }
+        }
+    }
+}
+
+/**
+ * Unpacks a block and restores the SIDs (portable implementation).
+ *  @param  in      The packed block.
+ *  @param  bits    The bit width.
+ *  @param  base    The SID preceding the block.
+ *  @param  out     The 128 SIDs.
+ */
+inline void unpack_block_generic(
+    const char* in, int bits, uint32_t base, uint32_t* out)
+{
+    const uint32_t mask = (bits == 32) ? 0xFFFFFFFF : ((1U << bits) - 1);
+    for (int lane = 0;lane < 4;++lane) {
+        int w = 0, shift = 0;
+        for (int k = 0;k < BLOCK_SIZE / 4;++k) {
+            uint32_t x = (bits == 0) ? 0 : get_uint32(in + 16 * w + 4 * lane) >> shift;
+            if (32 < shift + bits) {
+                x |= get_uint32(in + 16 * (w + 1) + 4 * lane) << (32 - shift);
+            }
+            out[4 * k + lane] = x & mask;
+            shift += bits;
+            if (32 <= shift) {
+                shift -= 32;
+                ++w;
+            }
+        }
+    }
+
+    for (int i = 0;i < BLOCK_SIZE;++i) {
+        base += out[i];
+        out[i] = base;
+    }
+}
+
+#if     defined(SIMSTRING_SSE2)
+
+inline void unpack_block_sse2(
+    const char* in, int bits, uint32_t base, uint32_t* out)
+{
+    const __m128i mask = _mm_set1_epi32(
+        (bits == 32) ? (int)0xFFFFFFFF : (int)((1U << bits) - 1));
+    const __m128i* p = reinterpret_cast<const __m128i*>(in);
+    __m128i prev = _mm_set1_epi32((int)base);
+    __m128i w = (bits == 0) ? _mm_setzero_si128() : _mm_loadu_si128(p);
+    int shift = 0;
+
+    for (int k = 0;k < BLOCK_SIZE / 4;++k) {
+        // Unpack the differences of four SIDs.
+        __m128i x = _mm_srl_epi32(w, _mm_cvtsi32_si128(shift));
+        shift += bits;
+        if (32 < shift) {
+            w = _mm_loadu_si128(++p);
+            shift -= 32;
+            x = _mm_or_si128(x, _mm_sll_epi32(w, _mm_cvtsi32_si128(bits - shift)));
+        } else if (shift == 32 && k + 1 < BLOCK_SIZE / 4) {
+            w = _mm_loadu_si128(++p);
+            shift = 0;
+        }
+        x = _mm_and_si128(x, mask);
+
+        // Compute the prefix sum.
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+        x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi32(x, prev);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4 * k), x);
+        prev = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+}
+
+#elif   defined(SIMSTRING_NEON)
+
+inline void unpack_block_neon(
+    const char* in, int bits, uint32_t base, uint32_t* out)
+{
+    const uint32x4_t mask = vdupq_n_u32(
+        (bits == 32) ? 0xFFFFFFFF : ((1U << bits) - 1));
+    const uint32x4_t zero = vdupq_n_u32(0);
+    const uint32_t* p = reinterpret_cast<const uint32_t*>(in);
+    uint32x4_t prev = vdupq_n_u32(base);
+    uint32x4_t w = (bits == 0) ? zero :
+        vreinterpretq_u32_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)));
+    int shift = 0;
+
+    for (int k = 0;k < BLOCK_SIZE / 4;++k) {
+        // Unpack the differences of four SIDs; a negative count of
+        // vshlq_u32 shifts to the right.
+        uint32x4_t x = vshlq_u32(w, vdupq_n_s32(-shift));
+        shift += bits;
+        if (32 < shift) {
+            p += 4;
+            w = vreinterpretq_u32_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)));
+            shift -= 32;
+            x = vorrq_u32(x, vshlq_u32(w, vdupq_n_s32(bits - shift)));
+        } else if (shift == 32 && k + 1 < BLOCK_SIZE / 4) {
+            p += 4;
+            w = vreinterpretq_u32_u8(vld1q_u8(reinterpret_cast<const uint8_t*>(p)));
+            shift = 0;
+        }
+        x = vandq_u32(x, mask);
+
+        // Compute the prefix sum.
+        x = vaddq_u32(x, vextq_u32(zero, x, 3));
+        x = vaddq_u32(x, vextq_u32(zero, x, 2));
+        x = vaddq_u32(x, prev);
+        vst1q_u32(out + 4 * k, x);
+        prev = vdupq_n_u32(vgetq_lane_u32(x, 3));
+    }
+}
+
+#endif
+
+/**
+ * Unpacks a block and restores the SIDs.
+ *  @param  in      The packed block.
+ *  @param  bits    The bit width.
+ *  @param  base    The SID preceding the block.
+ *  @param  out     The 128 SIDs.
+ */
+inline void unpack_block(const char* in, int bits, uint32_t base, uint32_t* out)
+{
+#if     defined(SIMSTRING_SSE2)
+    unpack_block_sse2(in, bits, base, out);
+#elif   defined(SIMSTRING_NEON)
+    unpack_block_neon(in, bits, base, out);
+#else
+    unpack_block_generic(in, bits, base, out);
+#endif
+}
+
+/**
+ * Compresses a posting list.
+ *  @param  values  The sorted SIDs.
+ *  @param  n       The number of the SIDs.
+ *  @param  out     The buffer receiving the compressed posting list.
+ */
+inline void encode(const uint32_t* values, size_t n, std::vector<char>& out)
+{
+    const size_t num_blocks = n / BLOCK_SIZE;
+    uint32_t deltas[BLOCK_SIZE];
+    uint32_t packed[4 * 32];
+
+    out.clear();
+    put_uint32(out, (uint32_t)n);
+    out.resize(HEADER_SIZE + ENTRY_SIZE * num_blocks);
+    const size_t begin = out.size();
+
+    // Complete blocks.
+    uint32_t prev = 0;
+    for (size_t b = 0;b < num_blocks;++b) {
+        const uint32_t* v = values + BLOCK_SIZE * b;
+        uint32_t any = 0;
+        for (int i = 0;i < BLOCK_SIZE;++i) {
+            deltas[i] = v[i] - prev;
+            prev = v[i];
+            any |= deltas[i];
+        }
+        int bits = 0;
+        while (bits < 32 && (any >> bits) != 0) {
+            ++bits;
+        }
+
+        const size_t entry = HEADER_SIZE + ENTRY_SIZE * b;
+        set_uint32(out, entry, prev);
+        set_uint32(out, entry + 4, (uint32_t)(out.size() - begin));
+        set_uint32(out, entry + 8, (uint32_t)bits);
+
+        pack_block(deltas, bits, packed);
+        const char* p = reinterpret_cast<const char*>(packed);
+        out.insert(out.end(), p, p + sizeof(uint32_t) * 4 * bits);
+    }
+
+    // The tail.
+    for (size_t i = BLOCK_SIZE * num_blocks;i < n;++i) {
+        uint32_t x = values[i] - prev;
+        prev = values[i];
+        while (0x80 <= x) {
+            out.push_back((char)(0x80 | (x & 0x7F)));
+            x >>= 7;
+        }
+        out.push_back((char)x);
+    }
+}
+
+/**
+ * Returns the number of SIDs in a compressed posting list.
+ *  @param  data    The compressed posting list.
+ *  @param  size    The size of the compressed posting list in bytes.
+ *  @return size_t  The number of SIDs.
+ */
+inline size_t size(const void* data, size_t size)
+{
+    return (size < HEADER_SIZE) ? 0 : get_uint32(reinterpret_cast<const char*>(data));
+}
+
+/**
+ * A reader of a compressed posting list.
+ */
+class decoder
+{
+protected:
+    const char* m_dir;
+    const char* m_blocks;
+    const char* m_tail;
+    size_t m_num;
+    size_t m_num_blocks;
+
+    // The block decoded in the buffer (num_blocks for the tail).
+    size_t m_block;
+    // The number of SIDs in the buffer.
+    size_t m_count;
+    // The position of the previous search in the buffer.
+    size_t m_pos;
+    // The SIDs of the decoded block.
+    uint32_t m_buffer[BLOCK_SIZE];
+
+public:
+    /**
+     * Constructs a reader.
+     *  @param  data    The compressed posting list.
+     *  @param  size    The size of the compressed posting list in bytes.
+     */
+    decoder(const void* data, size_t size)
+        : m_block((size_t)-1), m_count(0), m_pos(0)
+    {
+        const char* p = reinterpret_cast<const char*>(data);
+        m_num = postings::size(data, size);
+        m_num_blocks = m_num / BLOCK_SIZE;
+        m_dir = m_blocks = m_tail = p;
+        if (0 < m_num) {
+            m_dir = p + HEADER_SIZE;
+            m_blocks = m_tail = m_dir + ENTRY_SIZE * m_num_blocks;
+        }
+        if (0 < m_num_blocks) {
+            const char* e = m_dir + ENTRY_SIZE * (m_num_blocks - 1);
+            m_tail = m_blocks + get_uint32(e + 4) + 16 * get_uint32(e + 8);
+        }
+    }
+
+    /**
+     * Returns the number of SIDs.
+     */
+    size_t size() const
+    {
+        return m_num;
+    }
+
+    /**
+     * Decodes all the SIDs.
+     *  @param  out     The array receiving size() SIDs.
+     */
+    void decode(uint32_t* out)
+    {
+        for (size_t b = 0;b < m_num_blocks;++b) {
+            unpack_block(
+                m_blocks + get_uint32(m_dir + ENTRY_SIZE * b + 4),
+                (int)get_uint32(m_dir + ENTRY_SIZE * b + 8),
+                last(b),
+                out + BLOCK_SIZE * b
+                );
+        }
+        decode_tail(out + BLOCK_SIZE * m_num_blocks);
+    }
+
+    /**
+     * Checks whether the posting list contains a SID.
+     *  The SIDs given to successive calls must be in ascending order; the
+     *  search resumes from the position of the previous one.
+     *  @param  value   The SID.
+     *  @return bool    \c true if the posting list contains the SID.
+     */
+    bool find(uint32_t value)
+    {
+        // Find the first block that may contain the value.
+        size_t b = (m_block == (size_t)-1) ? 0 : m_block;
+        if (b < m_num_blocks && last(b + 1) < value) {
+            // Gallop over the skip directory; last(lo + 1) < value holds.
+            size_t lo = b, step = 1;
+            while (lo + step < m_num_blocks && last(lo + step + 1) < value) {
+                lo += step;
+                step <<= 1;
+            }
+            size_t hi = std::min(lo + step, m_num_blocks);
+            while (1 < hi - lo) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (last(mid + 1) < value) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            b = hi;
+        }
+
+        // Decode the block.
+        if (b != m_block) {
+            m_block = b;
+            m_pos = 0;
+            if (b < m_num_blocks) {
+                unpack_block(
+                    m_blocks + get_uint32(m_dir + ENTRY_SIZE * b + 4),
+                    (int)get_uint32(m_dir + ENTRY_SIZE * b + 8),
+                    last(b),
+                    m_buffer
+                    );
+                m_count = BLOCK_SIZE;
+            } else {
+                m_count = decode_tail(m_buffer);
+            }
+        }
+
+        // Search for the value in the block.
+        const uint32_t* p = simd::lower_bound(
+            m_buffer + m_pos, m_buffer + m_count, value);
+        m_pos = (size_t)(p - m_buffer);
+        return (m_pos < m_count && *p == value);
+    }
+
+protected:
+    // The last SID of the blocks before the b-th block (0 for b = 0).
+    inline uint32_t last(size_t b) const
+    {
+        return (b == 0) ? 0 : get_uint32(m_dir + ENTRY_SIZE * (b - 1));
+    }
+
+    size_t decode_tail(uint32_t* out) const
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(m_tail);
+        size_t n = m_num - BLOCK_SIZE * m_num_blocks;
+        uint32_t prev = last(m_num_blocks);
+        for (size_t i = 0;i < n;++i) {
+            uint32_t x = 0;
+            for (int shift = 0;;shift += 7) {
+                x |= (uint32_t)(*p & 0x7F) << shift;
+                if (!(*p++ & 0x80)) {
+                    break;
+                }
+            }
+            prev += x;
+            out[i] = prev;
+        }
+        return n;
+    }
+};
+
+/** @} */
+
+}; };
+
+#endif/*__SIMSTRING_POSTINGS_H__*/
@@ -0,0 +1,650 @@
+/*
+ *      Sharded databases.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_SHARDED_H__
+#define __SIMSTRING_SHARDED_H__
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "simstring.h"
+#include "thread_pool.h"
+
+namespace simstring
+{
+
+/**
+ * \addtogroup sharded Sharded databases
+ * @{
+ *
+ *  A sharded database partitions its strings into independent databases
+ *  (shards), which are listed in a manifest file. The manifest has the
+ *  name of the sharded database, and is a text file:
+ *
+ *  \verbatim
+ SimString shards 1
+ partition: hash
+ shards: 2
+ db.p0
+ db.p1
+ \endverbatim
+ *
+ *  The names of the shards are relative to the directory of the manifest.
+ */
+
+/**
+ * Partitions of strings into shards.
+ */
+enum {
+    /// Strings go to the shards by their hash values (default). Identical
+    /// strings are in the same shard.
+    partition_hash = 0,
+    /// Strings go to the shards in the order of insertion; a shard is
+    /// closed when it has the number of strings given to the writer, and
+    /// the number of shards grows as necessary.
+    partition_range,
+};
+
+/// The magic line of the manifest of a sharded database.
+#define SIMSTRING_SHARDS_MAGIC      "SimString shards 1"
+
+/**
+ * Returns the name of a shard of a database.
+ *  @param  name        The name of the sharded database.
+ *  @param  k           The number of the shard (from zero).
+ *  @return std::string The name of the shard.
+ */
+inline std::string shard_name(const std::string& name, int k)
+{
+    std::stringstream ss;
+    ss << name << ".p" << k;
+    return ss.str();
+}
+
+/**
+ * Returns the hash value of a string for partition_hash.
+ *  The value is the FNV-1a hash of the bytes of the string.
+ */
+template <class string_type>
+inline uint32_t shard_hash(const string_type& str)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(str.c_str());
+    const size_t n = sizeof(typename string_type::value_type) * str.length();
+    uint32_t h = 0x811c9dc5;
+    for (size_t i = 0;i < n;++i) {
+        h ^= p[i];
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+/**
+ * A writer of a sharded database.
+ *  @param  string_tmpl             The type of a string.
+ *  @param  ngram_generator_tmpl    The type of an n-gram generator.
+ */
+template <
+    class string_tmpl,
+    class ngram_generator_tmpl = ngram_generator
+    >
+class sharded_writer
+{
+public:
+    /// The type of a string.
+    typedef string_tmpl string_type;
+    /// The type of an n-gram generator.
+    typedef ngram_generator_tmpl ngram_generator_type;
+    /// The type of the writer of a shard.
+    typedef writer_base<string_type, ngram_generator_type> writer_type;
+
+protected:
+    /// The n-gram generator.
+    const ngram_generator_type& m_gen;
+    /// The writers of the shards.
+    std::vector<std::unique_ptr<writer_type> > m_shards;
+    /// The name of the sharded database.
+    std::string m_name;
+    /// The flags for building the shards.
+    int m_flags;
+    /// The partition of strings.
+    int m_partition;
+    /// The number of strings of a shard for partition_range.
+    size_t m_shard_size;
+    /// The number of strings inserted to the last shard.
+    size_t m_num_last;
+    /// The error message.
+    std::stringstream m_error;
+
+public:
+    /**
+     * Constructs a writer object.
+     *  @param  gen         The n-gram generator used by this writer.
+     */
+    sharded_writer(const ngram_generator_type& gen)
+        : m_gen(gen), m_flags(0), m_partition(partition_hash),
+        m_shard_size(0), m_num_last(0)
+    {
+    }
+
+    /**
+     * Constructs a writer object by opening a database.
+     *  @param  gen         The n-gram generator used by this writer.
+     *  @param  name        The name of the sharded database.
+     *  @param  num_shards  The number of shards (partition_hash), or the
+     *                      number of strings of a shard (partition_range).
+     *  @param  partition   The partition of strings.
+     *  @param  flags       The flags for building the shards.
+     */
+    sharded_writer(
+        const ngram_generator_type& gen,
+        const std::string& name,
+        size_t num_shards,
+        int partition = partition_hash,
+        int flags = 0
+        )
+        : m_gen(gen), m_flags(0), m_partition(partition_hash),
+        m_shard_size(0), m_num_last(0)
+    {
+        this->open(name, num_shards, partition, flags);
+    }
+
+    /**
+     * Destructs a writer object.
+     */
+    virtual ~sharded_writer()
+    {
+        close();
+    }
+
+    /**
+     * Opens a sharded database.
+     *  @param  name        The name of the sharded database.
+     *  @param  num_shards  The number of shards (partition_hash), or the
+     *                      number of strings of a shard (partition_range).
+     *  @param  partition   The partition of strings.
+     *  @param  flags       The flags for building the shards
+     *                      (::simstring::store_append is not supported).
+     *  @return bool        \c true if the database is successfully opened,
+     *                      \c false otherwise.
+     *  @see    ::simstring::partition_hash, ::simstring::partition_range,
+     *          ::simstring::store_compressed
+     */
+    bool open(
+        const std::string& name,
+        size_t num_shards,
+        int partition = partition_hash,
+        int flags = 0
+        )
+    {
+        m_shards.clear();
+        m_name = name;
+        m_flags = flags;
+        m_partition = partition;
+        m_shard_size = 0;
+        m_num_last = 0;
+
+        if (num_shards == 0 || (flags & store_append)) {
+            m_error << "Invalid parameters of the sharded database";
+            m_name.clear();
+            return false;
+        }
+
+        // The shards of partition_range are added as they are filled.
+        if (partition == partition_range) {
+            m_shard_size = num_shards;
+            num_shards = 1;
+        }
+        for (size_t k = 0;k < num_shards;++k) {
+            if (!this->add_shard()) {
+                m_shards.clear();
+                m_name.clear();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Closes the sharded database, and writes its manifest.
+     *  @return bool        \c true if the database is successfully closed,
+     *                      \c false otherwise.
+     */
+    bool close()
+    {
+        if (m_name.empty()) {
+            return !fail();
+        }
+
+        bool b = true;
+        for (size_t k = 0;k < m_shards.size();++k) {
+            if (!m_shards[k]->close()) {
+                m_error << m_shards[k]->error();
+                b = false;
+            }
+        }
+
+        // The manifest is written last, so that a reader never finds the
+        // shards being built.
+        std::ofstream ofs(m_name.c_str());
+        ofs << SIMSTRING_SHARDS_MAGIC << std::endl;
+        ofs << "partition: " << (m_partition == partition_range ? "range" : "hash") << std::endl;
+        ofs << "shards: " << m_shards.size() << std::endl;
+        for (size_t k = 0;k < m_shards.size();++k) {
+            ofs << base_name(shard_name(m_name, (int)k)) << std::endl;
+        }
+        if (ofs.fail()) {
+            m_error << "Failed to write the manifest: " << m_name;
+            b = false;
+        }
+
+        m_shards.clear();
+        m_name.clear();
+        return b;
+    }
+
+    /**
+     * Inserts a string to the database.
+     *  @param  str         The string to be inserted.
+     *  @return bool        \c true if the string is successfully inserted,
+     *                      \c false otherwise.
+     */
+    bool insert(const string_type& str)
+    {
+        if (m_shards.empty()) {
+            return false;
+        }
+
+        size_t k = m_shards.size() - 1;
+        if (m_partition == partition_range) {
+            if (m_shard_size <= m_num_last) {
+                if (!this->add_shard()) {
+                    return false;
+                }
+                ++k;
+            }
+            ++m_num_last;
+        } else {
+            k = shard_hash(str) % m_shards.size();
+        }
+
+        if (!m_shards[k]->insert(str)) {
+            m_error << m_shards[k]->error();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Returns the number of shards.
+     */
+    size_t size() const
+    {
+        return m_shards.size();
+    }
+
+    /**
+     * Checks whether an error has occurred.
+     *  @return bool    \c true if an error has occurred.
+     */
+    bool fail() const
+    {
+        return !m_error.str().empty();
+    }
+
+    /**
+     * Returns an error message.
+     *  @return std::string The string of the error message.
+     */
+    std::string error() const
+    {
+        return m_error.str();
+    }
+
+protected:
+    bool add_shard()
+    {
+        const std::string name = shard_name(m_name, (int)m_shards.size());
+        std::unique_ptr<writer_type> dbw(new writer_type(m_gen, name, m_flags));
+        m_num_last = 0;
+        if (dbw->fail()) {
+            m_error << dbw->error();
+            return false;
+        }
+        m_shards.push_back(std::move(dbw));
+        return true;
+    }
+
+    static std::string base_name(const std::string& path)
+    {
+        const std::string::size_type i = path.find_last_of("/\\");
+        return (i == std::string::npos) ? path : path.substr(i + 1);
+    }
+};
+
+/**
+ * A reader of a sharded database.
+ *
+ *  This class opens the shards listed in the manifest of a sharded
+ *  database, and fans out every query to the shards with a thread pool.
+ *  The results are merged in the order of the shards; for top-k queries,
+ *  the best strings of the shards are merged by their scores, and strings
+ *  of the same score appear in the order of the shards. check() stops
+ *  the shards not yet started once a shard finds a string.
+ *
+ *  @param  reader_tmpl     The type of the reader of a shard.
+ */
+template <class reader_tmpl = reader>
+class sharded_reader
+{
+public:
+    /// The type of the reader of a shard.
+    typedef reader_tmpl reader_type;
+
+protected:
+    /// The readers of the shards.
+    std::vector<std::unique_ptr<reader_type> > m_shards;
+    /// The thread pool querying the shards, or NULL.
+    std::unique_ptr<thread_pool> m_pool;
+    /// The number of threads querying the shards.
+    int m_num_threads;
+    /// The error message.
+    std::stringstream m_error;
+
+public:
+    /**
+     * Constructs an object.
+     */
+    sharded_reader() : m_num_threads(0)
+    {
+    }
+
+    /**
+     * Destructs an object.
+     */
+    virtual ~sharded_reader()
+    {
+        close();
+    }
+
+    /**
+     * Sets the number of threads querying the shards.
+     *  This function must be called before open().
+     *  @param  num_threads The number of threads. Zero uses a thread for
+     *                      every shard up to the number of hardware
+     *                      threads (default); one queries the shards
+     *                      sequentially in the calling thread.
+     */
+    void set_num_threads(int num_threads)
+    {
+        m_num_threads = num_threads;
+    }
+
+    /**
+     * Opens a sharded database.
+     *  The shards are always opened with ::simstring::open_eager, so
+     *  that threads query them at the same time.
+     *  @param  name        The name of the sharded database (manifest).
+     *  @param  flags       The flags for opening the shards.
+     *  @return bool        \c true if the database is successfully opened,
+     *                      \c false otherwise.
+     *  @see    ::simstring::open_eager, ::simstring::open_willneed
+     */
+    bool open(const std::string& name, int flags = 0)
+    {
+        close();
+
+        // Read the manifest.
+        std::ifstream ifs(name.c_str());
+        std::string line;
+        std::getline(ifs, line);
+        if (ifs.fail() || line != SIMSTRING_SHARDS_MAGIC) {
+            m_error << "Failed to read the manifest of a sharded database: " << name;
+            return false;
+        }
+        size_t n = 0;
+        while (std::getline(ifs, line) && line.compare(0, 7, "shards:") != 0) {
+        }
+        std::istringstream(line.substr(std::min(line.size(), (size_t)7))) >> n;
+        if (n == 0) {
+            m_error << "Incorrect manifest of a sharded database: " << name;
+            return false;
+        }
+
+        // Open the shards next to the manifest.
+        const std::string::size_type i = name.find_last_of("/\\");
+        const std::string dir = (i == std::string::npos) ? "" : name.substr(0, i + 1);
+        for (size_t k = 0;k < n;++k) {
+            if (!std::getline(ifs, line) || line.empty()) {
+                close();
+                m_error << "Incorrect manifest of a sharded database: " << name;
+                return false;
+            }
+            std::unique_ptr<reader_type> dbr(new reader_type);
+            if (!dbr->open(dir + line, flags | open_eager)) {
+                // close() clears the error.
+                close();
+                m_error << dbr->error();
+                return false;
+            }
+            if (!m_shards.empty() && dbr->char_size() != m_shards[0]->char_size()) {
+                close();
+                m_error << "Inconsistent character size of the shard: " << dir + line;
+                return false;
+            }
+            m_shards.push_back(std::move(dbr));
+        }
+
+        int num_threads = m_num_threads;
+        if (num_threads <= 0) {
+            num_threads = (int)std::min(
+                n, (size_t)std::max(std::thread::hardware_concurrency(), 1u));
+        }
+        if (1 < num_threads) {
+            m_pool.reset(new thread_pool(num_threads));
+        }
+        return true;
+    }
+
+    /**
+     * Closes the sharded database.
+     */
+    void close()
+    {
+        m_pool.reset();
+        m_shards.clear();
+        m_error.str("");
+    }
+
+    /**
+     * Returns the number of shards.
+     */
+    size_t size() const
+    {
+        return m_shards.size();
+    }
+
+    /**
+     * Returns the reader of a shard.
+     *  @param  k           The number of the shard.
+     */
+    reader_type& shard(size_t k)
+    {
+        return *m_shards[k];
+    }
+
+    /**
+     * Checks whether an error has occurred.
+     *  @return bool    \c true if an error has occurred.
+     */
+    bool fail() const
+    {
+        return !m_error.str().empty();
+    }
+
+    /**
+     * Returns an error message.
+     *  @return std::string The string of the error message.
+     */
+    std::string error() const
+    {
+        return m_error.str();
+    }
+
+    /**
+     * Returns the size of characters of the database.
+     */
+    int char_size() const
+    {
+        return m_shards.empty() ? 0 : m_shards[0]->char_size();
+    }
+
+    /**
+     * Retrieves strings that are similar to the query from the shards.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings, in the order of the shards.
+     *  @see    reader_base::retrieve()
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins
+        )
+    {
+        std::vector<std::vector<string_type> > results(m_shards.size());
+        this->for_each_shard([&](size_t k) {
+            m_shards[k]->retrieve(query, measure, alpha, std::back_inserter(results[k]));
+        });
+        for (size_t k = 0;k < results.size();++k) {
+            std::copy(results[k].begin(), results[k].end(), ins);
+        }
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query from the shards.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score
+     *                          (std::pair<string_type, double>), from the
+     *                          most similar one.
+     *  @see    reader_base::retrieve_topk()
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        insert_iterator ins
+        )
+    {
+        typedef std::pair<string_type, double> scored_type;
+        std::vector<std::vector<scored_type> > results(m_shards.size());
+        this->for_each_shard([&](size_t s) {
+            m_shards[s]->retrieve_topk(query, measure, k, std::back_inserter(results[s]));
+        });
+
+        // Merge the best strings of the shards; a stable sort keeps the
+        // order of the shards for the same score.
+        std::vector<scored_type> merged;
+        for (size_t s = 0;s < results.size();++s) {
+            merged.insert(merged.end(), results[s].begin(), results[s].end());
+        }
+        std::stable_sort(merged.begin(), merged.end(),
+            [](const scored_type& x, const scored_type& y) {
+                return x.second > y.second;
+            });
+        if (0 <= k && (size_t)k < merged.size()) {
+            merged.resize(k);
+        }
+        std::copy(merged.begin(), merged.end(), ins);
+    }
+
+    /**
+     * Checks whether a shard has a string similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @return bool            \c true if a similar string is found.
+     *  @see    reader_base::check()
+     */
+    template <class string_type>
+    bool check(
+        const string_type& query,
+        int measure,
+        double alpha
+        )
+    {
+        std::atomic<bool> found(false);
+        this->for_each_shard([&](size_t k) {
+            if (!found && m_shards[k]->check(query, measure, alpha)) {
+                found = true;
+            }
+        });
+        return found;
+    }
+
+protected:
+    /**
+     * Calls a function for every shard with the thread pool.
+     */
+    template <class function_type>
+    void for_each_shard(function_type func)
+    {
+        if (m_pool) {
+            parallel_for(*m_pool, m_shards.size(), 1, func);
+        } else {
+            for (size_t k = 0;k < m_shards.size();++k) {
+                func(k);
+            }
+        }
+    }
+};
+
+/** @} */
+
+};
+
+#endif/*__SIMSTRING_SHARDED_H__*/
@@ -35,27 +35,42 @@
 
 #include <stdint.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <typeinfo>
+#include <unordered_set>
 #include <vector>
 
 #include "ngram.h"
 #include "measure.h"
+#include "cache.h"
 #include "cdbpp.h"
+#include "filter.h"
+#include "intersect.h"
+#include "postings.h"
 #include "memory_mapped_file.h"
+#include "stats.h"
+#include "thread_pool.h"
 
 #define	SIMSTRING_NAME           "SimString"
 #define	SIMSTRING_COPYRIGHT      "Copyright (c) 2009-2011 Naoaki Okazaki"
 #define	SIMSTRING_MAJOR_VERSION  1
 #define SIMSTRING_MINOR_VERSION  1
-#define SIMSTRING_STREAM_VERSION 2
+#define SIMSTRING_STREAM_VERSION 3
+#define SIMSTRING_STREAM_VERSION_MIN 2
 
 /** 
  * \addtogroup api SimString C++ API
@@ -71,6 +86,51 @@ enum {
     BYTEORDER_CHECK = 0x62445371,
 };
 
+/**
+ * Flags of n-grams in the file header.
+ */
+enum {
+    /// N-grams encode begins and ends of strings.
+    NGRAM_BE = 0x0001,
+    /// N-grams are represented by hash values (hashed_ngram_generator).
+    NGRAM_HASHED = 0x0002,
+};
+
+/**
+ * Features of the database format in the file header.
+ *  A database using none of these is written in stream version 2, which
+ *  has no field for the features.
+ */
+enum {
+    /// Posting lists are compressed (see postings.h).
+    FEATURE_COMPRESSED = 0x0001,
+    /// SIDs are the ordinal numbers of strings, which a table of 64-bit
+    /// offsets maps to the positions in the master file.
+    FEATURE_LARGE = 0x0002,
+    /// The indices store short n-grams in their hash tables (CDB++
+    /// version 3).
+    FEATURE_INLINE_KEYS = 0x0004,
+    /// The master file contains the indices as CDB++ chunks, which a
+    /// directory of their offsets and sizes (two uint64_t values for each
+    /// size of strings) locates.
+    FEATURE_SINGLE_FILE = 0x0008,
+    /// The strings are in UTF-8, and the n-grams consist of code points
+    /// (see utf8_ngrams()) instead of bytes.
+    FEATURE_UTF8 = 0x0010,
+    /// The n-grams are represented by hash values (::simstring::NGRAM_HASHED);
+    /// the feature makes readers of stream version 2, which do not know
+    /// the n-gram flag, reject the database.
+    FEATURE_HASHED = 0x0020,
+};
+
+/*
+ * After the features, the header of a database with FEATURE_LARGE or
+ * FEATURE_SINGLE_FILE stores the 64-bit size of the master file (the
+ * 32-bit field is then zero), followed by the offset to the table of
+ * string offsets (FEATURE_LARGE) and the offset to the directory of the
+ * indices (FEATURE_SINGLE_FILE).
+ */
+
 /**
  * Query types.
  */
@@ -87,6 +147,115 @@ enum {
     overlap,
 };
 
+/**
+ * Flags for opening a database.
+ */
+enum {
+    /// Open all the indices when the database is opened. Otherwise, an
+    /// index is opened when a query accesses it for the first time. A
+    /// reader opened with this flag can serve queries from multiple
+    /// threads at the same time.
+    open_eager = 0x0001,
+    /// Advise the system that the database is accessed randomly, so that
+    /// page faults do not read ahead (MADV_RANDOM).
+    open_random = 0x0002,
+    /// Ask the system to read the database ahead in the background
+    /// (MADV_WILLNEED, PrefetchVirtualMemory).
+    open_willneed = 0x0004,
+    /// Load the whole database into memory when it is opened
+    /// (MAP_POPULATE).
+    open_populate = 0x0008,
+    /// Back the database by transparent huge pages where the system
+    /// supports them for mapped files (MADV_HUGEPAGE).
+    open_hugepages = 0x0010,
+    /// Lock the database in RAM (mlock, VirtualLock). Opening the
+    /// database fails if the memory cannot be locked, e.g., beyond
+    /// RLIMIT_MEMLOCK.
+    open_lock = 0x0020,
+};
+
+/**
+ * Translates the flags for opening a database into the hints on the use
+ * of mapped memory, except for locking.
+ *  @param  flags       The flags for opening a database.
+ *  @return int         The hints for memory_mapped_file::open().
+ */
+inline int mapping_advice(int flags)
+{
+    int advice = 0;
+    if (flags & open_random) {
+        advice |= memory_mapped_file::advise_random;
+    }
+    if (flags & open_willneed) {
+        advice |= memory_mapped_file::advise_willneed;
+    }
+    if (flags & open_populate) {
+        advice |= memory_mapped_file::advise_populate;
+    }
+    if (flags & open_hugepages) {
+        advice |= memory_mapped_file::advise_hugepage;
+    }
+    return advice;
+}
+
+/**
+ * Flags for building a database.
+ */
+enum {
+    /// Compress posting lists in the indices. The database is written in
+    /// stream version 3, which older readers reject.
+    store_compressed = 0x0001,
+    /// Allow the master file to grow beyond 4 GB (see FEATURE_LARGE). The
+    /// database is written in stream version 3, which older readers
+    /// reject. Without this flag, a writer fails when the master file
+    /// reaches 4 GB.
+    store_large = 0x0002,
+    /// Store short n-grams in the hash tables of the indices, which saves
+    /// a memory access per n-gram of a query. The database is written in
+    /// stream version 3, which older readers reject.
+    store_inline_keys = 0x0004,
+    /// Store the indices in the master file instead of a file for every
+    /// size of strings (see FEATURE_SINGLE_FILE). The database is written
+    /// in stream version 3, which older readers reject.
+    store_single_file = 0x0008,
+    /// Append the strings to an existing database as a new delta segment
+    /// (see segment_name()) instead of overwriting it. A reader queries
+    /// the database together with its segments. Without an existing
+    /// database, the writer creates it as usual.
+    store_append = 0x0010,
+    /// Store a filter of the n-grams in every index (see ngram_filter),
+    /// with which a reader skips the look-ups of query n-grams missing in
+    /// the index, and the indices that cannot have enough matches. The
+    /// filter is stored as the value of the empty key, which older
+    /// readers never look up.
+    store_ngram_filters = 0x0020,
+};
+
+/**
+ * Returns the name of a delta segment of a database.
+ *  The k-th segment (from one) appended to a database \c name is a
+ *  database named \c name.sk, whose strings deleted from the older
+ *  segments are listed in \c name.sk.del.
+ *  @param  name        The name of the database.
+ *  @param  k           The number of the segment.
+ *  @return std::string The name of the segment.
+ */
+inline std::string segment_name(const std::string& name, int k)
+{
+    std::stringstream ss;
+    ss << name << ".s" << k;
+    return ss.str();
+}
+
+/**
+ * Checks whether a file exists.
+ */
+inline bool file_exists(const std::string& name)
+{
+    std::ifstream ifs(name.c_str(), std::ios::binary);
+    return ifs.is_open();
+}
+
 
 
 /**
@@ -121,17 +290,35 @@ public:
     typedef ngram_generator_tmpl ngram_generator_type;
     /// The type representing a character.
     typedef typename string_type::value_type char_type;
+    /// The type representing an n-gram.
+    typedef typename ngram_traits<ngram_generator_type, string_type>::ngram_type ngram_type;
 
 protected:
     /// The type of an array of n-grams.
-    typedef std::vector<string_type> ngrams_type;
+    typedef std::vector<ngram_type> ngrams_type;
     /// The vector type of values associated with an n-gram.
     typedef std::vector<value_type> values_type;
     /// The type implementing an index (associations from n-grams to values).
-    typedef std::map<string_type, values_type> hashdb_type;
+    typedef std::map<ngram_type, values_type> hashdb_type;
     /// The vector of indices for different n-gram sizes.
     typedef std::vector<hashdb_type> indices_type;
 
+    /// A sorted run of postings spilled to a temporary file.
+    struct run_type
+    {
+        /// The name of the temporary file.
+        std::string name;
+        /// The file offset of each index in the run (-1 for no postings).
+        std::vector<std::streamoff> offsets;
+    };
+    /// The array of runs.
+    typedef std::vector<run_type> runs_type;
+    /// A string waiting for insertion and its value.
+    typedef std::vector<std::pair<string_type, value_type> > pending_type;
+
+    /// The number of strings inserted at a time by multiple threads.
+    enum { BATCH_SIZE = 65536 };
+
 protected:
     /// The vector of indices.
     indices_type m_indices;
@@ -139,14 +326,34 @@ protected:
     const ngram_generator_type& m_gen;
     /// The error message.
     std::stringstream m_error;
+    /// The runs spilled to temporary files.
+    runs_type m_runs;
+    /// The memory budget for the indices in bytes (zero for no limit).
+    size_t m_memory_budget;
+    /// The estimated memory usage of the indices in bytes.
+    size_t m_memory_used;
+    /// The prefix of temporary files.
+    std::string m_temp_prefix;
+    /// The flags for building the database.
+    int m_flags;
+    /// The thread pool for building the database (NULL for one thread).
+    std::unique_ptr<thread_pool> m_pool;
+    /// The strings waiting for insertion by the thread pool.
+    pending_type m_pending;
+    /// The n-grams of the string being inserted, reused by insertions.
+    ngrams_type m_ngrams;
+    /// The mutex for reporting errors from multiple threads.
+    std::mutex m_mutex;
 
 public:
     /**
      * Constructs an object.
      *  @param  gen             The n-gram generator.
+     *  @param  flags           The flags for building the database.
+     *  @see    ::simstring::store_compressed
      */
-    ngramdb_writer_base(const ngram_generator_type& gen)
-        : m_gen(gen)
+    ngramdb_writer_base(const ngram_generator_type& gen, int flags = 0)
+        : m_gen(gen), m_memory_budget(0), m_memory_used(0), m_flags(flags)
     {
     }
 
@@ -155,6 +362,7 @@ public:
      */
     virtual ~ngramdb_writer_base()
     {
+        remove_runs();
     }
 
     /**
@@ -162,17 +370,64 @@ public:
      */
     void clear()
     {
+        remove_runs();
+        m_pending.clear();
         m_indices.clear();
+        m_memory_used = 0;
         m_error.str("");
     }
 
+    /**
+     * Limits the memory used for buffering the indices.
+     *  When the estimated size of the indices exceeds the budget, the
+     *  postings are written to a temporary file as a sorted run, and the
+     *  runs are merged into the database by store(). The database is
+     *  identical to the one built without the limit.
+     *  @param  budget      The memory budget in bytes. Zero disables the
+     *                      limit (default).
+     *  @param  prefix      The prefix of temporary file names. An empty
+     *                      string keeps the current prefix.
+     */
+    void set_memory_budget(size_t budget, const std::string& prefix = "")
+    {
+        m_memory_budget = budget;
+        if (!prefix.empty()) {
+            m_temp_prefix = prefix;
+        }
+    }
+
+    /**
+     * Sets the number of threads for building the database.
+     *  With multiple threads, inserted strings are buffered and processed
+     *  in batches: the threads generate n-grams for slices of a batch into
+     *  partial indices, and then merge the partial indices of each size
+     *  in parallel. store() also writes the indices in parallel. The
+     *  database is identical to the one built with a single thread.
+     *  @param  num_threads The number of threads. Zero uses the number of
+     *                      hardware threads; one disables the threads
+     *                      (default).
+     */
+    bool set_num_threads(int num_threads)
+    {
+        // Insert the strings buffered for the current threads.
+        bool b = this->flush();
+        m_pool.reset();
+        if (num_threads != 1) {
+            m_pool.reset(new thread_pool(num_threads));
+            if (m_pool->size() == 1) {
+                m_pool.reset();
+            }
+        }
+        return b;
+    }
+
     /**
      * Checks whether the database is empty.
      *  @return bool    \c true if the database is empty, \c false otherwise.
      */
     bool empty()
     {
-        return m_indices.empty();
+        return m_indices.empty() && m_pending.empty();
     }
 
     /**
@@ -209,9 +464,18 @@ public:
      */
     bool insert(const string_type& key, const value_type& value)
     {
+        // Defer the insertion to a batch for the threads.
+        if (m_pool) {
+            m_pending.push_back(std::make_pair(key, value));
+            if (BATCH_SIZE <= m_pending.size()) {
+                return this->flush();
+            }
+            return true;
+        }
+
         // Generate n-grams from the key string.
-        ngrams_type ngrams;
-        m_gen(key, std::back_inserter(ngrams));
+        ngrams_type& ngrams = m_ngrams;
+        m_gen.generate(key, ngrams);
         if (ngrams.empty()) {
             return false;
         }
@@ -226,17 +490,28 @@ public:
         // Store the associations from the n-grams to the value.
         typename ngrams_type::const_iterator it;
         for (it = ngrams.begin();it != ngrams.end();++it) {
-            const string_type& ngram = *it;
+            const ngram_type& ngram = *it;
             typename hashdb_type::iterator iti = index.find(ngram);
             if (iti == index.end()) {
                 // Create a new posting array.
                 values_type v(1);
                 v[0] = value;
                 index.insert(typename hashdb_type::value_type(ngram, v));
+                // A tree node with the key and the posting array.
+                m_memory_used +=
+                    sizeof(typename hashdb_type::value_type) +
+                    4 * sizeof(void*) +
+                    ngram_key_size(ngram);
             } else {
                 // Append the value to the existing posting array.
                 iti->second.push_back(value);
             }
+            m_memory_used += sizeof(value_type);
+        }
+
+        // Spill the indices to a run when they exceed the memory budget.
+        if (m_memory_budget != 0 && m_memory_budget <= m_memory_used) {
+            return this->spill();
         }
 
         return true;
@@ -250,54 +525,531 @@ public:
      */
     bool store(const std::string& base)
     {
+        if (!this->prepare_store()) {
+            return false;
+        }
+
         // Write out all the indices to files.
+        bool b = this->for_each_index([&](int i) {
+            if (this->index_empty(i)) {
+                return true;
+            }
+            std::stringstream ss;
+            ss << base << '.' << i+1 << ".cdb";
+            const std::string name = ss.str();
+
+            // Open the database file with binary mode.
+            std::ofstream ofs(name.c_str(), std::ios::binary);
+            if (ofs.fail()) {
+                this->report("Failed to open a file for writing: " + name);
+                return false;
+            }
+            return this->store_index(ofs, i);
+        });
+
+        remove_runs();
+        return b;
+    }
+
+    /**
+     * Stores the n-gram database to a stream as consecutive CDB++ chunks.
+     *  Every chunk starts at a 64-bit boundary of the stream.
+     *  @param  ofs         The output stream.
+     *  @param  directory   The vector receiving the offset and size of the
+     *                      chunk of every index (zeros for empty indices).
+     *  @return bool        \c true if the database is successfully stored,
+     *                      \c false otherwise.
+     */
+    bool store(std::ofstream& ofs, std::vector<uint64_t>& directory)
+    {
+        if (!this->prepare_store()) {
+            return false;
+        }
+
+        bool b = true;
+        directory.assign(2 * m_indices.size(), 0);
         for (int i = 0;i < (int)m_indices.size();++i) {
-            if (!m_indices[i].empty()) {
-                std::stringstream ss;
-                ss << base << '.' << i+1 << ".cdb";
-                bool b = this->store(ss.str(), m_indices[i]);
-                if (!b) {
-                    return false;
-                }
+            if (this->index_empty(i)) {
+                continue;
+            }
+            while ((std::streamoff)ofs.tellp() % 64 != 0) {
+                ofs.put(0);
             }
+            const uint64_t begin = (uint64_t)(std::streamoff)ofs.tellp();
+            if (!this->store_index(ofs, i)) {
+                b = false;
+                break;
+            }
+            directory[2*i] = begin;
+            directory[2*i+1] = (uint64_t)(std::streamoff)ofs.tellp() - begin;
         }
 
-        return true;
+        remove_runs();
+        return b;
     }
 
 protected:
-    bool store(const std::string& name, const hashdb_type& index)
+    bool prepare_store()
     {
-        // Open the database file with binary mode.
-        std::ofstream ofs(name.c_str(), std::ios::binary);
-        if (ofs.fail()) {
-            m_error << "Failed to open a file for writing: " << name;
+        // The compressed format stores 32-bit values only.
+        if ((m_flags & store_compressed) && sizeof(value_type) != sizeof(uint32_t)) {
+            m_error << "Compressed postings require 32-bit values";
+            return false;
+        }
+
+        // Insert the strings remaining in the batch.
+        if (!this->flush()) {
             return false;
         }
 
+        // Spill the postings remaining in memory as the last run if the
+        // indices have been spilled, so that all indices are merged from
+        // the runs.
+        if (!m_runs.empty()) {
+            return this->spill();
+        }
+        return true;
+    }
+
+    bool index_empty(int i) const
+    {
+        if (m_runs.empty()) {
+            return m_indices[i].empty();
+        }
+        for (size_t r = 0;r < m_runs.size();++r) {
+            const run_type& run = m_runs[r];
+            if (i < (int)run.offsets.size() && 0 <= run.offsets[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool store_index(std::ofstream& ofs, int i)
+    {
+        if (!m_runs.empty()) {
+            return this->store_runs(ofs, i);
+        }
+        return this->store(ofs, m_indices[i]);
+    }
+
+    bool store(std::ofstream& ofs, const hashdb_type& index)
+    {
         try {
             // Open a CDB++ writer.
-            cdbpp::builder dbw(ofs);
+            cdbpp::builder dbw(ofs, (m_flags & store_inline_keys) != 0);
+            std::vector<char> buffer;
+            ngram_filter_builder filter;
 
             // Put associations: n-gram -> values.
             typename hashdb_type::const_iterator it;
             for (it = index.begin();it != index.end();++it) {
                 // Put an association from an n-gram to its values. 
-                dbw.put(
-                    it->first.c_str(),
-                    sizeof(char_type) * it->first.length(),
-                    &it->second[0],
-                    sizeof(it->second[0]) * it->second.size()
+                this->put(dbw, it->first, it->second, buffer, filter);
+            }
+            this->put_filter(dbw, filter, buffer);
+
+        } catch (const cdbpp::builder_exception& e) {
+            this->report(std::string("CDB++ error: ") + e.what());
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Inserts the strings buffered for the thread pool.
+     *  Every thread inserts the n-grams of a contiguous slice of the batch
+     *  into its partial indices. The partial indices of each size are then
+     *  merged in the order of the slices, so that the postings remain in
+     *  the order of insertion.
+     */
+    bool flush()
+    {
+        if (m_pending.empty()) {
+            return true;
+        }
+
+        const size_t n = m_pending.size();
+        const size_t num_slices = (size_t)m_pool->size();
+        const size_t slice = (n + num_slices - 1) / num_slices;
+        std::vector<indices_type> partials(num_slices);
+
+        // Generate n-grams into partial indices.
+        parallel_for(*m_pool, num_slices, 1, [&](size_t t) {
+            indices_type& partial = partials[t];
+            ngrams_type ngrams;
+            const size_t last = std::min(n, slice * (t + 1));
+            for (size_t i = slice * t;i < last;++i) {
+                m_gen.generate(m_pending[i].first, ngrams);
+                if (ngrams.empty()) {
+                    continue;
+                }
+                if (partial.size() < ngrams.size()) {
+                    partial.resize(ngrams.size());
+                }
+                hashdb_type& index = partial[ngrams.size()-1];
+                typename ngrams_type::const_iterator it;
+                for (it = ngrams.begin();it != ngrams.end();++it) {
+                    index[*it].push_back(m_pending[i].second);
+                }
+            }
+        });
+        m_pending.clear();
+
+        // Merge the partial indices of each size.
+        size_t max_size = m_indices.size();
+        for (size_t t = 0;t < num_slices;++t) {
+            max_size = std::max(max_size, partials[t].size());
+        }
+        m_indices.resize(max_size);
+        std::vector<size_t> used(max_size, 0);
+        parallel_for(*m_pool, max_size, 1, [&](size_t i) {
+            hashdb_type& index = m_indices[i];
+            for (size_t t = 0;t < num_slices;++t) {
+                if (partials[t].size() <= i) {
+                    continue;
+                }
+                hashdb_type& partial = partials[t][i];
+                typename hashdb_type::iterator it;
+                for (it = partial.begin();it != partial.end();++it) {
+                    used[i] += sizeof(value_type) * it->second.size();
+                    typename hashdb_type::iterator iti = index.find(it->first);
+                    if (iti == index.end()) {
+                        iti = index.insert(typename hashdb_type::value_type(
+                            it->first, values_type())).first;
+                        iti->second.swap(it->second);
+                        used[i] +=
+                            sizeof(typename hashdb_type::value_type) +
+                            4 * sizeof(void*) +
+                            ngram_key_size(it->first);
+                    } else {
+                        iti->second.insert(
+                            iti->second.end(),
+                            it->second.begin(),
+                            it->second.end()
+                            );
+                    }
+                }
+                hashdb_type().swap(partial);
+            }
+        });
+
+        for (size_t i = 0;i < max_size;++i) {
+            m_memory_used += used[i];
+        }
+
+        // Spill the indices to a run when they exceed the memory budget.
+        if (m_memory_budget != 0 && m_memory_budget <= m_memory_used) {
+            return this->spill();
+        }
+        return true;
+    }
+
+    /**
+     * Calls a function for every index, in parallel with the thread pool.
+     *  @param  func        The function called with the position of an
+     *                      index; it returns \c false on failure.
+     *  @return bool        \c false if any call failed.
+     */
+    template <class function_type>
+    bool for_each_index(function_type func)
+    {
+        const size_t n = m_indices.size();
+        if (!m_pool) {
+            for (size_t i = 0;i < n;++i) {
+                if (!func((int)i)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        std::vector<char> ok(n, 1);
+        parallel_for(*m_pool, n, 1, [&](size_t i) {
+            ok[i] = func((int)i) ? 1 : 0;
+        });
+        return std::find(ok.begin(), ok.end(), 0) == ok.end();
+    }
+
+    /**
+     * Appends an error message; tasks of the thread pool share m_error.
+     */
+    void report(const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error << message;
+    }
+
+    /**
+     * Writes the indices to a temporary file as a sorted run.
+     *  A run consists of the indices in ascending order of n-gram sizes;
+     *  each index is a sequence of (n-gram, postings) records sorted by
+     *  n-grams, preceded by the number of the records.
+     */
+    bool spill()
+    {
+        std::stringstream ss;
+        ss << m_temp_prefix << '.' << m_runs.size() << ".run";
+
+        run_type run;
+        run.name = ss.str();
+        run.offsets.resize(m_indices.size(), -1);
+
+        std::ofstream ofs(run.name.c_str(), std::ios::binary);
+        if (ofs.fail()) {
+            m_error << "Failed to open a temporary file for writing: " << run.name;
+            return false;
+        }
+
+        for (int i = 0;i < (int)m_indices.size();++i) {
+            hashdb_type& index = m_indices[i];
+            if (index.empty()) {
+                continue;
+            }
+
+            run.offsets[i] = (std::streamoff)ofs.tellp();
+            write_run_uint32(ofs, (uint32_t)index.size());
+
+            typename hashdb_type::const_iterator it;
+            for (it = index.begin();it != index.end();++it) {
+                write_run_uint32(ofs, (uint32_t)ngram_key_size(it->first));
+                ofs.write(
+                    reinterpret_cast<const char*>(ngram_key_data(it->first)),
+                    ngram_key_size(it->first)
                     );
+                write_run_uint32(ofs, (uint32_t)it->second.size());
+                ofs.write(
+                    reinterpret_cast<const char*>(&it->second[0]),
+                    sizeof(value_type) * it->second.size()
+                    );
+            }
+
+            // Keep the index slot so that max_size() is preserved.
+            index.clear();
+        }
+
+        m_runs.push_back(run);
+        m_memory_used = 0;
+
+        if (ofs.fail()) {
+            m_error << "Failed to write a temporary file: " << run.name;
+            return false;
+        }
+        return true;
+    }
+
+    /// A cursor reading the records of an index in a run.
+    struct run_reader
+    {
+        std::ifstream       ifs;
+        uint32_t            num;
+        ngram_type          key;
+        std::vector<char>   buffer;
+        values_type         values;
+
+        bool next()
+        {
+            if (num == 0) {
+                return false;
+            }
+            --num;
+
+            uint32_t len = read_run_uint32(ifs);
+            buffer.resize(len + 1);
+            ifs.read(&buffer[0], len);
+            ngram_key_assign(key, &buffer[0], len);
+
+            len = read_run_uint32(ifs);
+            values.resize(len);
+            if (0 < len) {
+                ifs.read(reinterpret_cast<char*>(&values[0]), sizeof(value_type) * len);
             }
+            return !ifs.fail();
+        }
+    };
+
+    /// Orders run readers by their current keys; earlier runs go first.
+    struct run_reader_greater
+    {
+        bool operator()(
+            const std::pair<run_reader*, size_t>& x,
+            const std::pair<run_reader*, size_t>& y
+            ) const
+        {
+            if (y.first->key < x.first->key) return true;
+            if (x.first->key < y.first->key) return false;
+            return (x.second > y.second);
+        }
+    };
+
+    /// A run reader and the index of its run.
+    typedef std::pair<run_reader*, size_t> run_entry_type;
+    /// A priority queue of run readers (the smallest key on the top).
+    typedef std::priority_queue<
+        run_entry_type, std::vector<run_entry_type>, run_reader_greater
+        > run_heap_type;
+
+    /**
+     * Merges the postings of an index in the runs into a stream.
+     */
+    bool store_runs(std::ofstream& ofs, int i)
+    {
+        std::vector<run_reader*> readers;
+        run_heap_type heap;
+        bool b = true;
+
+        // Position a reader at the index in every run that has one.
+        for (size_t r = 0;r < m_runs.size();++r) {
+            const run_type& run = m_runs[r];
+            if (i < (int)run.offsets.size() && 0 <= run.offsets[i]) {
+                run_reader* rd = new run_reader;
+                readers.push_back(rd);
+                rd->ifs.open(run.name.c_str(), std::ios::binary);
+                rd->ifs.seekg(run.offsets[i]);
+                rd->num = read_run_uint32(rd->ifs);
+                if (rd->ifs.fail() || !rd->next()) {
+                    this->report("Failed to read a temporary file: " + run.name);
+                    b = false;
+                    break;
+                }
+                heap.push(run_entry_type(rd, r));
+            }
+        }
+
+        if (b) {
+            b = this->merge_runs(ofs, heap);
+        }
+
+        for (size_t r = 0;r < readers.size();++r) {
+            delete readers[r];
+        }
+        return b;
+    }
+
+    bool merge_runs(std::ofstream& ofs, run_heap_type& heap)
+    {
+        try {
+            // Open a CDB++ writer.
+            cdbpp::builder dbw(ofs, (m_flags & store_inline_keys) != 0);
+            ngram_type key;
+            values_type values;
+            std::vector<char> buffer;
+            ngram_filter_builder filter;
+
+            while (!heap.empty()) {
+                // Concatenate the postings of the smallest key; runs are
+                // chronological, so the values remain sorted.
+                key = heap.top().first->key;
+                values.clear();
+                while (!heap.empty() && !(key < heap.top().first->key)) {
+                    run_entry_type e = heap.top();
+                    heap.pop();
+                    values.insert(
+                        values.end(),
+                        e.first->values.begin(),
+                        e.first->values.end()
+                        );
+                    if (e.first->next()) {
+                        heap.push(e);
+                    } else if (e.first->ifs.fail()) {
+                        this->report("Failed to read a temporary file: " + m_runs[e.second].name);
+                        return false;
+                    }
+                }
+
+                // Put an association from an n-gram to its values.
+                this->put(dbw, key, values, buffer, filter);
+            }
+            this->put_filter(dbw, filter, buffer);
 
         } catch (const cdbpp::builder_exception& e) {
-            m_error << "CDB++ error: " << e.what();
+            this->report(std::string("CDB++ error: ") + e.what());
             return false;
         }
 
         return true;
     }
+
+    /**
+     * Puts the postings of an n-gram to an index.
+     *  @param  dbw         The CDB++ writer of the index.
+     *  @param  key         The n-gram.
+     *  @param  values      The postings.
+     *  @param  buffer      The working buffer for compressing the postings.
+     *  @param  filter      The filter of the n-grams in the index, which
+     *                      receives the n-gram with ::store_ngram_filters.
+     */
+    void put(
+        cdbpp::builder& dbw,
+        const ngram_type& key,
+        const values_type& values,
+        std::vector<char>& buffer,
+        ngram_filter_builder& filter
+        )
+    {
+        if (m_flags & store_ngram_filters) {
+            filter.insert(ngram_key_data(key), ngram_key_size(key));
+        }
+        if (m_flags & store_compressed) {
+            postings::encode(
+                reinterpret_cast<const uint32_t*>(&values[0]),
+                values.size(),
+                buffer
+                );
+            dbw.put(
+                ngram_key_data(key),
+                ngram_key_size(key),
+                &buffer[0],
+                buffer.size()
+                );
+        } else {
+            dbw.put(
+                ngram_key_data(key),
+                ngram_key_size(key),
+                &values[0],
+                sizeof(values[0]) * values.size()
+                );
+        }
+    }
+
+    /**
+     * Puts the filter of the n-grams to an index with ::store_ngram_filters.
+     *  @param  dbw         The CDB++ writer of the index.
+     *  @param  filter      The filter of the n-grams in the index.
+     *  @param  buffer      The working buffer for the filter.
+     */
+    void put_filter(
+        cdbpp::builder& dbw,
+        const ngram_filter_builder& filter,
+        std::vector<char>& buffer
+        )
+    {
+        if (m_flags & store_ngram_filters) {
+            filter.build(buffer);
+            dbw.put("", 0, &buffer[0], buffer.size());
+        }
+    }
+
+    void remove_runs()
+    {
+        for (size_t r = 0;r < m_runs.size();++r) {
+            std::remove(m_runs[r].name.c_str());
+        }
+        m_runs.clear();
+    }
+
+    static void write_run_uint32(std::ofstream& ofs, uint32_t value)
+    {
+        ofs.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static uint32_t read_run_uint32(std::ifstream& ifs)
+    {
+        uint32_t value = 0;
+        ifs.read(reinterpret_cast<char *>(&value), sizeof(value));
+        return value;
+    }
 };
 
 
@@ -336,12 +1088,29 @@ public:
     typedef ngramdb_writer_base<string_tmpl, uint32_t, ngram_generator_tmpl> base_type;
 
 protected:
+    /// The size of the buffer for writing strings to the master file.
+    enum { BUFFER_SIZE = 0x100000 };
+
     /// The base name of the database.
     std::string m_name;
     /// The output stream for the string collection.
     std::ofstream m_ofs;
+    /// The size of the master file written so far.
+    uint64_t m_size;
+    /// The strings waiting for being written to the master file.
+    std::vector<char> m_buffer;
     /// The number of strings in the database.
     int m_num_entries;
+    /// The offsets of strings in the master file (store_large).
+    std::vector<uint64_t> m_offsets;
+    /// The offset to the table of string offsets (store_large).
+    uint64_t m_table_offset;
+    /// The offset to the directory of the indices (store_single_file).
+    uint64_t m_directory_offset;
+    /// Whether the writer appends a delta segment (store_append).
+    bool m_segment;
+    /// The strings deleted from the older segments.
+    std::vector<std::string> m_deleted;
 
 public:
     /**
@@ -349,7 +1118,7 @@ public:
      *  @param  gen         The n-gram generator used by this writer.
      */
     writer_base(const ngram_generator_type& gen)
-        : base_type(gen), m_num_entries(0)
+        : base_type(gen), m_size(0), m_num_entries(0), m_table_offset(0), m_directory_offset(0), m_segment(false)
     {
     }
 
@@ -357,14 +1126,18 @@ public:
      * Constructs a writer object by opening a database.
      *  @param  gen         The n-gram generator used by this writer.
      *  @param  name        The name of the database.
+     *  @param  flags       The flags for building the database.
+     *  @see    ::simstring::store_compressed, ::simstring::store_large,
+     *          ::simstring::store_inline_keys, ::simstring::store_single_file
      */
     writer_base(
         const ngram_generator_type& gen,
-        const std::string& name
+        const std::string& name,
+        int flags = 0
         )
-        : base_type(gen), m_num_entries(0)
+        : base_type(gen), m_size(0), m_num_entries(0), m_table_offset(0), m_directory_offset(0), m_segment(false)
     {
-        this->open(name);
+        this->open(name, flags);
     }
 
     /**
@@ -378,17 +1151,48 @@ public:
     /**
      * Opens a database.
      *  @param  name        The name of the database.
+     *  @param  flags       The flags for building the database.
      *  @return bool        \c true if the database is successfully opened,
      *                      \c false otherwise.
+     *  @see    ::simstring::store_compressed, ::simstring::store_large,
+     *          ::simstring::store_inline_keys, ::simstring::store_single_file,
+     *          ::simstring::store_append, ::simstring::store_ngram_filters
      */
-    bool open(const std::string& name)
+    bool open(const std::string& name, int flags = 0)
     {
         m_num_entries = 0;
+        m_offsets.clear();
+        m_table_offset = 0;
+        m_directory_offset = 0;
+        m_deleted.clear();
+        this->m_flags = flags;
+
+        // N-grams of code points are generated from strings of bytes.
+        if (this->m_gen.get_utf8() && sizeof(char_type) != 1) {
+            this->m_error << "N-grams of code points require strings in UTF-8";
+            return false;
+        }
+
+        // Write a new delta segment if the database exists.
+        std::string path = name;
+        m_segment = false;
+        if ((flags & store_append) && file_exists(name)) {
+            // The segment must generate the n-grams of the database.
+            if (!this->check_base(name)) {
+                return false;
+            }
+            int k = 1;
+            while (file_exists(segment_name(name, k))) {
+                ++k;
+            }
+            path = segment_name(name, k);
+            m_segment = true;
+        }
 
         // Open the master file for writing.
-        m_ofs.open(name.c_str(), std::ios::binary);
+        m_ofs.open(path.c_str(), std::ios::binary);
         if (m_ofs.fail()) {
-            this->m_error << "Failed to open a file for writing: " << name;
+            this->m_error << "Failed to open a file for writing: " << path;
             return false;
         }
 
@@ -398,7 +1202,13 @@ public:
             return false;
         }
 
-        m_name = name;
+        // Temporary files for spilled runs are created next to the database.
+        if (this->m_temp_prefix.empty()) {
+            this->m_temp_prefix = path;
+        }
+
+        m_name = path;
+        m_size = (uint64_t)(std::streamoff)m_ofs.tellp();
         return true;
     }
 
@@ -413,19 +1223,36 @@ public:
         bool b = true;
 
         // Write the n-gram database to files.
-        if (!m_name.empty()) {
+        if (!m_name.empty() && !(this->m_flags & store_single_file)) {
             b &= this->store(m_name);
         }
 
-        // Finalize the file header, and close the file.
+        // Write the table of string offsets and the indices stored in the
+        // master file, finalize the file header, and close the file.
         if (m_ofs.is_open()) {
+            b &= this->write_buffer();
+            if (this->m_flags & store_large) {
+                b &= this->write_offsets(m_ofs);
+            }
+            if (!m_name.empty() && (this->m_flags & store_single_file)) {
+                b &= this->write_indices(m_ofs);
+            }
             b &= this->write_header(m_ofs);
             m_ofs.close();
         }
 
+        // Write the list of deleted strings of a segment.
+        if (!m_name.empty() && !m_deleted.empty()) {
+            b &= this->write_deleted(m_name + ".del");
+        }
+
         // Initialize the members.
         m_name.clear();
+        m_size = 0;
+        m_buffer.clear();
         m_num_entries = 0;
+        m_offsets.clear();
+        m_deleted.clear();
         return b;
     }
 
@@ -437,27 +1264,145 @@ public:
      */
     bool insert(const string_type& str)
     {
-        // This will be the offset address to access the key string.
-        value_type off = (value_type)(std::streamoff)m_ofs.tellp();
+        return this->insert_many(&str, &str + 1);
+    }
 
-        // Write the key string to the master file.
-        m_ofs.write(reinterpret_cast<const char*>(str.c_str()), sizeof(char_type) * (str.length()+1));
-        if (m_ofs.fail()) {
+    /**
+     * Inserts strings to the database.
+     *  This function inserts the strings in a range in the same way as
+     *  insert(). The strings are written to the master file in large
+     *  chunks, and the database is identical to the one built with
+     *  insert().
+     *  @param  first       The iterator pointing to the first string.
+     *  @param  last        The iterator pointing past the last string.
+     *  @return bool        \c true if all the strings are successfully
+     *                      inserted, \c false otherwise; the insertion
+     *                      stops at the first failure.
+     */
+    template <class iterator_type>
+    bool insert_many(iterator_type first, iterator_type last)
+    {
+        // The strings would be discarded without the master file.
+        if (first != last && !m_ofs.is_open()) {
             this->m_error << "Failed to write a string to the master file.";
             return false;
         }
-        ++m_num_entries;
 
-        // Insert the n-grams of the key string to the database.
-        return base_type::insert(str, off);
+        bool b = true;
+        for (;first != last && b;++first) {
+            const string_type& str = *first;
+            const size_t size = sizeof(char_type) * (str.length()+1);
+
+            // This will be the offset address to access the key string, or
+            // the ordinal number of the string mapped to the offset.
+            value_type off = (value_type)m_size;
+            if (this->m_flags & store_large) {
+                off = (value_type)m_num_entries;
+                m_offsets.push_back(m_size);
+            } else if (0xFFFFFFFF < m_size + size) {
+                this->m_error << "The master file exceeds 4 GB; build the database with store_large.";
+                b = false;
+                break;
+            }
+
+            // Buffer the key string for the master file.
+            const char* p = reinterpret_cast<const char*>(str.c_str());
+            m_buffer.insert(m_buffer.end(), p, p + size);
+            m_size += size;
+            ++m_num_entries;
+            if (BUFFER_SIZE <= m_buffer.size()) {
+                b = this->write_buffer();
+            }
+
+            // Insert the n-grams of the key string to the database.
+            b = b && base_type::insert(str, off);
+        }
+        return b;
+    }
+
+    /**
+     * Deletes a string from the database.
+     *  The string (all of its occurrences) is deleted from the older
+     *  segments of the database, and is retrieved again if it is inserted
+     *  into this or a newer segment. This requires ::simstring::store_append.
+     *  @param  str         The string to be deleted.
+     *  @return bool        \c true if the string is successfully deleted,
+     *                      \c false otherwise.
+     */
+    bool remove(const string_type& str)
+    {
+        if (!(this->m_flags & store_append)) {
+            this->m_error << "Deleting strings requires store_append.";
+            return false;
+        }
+
+        // A new database has no string to be deleted.
+        if (m_segment) {
+            m_deleted.push_back(std::string(
+                reinterpret_cast<const char*>(str.c_str()),
+                sizeof(char_type) * str.length()
+                ));
+        }
+        return true;
     }
 
 protected:
+    /**
+     * Checks that a database accepts segments from this writer.
+     *  @param  name        The name of the database.
+     *  @return bool        \c true if the database has the same parameters
+     *                      of n-grams and characters as this writer.
+     */
+    bool check_base(const std::string& name)
+    {
+        uint32_t header[10] = {0};
+        std::ifstream ifs(name.c_str(), std::ios::binary);
+        ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+        if (ifs.gcount() < 36 || std::memcmp(header, "SSDB", 4) != 0 || header[1] != BYTEORDER_CHECK) {
+            this->m_error << "Incorrect file format: " << name;
+            return false;
+        }
+
+        // The features follow the header of version 3 or later.
+        const uint32_t features = (2 < header[2] && 40 <= ifs.gcount()) ? header[9] : 0;
+        const bool be = ((header[6] & NGRAM_BE) != 0);
+        const bool hashed = ((header[6] & NGRAM_HASHED) != 0);
+        const bool utf8 = ((features & FEATURE_UTF8) != 0);
+        if (header[4] != sizeof(char_type) ||
+            (int)header[5] != this->m_gen.get_n() ||
+            be != this->m_gen.get_be() ||
+            hashed != (ngram_traits<ngram_generator_type, string_type>::hashed != 0) ||
+            utf8 != this->m_gen.get_utf8()) {
+            this->m_error <<
+                "Inconsistent parameters with the database: " << name <<
+                " (char size " << header[4] <<
+                ", n-gram length " << header[5] <<
+                ", begin/end marks " << (be ? "true" : "false") <<
+                ", UTF-8 " << (utf8 ? "true" : "false") << ")";
+            return false;
+        }
+        return true;
+    }
+
+    bool write_buffer()
+    {
+        if (m_buffer.empty()) {
+            return true;
+        }
+        m_ofs.write(&m_buffer[0], m_buffer.size());
+        m_buffer.clear();
+        if (m_ofs.fail()) {
+            this->m_error << "Failed to write a string to the master file.";
+            return false;
+        }
+        return true;
+    }
+
     bool write_header(std::ofstream& ofs)
     {
         uint32_t num_entries = m_num_entries;
         uint32_t max_size = (uint32_t)this->max_size();
-        uint32_t size = (uint32_t)m_ofs.tellp();
+        uint64_t size = (uint64_t)(std::streamoff)m_ofs.tellp();
 
         // Seek to the beginning of the master file, to which the file header
         // is to be written.
@@ -467,16 +1412,54 @@ protected:
             return false;
         }
 
+        // Use the features of the database format only when necessary;
+        // a database without them stays readable by older readers.
+        uint32_t features = 0;
+        if (this->m_flags & store_compressed) {
+            features |= FEATURE_COMPRESSED;
+        }
+        if (this->m_flags & store_large) {
+            features |= FEATURE_LARGE;
+        }
+        if (this->m_flags & store_inline_keys) {
+            features |= FEATURE_INLINE_KEYS;
+        }
+        if (this->m_flags & store_single_file) {
+            features |= FEATURE_SINGLE_FILE;
+        }
+        if (this->m_gen.get_utf8()) {
+            features |= FEATURE_UTF8;
+        }
+        if (ngram_traits<ngram_generator_type, string_type>::hashed) {
+            features |= FEATURE_HASHED;
+        }
+        const bool size64 = (features & (FEATURE_LARGE | FEATURE_SINGLE_FILE)) != 0;
+
         // Write the file header.
         m_ofs.write("SSDB", 4);
         write_uint32(BYTEORDER_CHECK);
-        write_uint32(SIMSTRING_STREAM_VERSION);
-        write_uint32(size);
+        write_uint32(features ? SIMSTRING_STREAM_VERSION : SIMSTRING_STREAM_VERSION_MIN);
+        write_uint32(size64 ? 0 : (uint32_t)size);
         write_uint32(sizeof(char_type));
         write_uint32(this->m_gen.get_n());
-        write_uint32(static_cast<int>(this->m_gen.get_be()));
+        write_uint32(
+            (this->m_gen.get_be() ? NGRAM_BE : 0) |
+            (ngram_traits<ngram_generator_type, string_type>::hashed ? NGRAM_HASHED : 0)
+            );
         write_uint32(num_entries);
         write_uint32(max_size);
+        if (features) {
+            write_uint32(features);
+        }
+        if (size64) {
+            write_uint64(size);
+        }
+        if (features & FEATURE_LARGE) {
+            write_uint64(m_table_offset);
+        }
+        if (features & FEATURE_SINGLE_FILE) {
+            write_uint64(m_directory_offset);
+        }
         if (ofs.fail()) {
             this->m_error << "Failed to write a file header to the master file.";
             return false;
@@ -485,10 +1468,77 @@ protected:
         return true;
     }
 
+    bool write_deleted(const std::string& name)
+    {
+        std::ofstream ofs(name.c_str(), std::ios::binary);
+        std::vector<std::string>::const_iterator it;
+        for (it = m_deleted.begin();it != m_deleted.end();++it) {
+            uint32_t size = (uint32_t)it->size();
+            ofs.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            ofs.write(it->data(), it->size());
+        }
+        if (ofs.fail()) {
+            this->m_error << "Failed to write the deleted strings: " << name;
+            return false;
+        }
+        return true;
+    }
+
+    bool write_indices(std::ofstream& ofs)
+    {
+        std::vector<uint64_t> directory;
+        if (!this->store(ofs, directory)) {
+            return false;
+        }
+
+        while ((std::streamoff)ofs.tellp() % sizeof(uint64_t) != 0) {
+            ofs.put(0);
+        }
+        m_directory_offset = (uint64_t)(std::streamoff)ofs.tellp();
+
+        if (!directory.empty()) {
+            ofs.write(
+                reinterpret_cast<const char*>(&directory[0]),
+                sizeof(uint64_t) * directory.size()
+                );
+        }
+        if (ofs.fail()) {
+            this->m_error << "Failed to write the directory of the indices to the master file.";
+            return false;
+        }
+        return true;
+    }
+
+    bool write_offsets(std::ofstream& ofs)
+    {
+        // Align the table so that the reader can access it in place.
+        while ((std::streamoff)ofs.tellp() % sizeof(uint64_t) != 0) {
+            ofs.put(0);
+        }
+        m_table_offset = (uint64_t)(std::streamoff)ofs.tellp();
+
+        if (!m_offsets.empty()) {
+            ofs.write(
+                reinterpret_cast<const char*>(&m_offsets[0]),
+                sizeof(uint64_t) * m_offsets.size()
+                );
+        }
+        if (ofs.fail()) {
+            this->m_error << "Failed to write the offsets of strings to the master file.";
+            return false;
+        }
+        return true;
+    }
+
     inline void write_uint32(uint32_t value)
     {
         m_ofs.write(reinterpret_cast<const char *>(&value), sizeof(value));
     }
+
+    inline void write_uint64(uint64_t value)
+    {
+        m_ofs.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
 };
 
 
@@ -506,13 +1556,37 @@ class ngramdb_reader_base
 public:
     /// The type of a value.
     typedef value_tmpl value_type;
-    
+
+    /// A retrieved SID with its similarity score.
+    struct scored_type
+    {
+        /// The SID.
+        value_type  value;
+        /// The similarity score.
+        double      score;
+
+        scored_type() : value(0), score(0.)
+        {
+        }
+
+        scored_type(value_type v, double s)
+            : value(v), score(s)
+        {
+        }
+    };
+
+    /// An array of SIDs with scores.
+    typedef std::vector<scored_type> scored_results_type;
+
 protected:
     // An inverted list of SIDs.
     struct inverted_list_type
     {
         int num;
         const value_type* values;
+        // The compressed postings (FEATURE_COMPRESSED).
+        const void* packed;
+        size_t packed_size;
 
         friend bool operator<(
             const inverted_list_type& x, 
@@ -535,6 +1609,8 @@ protected:
         memory_mapped_file  image;
         // The index.
         hashtbl_type        table;
+        // The filter of the n-grams in the index (store_ngram_filters).
+        ngram_filter        filter;
     };
 
     // Indices with different sizes of strings.
@@ -557,16 +1633,165 @@ protected:
     // An array of candidates.
     typedef std::vector<candidate_type> candidates_type;
 
+    // Parameters of counting candidates with an array of counters.
+    enum {
+        // The maximum number of postings counted (the limit of a counter).
+        DENSE_MAX_LISTS = 255,
+        // The maximum range of SIDs covered by the counters.
+        DENSE_MAX_RANGE = 0x1000000,
+        // The counters are used when the range of SIDs is no larger than
+        // this times the number of SIDs copied by merging the postings.
+        DENSE_RATIO = 4,
+    };
+
+    // The minimum number of postings merged by a task joining a range of
+    // SIDs in a size bucket (see join_ranges()).
+    enum { RANGE_MIN_POSTINGS = 65536 };
+
     // An array of SIDs retrieved.
     typedef std::vector<value_type> results_type;
 
+    // Orders scored SIDs from the best: higher scores, then smaller SIDs.
+    struct scored_better
+    {
+        bool operator()(const scored_type& x, const scored_type& y) const
+        {
+            return (x.score > y.score || (x.score == y.score && x.value < y.value));
+        }
+    };
+
+public:
+    /**
+     * The working memory of queries.
+     *  A context keeps the buffers of a query for later queries, so that
+     *  queries in the steady state do not allocate memory. A context must
+     *  not be used by multiple threads at the same time.
+     */
+    struct context_type
+    {
+        // The postings of the query n-grams.
+        inverted_lists_type posts;
+        // The buffer for decoding compressed postings.
+        results_type buffer;
+        // The candidates and the buffer for updating them.
+        candidates_type cands, tmp;
+        // The keys and values of the look-ups of the query n-grams.
+        std::vector<const void*> keys, found;
+        std::vector<size_t> ksizes, vsizes;
+        // The hash values of the query n-grams for the filters, and the
+        // positions of the query n-grams looked up after the filters.
+        std::vector<uint64_t> hashes;
+        std::vector<int> slots;
+        // The counters of candidates indexed by SIDs (zero when unused).
+        std::vector<uint8_t> counters;
+        // A heap of scored SIDs with the worst one on the top.
+        scored_results_type heap;
+        // The scores indexed by the numbers of matches.
+        std::vector<double> scores;
+        /// The statistics of the last query, collected by readers with
+        /// ::simstring::collect_stats.
+        reader_stats stats;
+        // The SIDs retrieved by a task of a parallel query.
+        results_type results;
+        // The SIDs and scores retrieved from a segment, or by a task of a
+        // parallel query.
+        scored_results_type scored;
+        // The working memory of the tasks of a parallel query.
+        std::vector<std::unique_ptr<context_type> > parts;
+    };
+
+protected:
+    // Appends a SID that has num matches to the results.
+    template <class measure_type>
+    static inline void add_result(
+        results_type& results, value_type value, int qsize, int xsize, int num)
+    {
+        results.push_back(value);
+    }
+
+    // Appends a SID that has num matches to the results with its score.
+    template <class measure_type>
+    static inline void add_result(
+        scored_results_type& results, value_type value, int qsize, int xsize, int num)
+    {
+        results.push_back(scored_type(value, measure_type::score(qsize, xsize, num)));
+    }
+
+    // Returns whether the results need the exact numbers of matches.
+    static inline bool exact_matches(const results_type&)
+    {
+        return false;
+    }
+
+    static inline bool exact_matches(const scored_results_type&)
+    {
+        return true;
+    }
+
+    // Returns the results of a task of a parallel query of the same type
+    // as the given ones.
+    static inline results_type& part_results(context_type& part, const results_type&)
+    {
+        return part.results;
+    }
+
+    static inline scored_results_type& part_results(context_type& part, const scored_results_type&)
+    {
+        return part.scored;
+    }
+
+
+    // A cursor searching a posting list for ascending SIDs.
+    class cursor
+    {
+    protected:
+        const value_type* m_first;
+        const value_type* m_last;
+        postings::decoder m_decoder;
+        bool m_packed;
+
+    public:
+        // The decoder reads the postings of a compressed database only.
+        cursor(const inverted_list_type& post, int features)
+            : m_first(post.values), m_last(post.values + post.num),
+            m_decoder(
+                (features & FEATURE_COMPRESSED) ? post.packed : NULL,
+                (features & FEATURE_COMPRESSED) ? post.packed_size : 0),
+            m_packed((features & FEATURE_COMPRESSED) != 0)
+        {
+        }
+
+        // Checks whether the posting list contains the SID; the search
+        // resumes from the position of the previous one.
+        inline bool find(value_type value)
+        {
+            if (m_packed) {
+                return m_decoder.find((uint32_t)value);
+            }
+            m_first = simd::lower_bound(m_first, m_last, value);
+            return (m_first != m_last && *m_first == value);
+        }
+    };
+
 protected:
     // The array of the indices.
     indices_type m_indices;
     // The maximum size of strings in the database.
     int m_max_size;
+    // The flags for opening the database.
+    int m_flags;
+    // The features of the database format.
+    int m_features;
     // The database name (base name of indices).
     std::string m_name;
+    // The memory image containing the indices (FEATURE_SINGLE_FILE).
+    const char* m_container;
+    // The offset and size of every index in the container.
+    const uint64_t* m_directory;
+    // The thread pool running the size buckets of a query, or NULL.
+    thread_pool* m_pool;
+    // Whether an index has a filter of n-grams (store_ngram_filters).
+    bool m_filters;
     // The error message.
     std::stringstream m_error;
 
@@ -576,6 +1801,8 @@ public:
      * Constructs an object.
      */
     ngramdb_reader_base()
+        : m_max_size(0), m_flags(0), m_features(0),
+        m_container(NULL), m_directory(NULL), m_pool(NULL), m_filters(false)
     {
     }
 
@@ -608,13 +1835,43 @@ public:
      * Opens an n-gram database.
      *  @param  name        The name of the database.
      *  @param  max_size    The maximum size of the strings.
+     *  @param  flags       The flags for opening the database.
+     *  @param  features    The features of the database format.
+     *  @param  container   The memory image containing the indices, or
+     *                      \c NULL if the indices are stored in files.
+     *  @param  directory   The offset and size of every index in the
+     *                      container.
+     *  @see    ::simstring::open_eager, ::simstring::FEATURE_COMPRESSED
      */
-    void open(const std::string& name, int max_size)
+    void open(
+        const std::string& name,
+        int max_size,
+        int flags = 0,
+        int features = 0,
+        const char* container = NULL,
+        const uint64_t* directory = NULL
+        )
     {
         m_name = name;
         m_max_size = max_size;
+        m_flags = flags;
+        m_features = features;
+        m_container = container;
+        m_directory = directory;
         // The maximum size corresponds to the number of indices in the database.
         m_indices.resize(max_size);
+
+        // Opening the indices in a container needs no system call.
+        if (m_container != NULL) {
+            m_flags |= open_eager;
+        }
+
+        // Open all the indices now so that queries never modify the reader.
+        if (m_flags & open_eager) {
+            for (int size = 1;size <= max_size;++size) {
+                open_index(m_name, size);
+            }
+        }
     }
 
     /**
@@ -624,24 +1881,104 @@ public:
     {
         m_name.clear();
         m_indices.clear();
+        m_flags = 0;
+        m_features = 0;
+        m_container = NULL;
+        m_directory = NULL;
+        m_filters = false;
         m_error.str("");
     }
 
+    /**
+     * Runs the size buckets of a query in parallel with a thread pool.
+     *  An overlap join searching several sizes of strings (e.g., a long
+     *  query with a low threshold) runs every size as a task of the pool,
+     *  which may be shared with other readers and queries, including the
+     *  queries of this reader (e.g., retrieve_batch() with the same pool);
+     *  a bucket with many postings is also split into ranges of SIDs. The results are
+     *  identical to the sequential join in the same order, except that the
+     *  SIDs of a split bucket are ordered by the ranges. The database must
+     *  be opened with ::simstring::open_eager; others are searched
+     *  sequentially.
+     *  @param  pool        The thread pool, or \c NULL to search the sizes
+     *                      sequentially in the calling thread (default).
+     */
+    void set_thread_pool(thread_pool* pool)
+    {
+        m_pool = pool;
+    }
+
+    /**
+     * Checks whether the indices have filters of n-grams.
+     *  @return bool        \c true if the database was built with
+     *                      ::simstring::store_ngram_filters.
+     */
+    bool ngram_filters()
+    {
+        for (int size = 1;size <= m_max_size;++size) {
+            const index_type& index = get_index(size);
+            if (index.table.is_open()) {
+                return index.filter.is_open();
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Returns the working memory of queries of the calling thread.
+     *  Queries without a context given use this context.
+     */
+    static context_type& thread_context()
+    {
+        static thread_local context_type instance;
+        return instance;
+    }
+
     /**
      * Performs an overlap join on inverted lists retrieved for the query.
      *  @param  query       The query object that stores query n-grams,
      *                      threshold, and conditions for the similarity
      *                      measure.
-     *  @param  results     The SIDs that satisfies the overlap join.
+     *  @param  results     The SIDs that satisfies the overlap join
+     *                      (results_type), or the SIDs with their
+     *                      similarity scores (scored_results_type).
      */
-    template <class measure_type, class query_type>
-    bool overlapjoin(const query_type& query, double alpha, results_type& results, bool check)
+    template <class measure_type, class query_type, class array_type>
+    bool overlapjoin(const query_type& query, double alpha, array_type& results, bool check)
     {
-        int i;
-        const int qsize = query.size();
+        return this->overlapjoin<measure_type>(
+            query, alpha, results, check, thread_context());
+    }
 
-        // Allocate a vector of postings corresponding to n-gram queries.
-        inverted_lists_type posts(qsize);
+    /**
+     * Performs an overlap join on inverted lists retrieved for the query.
+     *  @param  query       The query object that stores query n-grams,
+     *                      threshold, and conditions for the similarity
+     *                      measure.
+     *  @param  results     The SIDs that satisfies the overlap join
+     *                      (results_type), or the SIDs with their
+     *                      similarity scores (scored_results_type). The
+     *                      scores are computed from the numbers of matches
+     *                      counted by the join, in ascending order of sizes
+     *                      and SIDs.
+     *  @param  ctx         The working memory of the query, whose
+     *                      statistics (stats) are updated if the policy
+     *                      (stats_policy_type) collects statistics.
+     */
+    template <class measure_type, class stats_policy_type = no_stats, class query_type, class array_type>
+    bool overlapjoin(
+        const query_type& query,
+        double alpha,
+        array_type& results,
+        bool check,
+        context_type& ctx
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        const int qsize = query.size();
+        reader_stats& stats = ctx.stats;
+        stopwatch<STATS> sw;
+        ctx.posts.resize(qsize);
 
         // Compute the range of n-gram lengths for the candidate strings;
         // in other words, we do not have to search for strings whose n-gram
@@ -649,139 +1986,1026 @@ public:
         const int xmin = std::max(measure_type::min_size(query.size(), alpha), 1);
         const int xmax = std::min(measure_type::max_size(query.size(), alpha), m_max_size);
 
+        // Hash the query n-grams once for the filters of all the indices.
+        const uint64_t* hashes = this->hash_filters(query, ctx);
+
+        // Most negative answers of an existence check need the filters
+        // alone, without looking up n-grams or running tasks.
+        if (check && hashes != NULL &&
+            !this->template test_filters<measure_type, stats_policy_type>(
+                qsize, hashes, alpha, xmin, xmax, ctx)) {
+            sw.lap(stats.lookup_seconds);
+            return false;
+        }
+
+        // Spread the sizes over the thread pool.
+        if (m_pool != NULL && (m_flags & open_eager) && xmin <= xmax) {
+            return this->template overlapjoin_parallel<measure_type, stats_policy_type>(
+                query, hashes, alpha, xmin, xmax, results, check, ctx);
+        }
+
         // Loop for each length in the range.
         for (int xsize = xmin;xsize <= xmax;++xsize) {
-            // Access to the n-gram index for the length.
-            hashtbl_type& tbl = open_index(m_name, xsize);
-            if (!tbl.is_open()) {
-                // Ignore an empty index.
+            // Obtain the postings of the query n-grams; ignore an empty index.
+            const int mmin = measure_type::min_match(qsize, xsize, alpha);
+            const bool found = this->template fetch<stats_policy_type>(
+                query, hashes, xsize, mmin, ctx);
+            sw.lap(stats.lookup_seconds);
+            if (!found) {
                 continue;
             }
 
-            // Search for string entries that match to each query n-gram.
-            // Note that we do not traverse each entry here, but only obtain
-            // the number of and the pointer to the entries.
-            typename query_type::const_iterator it;
-            for (it = query.begin(), i = 0;it != query.end();++it, ++i) {
-                size_t vsize;
-                const void *values = tbl.get(
-                    it->c_str(),
-                    sizeof(it->at(0)) * it->length(),
-                    &vsize
-                    );
-                posts[i].num = (int)(vsize / sizeof(value_type));
-                posts[i].values = reinterpret_cast<const value_type*>(values);
+            const bool b = this->template join<measure_type, stats_policy_type>(
+                qsize, xsize, alpha, results, check, ctx, sw, NULL);
+            if (b && check) {
+                return true;
             }
+        }
 
-            // Sort the query n-grams by ascending order of their frequencies.
-            // This reduces the number of initial candidates.
-            std::sort(posts.begin(), posts.end());
+        return !results.empty();
+    }
 
-            // The minimum number of n-gram matches required for the query.
-            const int mmin = measure_type::min_match(qsize, xsize, alpha);
-            // A candidate must match to one of n-grams in these queries.
-            const int min_queries = qsize - mmin + 1;
-
-            // Step 1: collect candidates that match to the initial queries.
-            candidates_type cands;
-            for (i = 0;i < min_queries;++i) {
-                candidates_type tmp;
-                typename candidates_type::const_iterator itc = cands.begin();
-                const value_type* p = posts[i].values;
-                const value_type* last = posts[i].values + posts[i].num;
-
-                while (itc != cands.end() || p != last) {
-                    if (itc == cands.end() || (p != last && itc->value > *p)) {
-                        tmp.push_back(candidate_type(*p, 1));
-                        ++p;
-                    } else if (p == last || (itc != cands.end() && itc->value < *p)) {
-                        tmp.push_back(candidate_type(itc->value, itc->num));
-                        ++itc;
-                    } else {
-                        tmp.push_back(candidate_type(itc->value, itc->num+1));
-                        ++itc;
-                        ++p;
-                    }
-                }
-                std::swap(cands, tmp);
-            }
+    /**
+     * Finds the SIDs of the k strings most similar to the query.
+     *  Indices are searched from the size of the query outward, so that
+     *  similar strings are found early. Once k strings have been found,
+     *  the score of the k-th string serves as the threshold, which narrows
+     *  the range of sizes and raises the number of required matches.
+     *  @param  query       The query object that stores query n-grams.
+     *  @param  k           The number of strings.
+     *  @param  results     The SIDs and scores in descending order of
+     *                      scores; ties are in ascending order of SIDs.
+     */
+    template <class measure_type, class query_type>
+    void overlapjoin_topk(const query_type& query, int k, scored_results_type& results)
+    {
+        this->overlapjoin_topk<measure_type>(query, k, results, thread_context());
+    }
 
-            // No initial candidate is found.
-            if (cands.empty()) {
-                continue;
+    /**
+     * Finds the SIDs of the k strings most similar to the query.
+     *  @param  query       The query object that stores query n-grams.
+     *  @param  k           The number of strings.
+     *  @param  results     The SIDs and scores in descending order of
+     *                      scores; ties are in ascending order of SIDs.
+     *  @param  ctx         The working memory of the query, whose
+     *                      statistics (stats) are updated if the policy
+     *                      (stats_policy_type) collects statistics.
+     */
+    template <class measure_type, class stats_policy_type = no_stats, class query_type>
+    void overlapjoin_topk(
+        const query_type& query,
+        int k,
+        scored_results_type& results,
+        context_type& ctx
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        int i;
+        const int qsize = query.size();
+        inverted_lists_type& posts = ctx.posts;
+        candidates_type& cands = ctx.cands;
+        candidates_type& tmp = ctx.tmp;
+        scored_results_type& heap = ctx.heap;
+        reader_stats& stats = ctx.stats;
+        const scored_better better;
+
+        results.clear();
+        if (qsize == 0 || k <= 0) {
+            return;
+        }
+        posts.resize(qsize);
+        heap.clear();
+        stopwatch<STATS> sw;
+        const uint64_t* hashes = this->hash_filters(query, ctx);
+
+        for (int d = 0;;++d) {
+            // Compute the range of sizes with the current threshold. The
+            // threshold is lowered slightly so that ties with the k-th
+            // string are not lost to rounding errors.
+            int xmin = 1, xmax = m_max_size;
+            double alpha = 0.;
+            if ((int)heap.size() == k) {
+                alpha = heap.front().score * (1. - 1e-9);
+                xmin = std::max(measure_type::min_size(qsize, alpha), 1);
+                xmax = std::min(measure_type::max_size(qsize, alpha), m_max_size);
+            }
+            if (qsize + d > xmax && qsize - d < xmin) {
+                break;
             }
 
-            // Step 2: count the number of matches with remaining queries.
-            for (;i < qsize;++i) {
-                candidates_type tmp;
-                typename candidates_type::const_iterator itc;
-                const value_type* first = posts[i].values;
-                const value_type* last = posts[i].values + posts[i].num;
+            for (int sign = 0;sign < ((d == 0) ? 1 : 2);++sign) {
+                const int xsize = (sign == 0) ? qsize + d : qsize - d;
+                if (xsize < xmin || xmax < xsize) {
+                    continue;
+                }
 
-                // For each active candidate.
-                for (itc = cands.begin();itc != cands.end();++itc) {
-                    int num = itc->num;
-                    if (std::binary_search(first, last, itc->value)) {
-                        ++num;
-                    }
+                // A result must share at least one n-gram with the query.
+                int mmin = 1;
+                if (0. < alpha) {
+                    mmin = std::max(measure_type::min_match(qsize, xsize, alpha), 1);
+                }
+                const int min_queries = qsize - mmin + 1;
+
+                const bool found = this->template fetch<stats_policy_type>(
+                    query, hashes, xsize, mmin, ctx);
+                sw.lap(stats.lookup_seconds);
+                if (!found) {
+                    continue;
+                }
 
-                    if (mmin <= num) {
-                        // This candidate has sufficient matches.
-                        if (check) {
-                            return true;
+                // Step 1: collect candidates that match to the initial queries.
+                this->merge(ctx, min_queries);
+                sw.lap(stats.merge_seconds);
+                if (STATS) {
+                    this->count_step1(ctx, min_queries);
+                }
+
+                // Step 2: count the exact number of matches of every
+                // candidate, pruning the ones that cannot reach mmin.
+                for (i = std::max(min_queries, 0);i < qsize && !cands.empty();++i) {
+                    typename candidates_type::const_iterator itc;
+                    cursor cur(posts[i], m_features);
+                    tmp.clear();
+                    tmp.reserve(cands.size());
+                    for (itc = cands.begin();itc != cands.end();++itc) {
+                        int num = itc->num;
+                        if (cur.find(itc->value)) {
+                            ++num;
                         }
-                        results.push_back(itc->value);
-                    } else if (num + (qsize - i - 1) >= mmin) {
-                        // This candidate still has the chance.
-                        tmp.push_back(candidate_type(itc->value, num));
+                        if (num + (qsize - i - 1) >= mmin) {
+                            tmp.push_back(candidate_type(itc->value, num));
+                        }
+                    }
+                    if (STATS) {
+                        stats.probes += cands.size();
+                        stats.pruned += cands.size() - tmp.size();
                     }
+                    std::swap(cands, tmp);
                 }
-                std::swap(cands, tmp);
 
-                // Exit the loop if all candidates are pruned.
+                // The score of a candidate depends only on its number of
+                // matches, which is in [mmin, qsize].
                 if (cands.empty()) {
-                    break;
+                    sw.lap(stats.verify_seconds);
+                    continue;
+                }
+                std::vector<double>& scores = ctx.scores;
+                scores.resize(qsize + 1);
+                for (i = mmin;i <= qsize;++i) {
+                    scores[i] = measure_type::score(qsize, xsize, i);
                 }
-            }
 
-            if (!cands.empty()) {
-                // Step 2 was not performed.
+                // Keep the k best candidates.
                 typename candidates_type::const_iterator itc;
                 for (itc = cands.begin();itc != cands.end();++itc) {
-                    if (mmin <= itc->num) {
-                        if (check) {
-                            return true;
-                        }
-                        results.push_back(itc->value);
+                    if (itc->num < mmin) {
+                        continue;
+                    }
+                    scored_type r(itc->value, scores[itc->num]);
+                    if (r.score <= 0.) {
+                        // Dissimilar strings (e.g., partial matches in exact).
+                        continue;
+                    } else if ((int)heap.size() < k) {
+                        heap.push_back(r);
+                        std::push_heap(heap.begin(), heap.end(), better);
+                    } else if (better(r, heap.front())) {
+                        std::pop_heap(heap.begin(), heap.end(), better);
+                        heap.back() = r;
+                        std::push_heap(heap.begin(), heap.end(), better);
                     }
                 }
+                sw.lap(stats.verify_seconds);
             }
         }
 
-        return !results.empty();
+        // Output the results from the best one.
+        std::sort_heap(heap.begin(), heap.end(), better);
+        results.assign(heap.begin(), heap.end());
+        if (STATS) {
+            stats.results += results.size();
+        }
     }
 
 protected:
     /**
-     * Open the index storing strings of the specific size.
-     *  @param  base            The base name of the indices.
-     *  @param  size            The size of strings.
-     *  @return hashtbl_type&   The hash table of the index.
+     * Performs an overlap join on the postings of a size bucket.
+     *  @param  qsize       The number of the query n-grams.
+     *  @param  xsize       The size of the strings in the bucket.
+     *  @param  alpha       The threshold for approximate string matching.
+     *  @param  results     The SIDs that satisfy the overlap join, or the
+     *                      SIDs with their scores; the latter count the
+     *                      exact numbers of matches of the SIDs.
+     *  @param  check       \c true to return as soon as a SID is found,
+     *                      without adding it to the results.
+     *  @param  ctx         The working memory with the postings (posts) of
+     *                      the bucket.
+     *  @param  sw          The stopwatch of the query.
+     *  @param  stop        The flag that tells to give up the bucket, or
+     *                      \c NULL.
+     *  @return bool        \c true if a SID is found.
      */
-    hashtbl_type& open_index(const std::string& base, int size)
+    template <class measure_type, class stats_policy_type, class array_type>
+    bool join(
+        int qsize,
+        int xsize,
+        double alpha,
+        array_type& results,
+        bool check,
+        context_type& ctx,
+        stopwatch<stats_policy_type::enabled>& sw,
+        const std::atomic<bool>* stop
+        )
     {
-        index_type& index = m_indices[size-1];
-        if (!index.table.is_open()) {
-            std::stringstream ss;
-            ss << base << '.' << size << ".cdb";
-            index.image.open(ss.str().c_str(), std::ios::in);
-            if (index.image.is_open()) {
-                index.table.open(index.image.data(), index.image.size());
-            }
+        enum { STATS = stats_policy_type::enabled };
+        int i;
+        inverted_lists_type& posts = ctx.posts;
+        candidates_type& cands = ctx.cands;
+        candidates_type& tmp = ctx.tmp;
+        reader_stats& stats = ctx.stats;
+        const size_t num_results = results.size();
+        // Scores need the candidates counted in all the postings.
+        const bool exact = exact_matches(results);
+
+        // The minimum number of n-gram matches required for the query.
+        const int mmin = measure_type::min_match(qsize, xsize, alpha);
+        // A candidate must match to one of n-grams in these queries.
+        const int min_queries = qsize - mmin + 1;
+
+        // Step 1: collect candidates that match to the initial queries.
+        this->merge(ctx, min_queries);
+        sw.lap(stats.merge_seconds);
+        if (STATS) {
+            this->count_step1(ctx, min_queries);
         }
 
-        return index.table;
-    }
+        // Step 2: count the number of matches with remaining queries.
+        for (i = std::max(min_queries, 0);i < qsize && !cands.empty();++i) {
+            typename candidates_type::const_iterator itc;
+            cursor cur(posts[i], m_features);
+            const size_t num_found = results.size();
+            if (stop != NULL && *stop) {
+                return false;
+            }
+            tmp.clear();
+            tmp.reserve(cands.size());
+
+            // For each active candidate.
+            for (itc = cands.begin();itc != cands.end();++itc) {
+                int num = itc->num;
+                if (cur.find(itc->value)) {
+                    ++num;
+                }
+
+                if (mmin <= num && !exact) {
+                    // This candidate has sufficient matches.
+                    if (check) {
+                        sw.lap(stats.verify_seconds);
+                        if (STATS) {
+                            stats.probes += (itc - cands.begin()) + 1;
+                            ++stats.results;
+                        }
+                        return true;
+                    }
+                    add_result<measure_type>(results, itc->value, qsize, xsize, num);
+                } else if (num + (qsize - i - 1) >= mmin) {
+                    // This candidate still has the chance.
+                    tmp.push_back(candidate_type(itc->value, num));
+                }
+            }
+            if (STATS) {
+                stats.probes += cands.size();
+                stats.pruned += cands.size() - tmp.size() - (results.size() - num_found);
+            }
+            std::swap(cands, tmp);
+        }
+
+        if (!cands.empty()) {
+            // Step 2 was not performed, or it counted all the matches.
+            typename candidates_type::const_iterator itc;
+            for (itc = cands.begin();itc != cands.end();++itc) {
+                if (mmin <= itc->num) {
+                    if (check) {
+                        sw.lap(stats.verify_seconds);
+                        if (STATS) {
+                            ++stats.results;
+                        }
+                        return true;
+                    }
+                    add_result<measure_type>(results, itc->value, qsize, xsize, itc->num);
+                }
+            }
+        }
+        sw.lap(stats.verify_seconds);
+
+        if (STATS) {
+            stats.results += results.size() - num_results;
+        }
+        return num_results < results.size();
+    }
+
+    /**
+     * Performs an overlap join with the tasks of the thread pool.
+     *  Every size in the range is a task with a context of its own, and the
+     *  results are merged in ascending order of sizes as the sequential
+     *  join does. The task of a bucket with many postings splits it into
+     *  ranges of SIDs (see join_ranges()). When a task finds a SID for
+     *  \c check, the others give up their buckets.
+     *  @param  query       The query n-grams.
+     *  @param  hashes      The hash values of the query n-grams for the
+     *                      filters of the indices, or \c NULL.
+     *  @param  alpha       The threshold for approximate string matching.
+     *  @param  xmin        The minimum size of the strings.
+     *  @param  xmax        The maximum size of the strings.
+     *  @param  results     The SIDs that satisfy the overlap join, or the
+     *                      SIDs with their scores.
+     *  @param  check       \c true to find whether any SID satisfies the
+     *                      overlap join.
+     *  @param  ctx         The working memory of the query.
+     */
+    template <class measure_type, class stats_policy_type, class query_type, class array_type>
+    bool overlapjoin_parallel(
+        const query_type& query,
+        const uint64_t* hashes,
+        double alpha,
+        int xmin,
+        int xmax,
+        array_type& results,
+        bool check,
+        context_type& ctx
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        const int qsize = query.size();
+        const int n = xmax - xmin + 1;
+        std::vector<std::unique_ptr<context_type> >& parts = ctx.parts;
+        while ((int)parts.size() < n) {
+            parts.push_back(std::unique_ptr<context_type>(new context_type));
+        }
+        std::atomic<bool> stop(false);
+
+        auto task = [&](int j) {
+            context_type& part = *parts[j];
+            array_type& found_here = part_results(part, results);
+            stopwatch<STATS> sw;
+            found_here.clear();
+            part.stats.clear();
+            if (stop) {
+                return;
+            }
+
+            const int xsize = xmin + j;
+            const int mmin = measure_type::min_match(qsize, xsize, alpha);
+            part.posts.resize(qsize);
+            const bool found = this->template fetch<stats_policy_type>(
+                query, hashes, xsize, mmin, part);
+            sw.lap(part.stats.lookup_seconds);
+            if (!found) {
+                return;
+            }
+
+            const bool b = this->template join_ranges<measure_type, stats_policy_type>(
+                qsize, xsize, alpha, found_here, check, part, sw, stop);
+            if (b && check) {
+                stop = true;
+            }
+        };
+
+        // The calling thread runs the tasks while waiting for them.
+        if (n == 1) {
+            task(0);
+        } else {
+            task_group group(*m_pool);
+            for (int j = 0;j < n;++j) {
+                group.run([&task, j] { task(j); });
+            }
+            group.wait();
+        }
+
+        for (int j = 0;j < n;++j) {
+            context_type& part = *parts[j];
+            const array_type& found_here = part_results(part, results);
+            results.insert(results.end(), found_here.begin(), found_here.end());
+            if (STATS) {
+                ctx.stats += part.stats;
+            }
+        }
+        return (check && stop) || !results.empty();
+    }
+
+    /**
+     * Performs an overlap join on a size bucket split into ranges of SIDs.
+     *  A SID matches the same n-grams in the postings restricted to its
+     *  range, so the ranges are joined independently with the tasks of the
+     *  thread pool. Buckets with compressed or few postings are joined in
+     *  one piece.
+     *  @param  qsize       The number of the query n-grams.
+     *  @param  xsize       The size of the strings in the bucket.
+     *  @param  alpha       The threshold for approximate string matching.
+     *  @param  results     The SIDs that satisfy the overlap join, or the
+     *                      SIDs with their scores.
+     *  @param  check       \c true to return as soon as a SID is found.
+     *  @param  ctx         The working memory with the postings (posts) of
+     *                      the bucket.
+     *  @param  sw          The stopwatch of the task.
+     *  @param  stop        The flag that tells to give up the bucket.
+     *  @return bool        \c true if a SID is found.
+     */
+    template <class measure_type, class stats_policy_type, class array_type>
+    bool join_ranges(
+        int qsize,
+        int xsize,
+        double alpha,
+        array_type& results,
+        bool check,
+        context_type& ctx,
+        stopwatch<stats_policy_type::enabled>& sw,
+        std::atomic<bool>& stop
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        const inverted_lists_type& posts = ctx.posts;
+        const int mmin = measure_type::min_match(qsize, xsize, alpha);
+        const int min_queries = std::min(qsize - mmin + 1, qsize);
+
+        // Split the bucket by the SIDs of the longest postings in Step 1.
+        size_t total = 0;
+        for (int i = 0;i < min_queries;++i) {
+            total += posts[i].num;
+        }
+        int m = (int)std::min(total / RANGE_MIN_POSTINGS, (size_t)m_pool->size());
+        if ((m_features & FEATURE_COMPRESSED) || m < 2 || min_queries <= 0) {
+            return this->template join<measure_type, stats_policy_type>(
+                qsize, xsize, alpha, results, check, ctx, sw, &stop);
+        }
+        const inverted_list_type& longest = posts[min_queries-1];
+        std::vector<std::unique_ptr<context_type> >& parts = ctx.parts;
+        while ((int)parts.size() < m) {
+            parts.push_back(std::unique_ptr<context_type>(new context_type));
+        }
+        std::atomic<bool> found(false);
+
+        auto task = [&](int r) {
+            context_type& part = *parts[r];
+            array_type& found_here = part_results(part, results);
+            stopwatch<STATS> sw;
+            found_here.clear();
+            part.stats.clear();
+            if (stop) {
+                return;
+            }
+
+            // Restrict the postings to the range [first, last) of SIDs.
+            const value_type* vs = longest.values;
+            const bool head = (r == 0), tail = (r == m - 1);
+            const value_type first = head ? 0 : vs[(size_t)longest.num * r / m];
+            const value_type last = tail ? 0 : vs[(size_t)longest.num * (r + 1) / m];
+            part.posts.resize(qsize);
+            for (int i = 0;i < qsize;++i) {
+                const value_type* begin = posts[i].values;
+                const value_type* end = begin + posts[i].num;
+                const value_type* p = head ? begin : simd::lower_bound(begin, end, first);
+                const value_type* q = tail ? end : simd::lower_bound(p, end, last);
+                part.posts[i] = posts[i];
+                part.posts[i].values = p;
+                part.posts[i].num = (int)(q - p);
+            }
+            std::sort(part.posts.begin(), part.posts.end());
+
+            const bool b = this->template join<measure_type, stats_policy_type>(
+                qsize, xsize, alpha, found_here, check, part, sw, &stop);
+            if (b && check) {
+                found = true;
+                stop = true;
+            }
+        };
+
+        {
+            task_group group(*m_pool);
+            for (int r = 0;r < m;++r) {
+                group.run([&task, r] { task(r); });
+            }
+            group.wait();
+        }
+
+        // The bucket counts once in the statistics.
+        for (int r = 0;r < m;++r) {
+            context_type& part = *parts[r];
+            const array_type& found_here = part_results(part, results);
+            results.insert(results.end(), found_here.begin(), found_here.end());
+            if (STATS) {
+                ctx.stats += part.stats;
+                ctx.stats.buckets -= part.stats.buckets;
+            }
+        }
+        if (STATS) {
+            ++ctx.stats.buckets;
+        }
+        return found || !results.empty();
+    }
+
+    /**
+     * Computes the hash values of query n-grams for the filters.
+     *  @param  query       The query n-grams.
+     *  @param  ctx         The working memory receiving the hash values
+     *                      (hashes).
+     *  @param  force       \c true to compute the values even if no index
+     *                      opened so far has a filter.
+     *  @return             The hash values, or \c NULL if the indices have
+     *                      no filter or the query has no n-gram.
+     */
+    template <class query_type>
+    const uint64_t* hash_filters(const query_type& query, context_type& ctx, bool force = false)
+    {
+        if ((!m_filters && !force) || query.size() == 0) {
+            return NULL;
+        }
+        std::vector<uint64_t>& hashes = ctx.hashes;
+        hashes.resize(query.size());
+        typename query_type::const_iterator it;
+        int i;
+        for (it = query.begin(), i = 0;it != query.end();++it, ++i) {
+            hashes[i] = filter_hash(ngram_key_data(*it), ngram_key_size(*it));
+        }
+        return &hashes[0];
+    }
+
+    /**
+     * Tests the size buckets of a query with the filters of the indices.
+     *  The blocks of the query n-grams in all the filters are prefetched
+     *  at once, so that a query rejected by every bucket costs the latency
+     *  of a few cache misses instead of one per bucket and n-gram.
+     *  @param  qsize       The number of the query n-grams.
+     *  @param  hashes      The hash values of the query n-grams.
+     *  @param  alpha       The threshold for approximate string matching.
+     *  @param  xmin        The minimum size of the strings.
+     *  @param  xmax        The maximum size of the strings.
+     *  @param  ctx         The working memory of the query.
+     *  @return bool        \c false if no bucket can have a string with
+     *                      enough matches, \c true otherwise (including
+     *                      buckets without a filter).
+     */
+    template <class measure_type, class stats_policy_type>
+    bool test_filters(
+        int qsize,
+        const uint64_t* hashes,
+        double alpha,
+        int xmin,
+        int xmax,
+        context_type& ctx
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        int i, xsize;
+        for (xsize = xmin;xsize <= xmax;++xsize) {
+            const ngram_filter& filter = get_index(xsize).filter;
+            if (filter.is_open()) {
+                for (i = 0;i < qsize;++i) {
+                    filter.prefetch(hashes[i]);
+                }
+            }
+        }
+
+        int skipped = 0;
+        for (xsize = xmin;xsize <= xmax;++xsize) {
+            const index_type& index = get_index(xsize);
+            if (!index.table.is_open()) {
+                continue;
+            } else if (!index.filter.is_open()) {
+                return true;
+            }
+
+            // Count the n-grams that may be in the index until the count
+            // reaches mmin or can no longer reach it.
+            const int mmin = measure_type::min_match(qsize, xsize, alpha);
+            int num = 0;
+            for (i = 0;i < qsize && num < mmin && mmin <= num + qsize - i;++i) {
+                if (index.filter.contains(hashes[i])) {
+                    ++num;
+                }
+            }
+            if (mmin <= num) {
+                return true;
+            }
+            ++skipped;
+        }
+
+        if (STATS) {
+            ctx.stats.skipped += skipped;
+        }
+        return false;
+    }
+
+    /**
+     * Counts Step 1 of a size bucket in the statistics.
+     *  @param  ctx         The working memory with the postings (posts) and
+     *                      the candidates (cands) of the bucket.
+     *  @param  n           The number of the postings merged in Step 1.
+     */
+    void count_step1(context_type& ctx, int n)
+    {
+        reader_stats& stats = ctx.stats;
+        n = std::min(n, (int)ctx.posts.size());
+        ++stats.buckets;
+        for (int i = 0;i < n;++i) {
+            stats.postings += ctx.posts[i].num;
+        }
+        stats.candidates += ctx.cands.size();
+    }
+
+    /**
+     * Obtains the postings of query n-grams from an index.
+     *  The query n-grams are tested with the filter of the index, if any,
+     *  so that the n-grams missing in the index are not looked up, and the
+     *  index is skipped if fewer than mmin n-grams can be found.
+     *  @param  query       The query n-grams.
+     *  @param  hashes      The hash values of the query n-grams for the
+     *                      filter (see hash_filters()), or \c NULL to
+     *                      compute them if the index has a filter.
+     *  @param  xsize       The size of the index.
+     *  @param  mmin        The minimum number of n-gram matches required.
+     *  @param  ctx         The working memory receiving the postings
+     *                      (posts) in ascending order of their sizes, whose
+     *                      statistics (stats) are updated if the policy
+     *                      (stats_policy_type) collects statistics.
+     *  @return bool        \c false if the index is empty or skipped.
+     */
+    template <class stats_policy_type, class query_type>
+    bool fetch(
+        const query_type& query,
+        const uint64_t* hashes,
+        int xsize,
+        int mmin,
+        context_type& ctx
+        )
+    {
+        enum { STATS = stats_policy_type::enabled };
+        int i;
+        inverted_lists_type& posts = ctx.posts;
+        reader_stats& stats = ctx.stats;
+
+        // Access to the n-gram index for the length.
+        const index_type& index = get_index(xsize);
+        const hashtbl_type& tbl = index.table;
+        const ngram_filter& filter = index.filter;
+        if (!tbl.is_open()) {
+            return false;
+        }
+
+        // Search for string entries that match to each query n-gram.
+        // Note that we do not traverse each entry here, but only obtain
+        // the number of and the pointer to the entries. The look-ups are
+        // batched so that their memory accesses overlap.
+        const size_t n = query.size();
+        std::vector<const void*>& keys = ctx.keys;
+        std::vector<const void*>& found = ctx.found;
+        std::vector<size_t>& ksizes = ctx.ksizes;
+        std::vector<size_t>& vsizes = ctx.vsizes;
+        std::vector<int>& slots = ctx.slots;
+        keys.resize(n);
+        found.resize(n);
+        ksizes.resize(n);
+        vsizes.resize(n);
+        size_t m = 0;
+        typename query_type::const_iterator it;
+        if (filter.is_open()) {
+            // Look up only the n-grams that may be in the index; the index
+            // is skipped as soon as it cannot have mmin matches.
+            slots.resize(n);
+            for (it = query.begin(), i = 0;it != query.end();++it, ++i) {
+                keys[i] = ngram_key_data(*it);
+                ksizes[i] = ngram_key_size(*it);
+            }
+            if (hashes == NULL) {
+                hashes = this->hash_filters(query, ctx, true);
+            }
+            for (i = 0;i < (int)n;++i) {
+                filter.prefetch(hashes[i]);
+            }
+            for (i = 0;i < (int)n;++i) {
+                if (filter.contains(hashes[i])) {
+                    keys[m] = keys[i];
+                    ksizes[m] = ksizes[i];
+                    slots[m] = i;
+                    ++m;
+                } else if ((int)(m + n - i - 1) < mmin) {
+                    if (STATS) {
+                        stats.filtered += i + 1 - m;
+                        ++stats.skipped;
+                    }
+                    return false;
+                } else {
+                    posts[i].num = 0;
+                    posts[i].values = NULL;
+                    posts[i].packed = NULL;
+                    posts[i].packed_size = 0;
+                }
+            }
+            if (STATS) {
+                stats.filtered += n - m;
+            }
+        } else {
+            for (it = query.begin(), i = 0;it != query.end();++it, ++i) {
+                keys[i] = ngram_key_data(*it);
+                ksizes[i] = ngram_key_size(*it);
+            }
+            m = n;
+        }
+        if (m != 0) {
+            tbl.get_many(m, &keys[0], &ksizes[0], &found[0], &vsizes[0]);
+        }
+        if (STATS) {
+            stats.lookups += m;
+        }
+
+        for (i = 0;i < (int)m;++i) {
+            inverted_list_type& post = posts[(m == n) ? i : slots[i]];
+            const void *values = found[i];
+            const size_t vsize = vsizes[i];
+            if (m_features & FEATURE_COMPRESSED) {
+                post.num = (int)postings::size(values, vsize);
+                post.values = NULL;
+                post.packed = values;
+                post.packed_size = vsize;
+            } else {
+                post.num = (int)(vsize / sizeof(value_type));
+                post.values = reinterpret_cast<const value_type*>(values);
+                // The context may have served a compressed database.
+                post.packed = NULL;
+                post.packed_size = 0;
+            }
+        }
+
+        // Sort the query n-grams by ascending order of their frequencies.
+        // This reduces the number of initial candidates.
+        std::sort(posts.begin(), posts.end());
+        return true;
+    }
+
+    /**
+     * Merges postings into candidates counting their occurrences.
+     *  @param  ctx         The working memory with the postings (posts),
+     *                      receiving the candidates (cands).
+     *  @param  n           The number of the postings to be merged.
+     */
+    void merge(context_type& ctx, int n)
+    {
+        const inverted_lists_type& posts = ctx.posts;
+        candidates_type& cands = ctx.cands;
+        candidates_type& tmp = ctx.tmp;
+        results_type& buffer = ctx.buffer;
+        n = std::min(n, (int)posts.size());
+        cands.clear();
+
+        // Many postings may be counted faster with an array of counters;
+        // all the postings are decoded in advance for this purpose.
+        const value_type* lists[DENSE_MAX_LISTS];
+        const bool dense = (2 <= n && n <= DENSE_MAX_LISTS);
+        if (dense) {
+            this->decode_all(posts, n, lists, buffer);
+            if (this->count(ctx, n, lists)) {
+                return;
+            }
+        }
+
+        for (int i = 0;i < n;++i) {
+            typename candidates_type::const_iterator itc = cands.begin();
+            const value_type* p = dense ? lists[i] : this->decode(posts[i], buffer);
+            const value_type* last = p + posts[i].num;
+            tmp.clear();
+            tmp.reserve(cands.size() + posts[i].num);
+
+            while (itc != cands.end() && p != last) {
+                if (*p < itc->value) {
+                    // Copy the run of SIDs preceding the candidate.
+                    const value_type* q = simd::lower_bound(p, last, itc->value);
+                    for (;p != q;++p) {
+                        tmp.push_back(candidate_type(*p, 1));
+                    }
+                } else if (itc->value < *p) {
+                    tmp.push_back(*itc);
+                    ++itc;
+                } else {
+                    tmp.push_back(candidate_type(itc->value, itc->num+1));
+                    ++itc;
+                    ++p;
+                }
+            }
+            for (;itc != cands.end();++itc) {
+                tmp.push_back(*itc);
+            }
+            for (;p != last;++p) {
+                tmp.push_back(candidate_type(*p, 1));
+            }
+            std::swap(cands, tmp);
+        }
+    }
+
+    /**
+     * Counts the occurrences of SIDs in postings with an array of counters.
+     *  Merging n postings copies the candidates n times, which dominates
+     *  the time of queries requiring matches with few n-grams. When the
+     *  SIDs are dense in their range, this function counts them in an
+     *  array indexed by SIDs instead, and scans the array once. The array
+     *  belongs to the context and is reused by its later queries.
+     *  @param  ctx         The working memory with the postings (posts),
+     *                      receiving the candidates (cands) in ascending
+     *                      order of SIDs.
+     *  @param  n           The number of the postings to be counted.
+     *  @param  lists       The SIDs of the postings.
+     *  @return bool        \c false if the SIDs are too sparse to count.
+     */
+    bool count(context_type& ctx, int n, const value_type* const* lists)
+    {
+        int i;
+        const inverted_lists_type& posts = ctx.posts;
+        candidates_type& cands = ctx.cands;
+        size_t total = 0, copies = 0;
+        value_type lo = (value_type)-1, hi = 0;
+        for (i = 0;i < n;++i) {
+            if (0 < posts[i].num) {
+                total += posts[i].num;
+                copies += total;
+                lo = std::min(lo, lists[i][0]);
+                hi = std::max(hi, lists[i][posts[i].num-1]);
+            }
+        }
+        if (total == 0) {
+            return false;
+        }
+        const size_t range = (size_t)(hi - lo) + 1;
+        if (DENSE_MAX_RANGE < range || DENSE_RATIO * copies < range) {
+            return false;
+        }
+
+        // Count the SIDs.
+        std::vector<uint8_t>& counters = ctx.counters;
+        const size_t words = (range + 7) / 8;
+        if (counters.size() < 8 * words) {
+            counters.resize(8 * words, 0);
+        }
+        uint8_t* c = &counters[0];
+        for (i = 0;i < n;++i) {
+            const value_type* p = lists[i];
+            const value_type* last = p + posts[i].num;
+            for (;p != last;++p) {
+                ++c[*p - lo];
+            }
+        }
+
+        // Collect the counted SIDs, clearing the counters for the next use.
+        cands.reserve(std::min(total, range));
+        for (size_t w = 0;w < words;++w, c += 8) {
+            uint64_t word;
+            std::memcpy(&word, c, sizeof(word));
+            if (word != 0) {
+                for (int j = 0;j < 8;++j) {
+                    if (c[j] != 0) {
+                        cands.push_back(candidate_type(
+                            lo + (value_type)(8 * w + j), c[j]));
+                    }
+                }
+                std::memset(c, 0, sizeof(word));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Obtains the SIDs of postings, decoding compressed ones in a buffer.
+     *  @param  posts       The postings.
+     *  @param  n           The number of the postings.
+     *  @param  lists       The array receiving the pointers to the SIDs.
+     *  @param  buffer      The buffer for decoding compressed postings.
+     */
+    void decode_all(
+        const inverted_lists_type& posts,
+        int n,
+        const value_type** lists,
+        results_type& buffer
+        )
+    {
+        int i;
+        if (!(m_features & FEATURE_COMPRESSED)) {
+            for (i = 0;i < n;++i) {
+                lists[i] = posts[i].values;
+            }
+            return;
+        }
+
+        size_t total = 0;
+        for (i = 0;i < n;++i) {
+            total += posts[i].num;
+        }
+        buffer.resize(total + 1);
+        for (i = 0, total = 0;i < n;++i) {
+            lists[i] = &buffer[total];
+            postings::decoder(posts[i].packed, posts[i].packed_size).decode(
+                reinterpret_cast<uint32_t*>(&buffer[total]));
+            total += posts[i].num;
+        }
+    }
+
+    /**
+     * Obtains the SIDs of a posting list, decoding compressed postings.
+     *  @param  post        The posting list.
+     *  @param  buffer      The buffer receiving decoded SIDs.
+     *  @return             The pointer to the SIDs.
+     */
+    const value_type* decode(const inverted_list_type& post, results_type& buffer)
+    {
+        if (!(m_features & FEATURE_COMPRESSED)) {
+            return post.values;
+        }
+        buffer.resize(post.num + 1);
+        postings::decoder(post.packed, post.packed_size).decode(
+            reinterpret_cast<uint32_t*>(&buffer[0]));
+        return &buffer[0];
+    }
+
+    /**
+     * Obtains the index storing strings of the specific size.
+     *  When the database was opened with ::simstring::open_eager, this
+     *  function does not modify the reader and is safe to call from
+     *  multiple threads.
+     *  @param  size            The size of strings.
+     *  @return index_type&     The index.
+     */
+    const index_type& get_index(int size)
+    {
+        if (m_flags & open_eager) {
+            return m_indices[size-1];
+        }
+        return open_index(m_name, size);
+    }
+
+    /**
+     * Open the index storing strings of the specific size.
+     *  @param  base            The base name of the indices.
+     *  @param  size            The size of strings.
+     *  @return index_type&     The index.
+     */
+    index_type& open_index(const std::string& base, int size)
+    {
+        index_type& index = m_indices[size-1];
+        if (index.table.is_open()) {
+            return index;
+        }
+        if (m_container != NULL) {
+            const uint64_t* entry = m_directory + 2 * (size-1);
+            if (entry[1] != 0) {
+                index.table.open(m_container + entry[0], (size_t)entry[1]);
+            }
+        } else {
+            std::stringstream ss;
+            ss << base << '.' << size << ".cdb";
+            index.image.open(ss.str().c_str(), std::ios::in, mapping_advice(m_flags));
+            if (index.image.is_open()) {
+                index.table.open(index.image.data(), index.image.size());
+                if ((m_flags & open_lock) &&
+                    !index.image.advise(memory_mapped_file::advise_lock)) {
+                    m_error << "Failed to lock the index in memory: " << ss.str();
+                }
+            }
+        }
+
+        // The filter is the value of the empty key, which is not an n-gram.
+        if (index.table.is_open()) {
+            size_t vsize = 0;
+            const void* value = index.table.get("", 0, &vsize);
+            if (value != NULL && index.filter.open(value, vsize)) {
+                m_filters = true;
+            }
+        }
+        return index;
+    }
+};
+
+
+
+/**
+ * A string retrieved from a SimString database.
+ *  The string points to the memory image of the master file instead of a
+ *  copy, and remains valid until the database is closed.
+ *  @param  char_tmpl       The type of characters.
+ */
+template <class char_tmpl>
+struct result_view
+{
+    /// The type of characters.
+    typedef char_tmpl char_type;
+
+    /// The segment storing the string: zero for the database, and k for
+    /// the k-th delta segment.
+    int segment;
+    /// The SID of the string in the segment.
+    uint32_t sid;
+    /// The pointer to the null-terminated string.
+    const char_type* data;
+    /// The length of the string.
+    size_t length;
+    /// The similarity score for top-k and scored queries, or zero.
+    double score;
 };
 
 
@@ -793,71 +3017,202 @@ protected:
  *  Inheriting the base class ngramdb_reader_base that retrieves string IDs
  *  from a query feature set, this class manages the master string table,
  *  which maintains associations between strings and string IDs.
+ *
+ *  A reader opened with ::simstring::open_eager can be shared by multiple
+ *  threads calling retrieve() and check() at the same time; every query
+ *  keeps its working memory in a query context of its own (see
+ *  query_context). Opening and closing the database must not overlap with
+ *  queries.
+ *
+ *  @param  ngram_generator_tmpl    The type of an n-gram generator. This
+ *                                  must be the type used for building the
+ *                                  database.
+ *  @param  stats_policy_tmpl       The policy of collecting statistics of
+ *                                  queries (::simstring::no_stats or
+ *                                  ::simstring::collect_stats).
  */
-class reader
+template <
+    class ngram_generator_tmpl = ngram_generator,
+    class stats_policy_tmpl = no_stats
+>
+class reader_base
     : public ngramdb_reader_base<uint32_t>
 {
 public:
     /// The type of an n-gram generator.
-    typedef ngram_generator ngram_generator_type;
+    typedef ngram_generator_tmpl ngram_generator_type;
+    /// The policy of collecting statistics of queries.
+    typedef stats_policy_tmpl stats_policy_type;
     /// The type of the base class.
     typedef ngramdb_reader_base<uint32_t> base_type;
 
+    /**
+     * The working memory of queries of a string type.
+     *  A query allocates its buffers in a context, which keeps them for
+     *  later queries. Queries in the steady state thus allocate no memory
+     *  other than the strings given to the insert iterator, unless the
+     *  cache is enabled or the database has deleted strings. A context
+     *  must not be used by multiple threads at the same time. The
+     *  functions without a context parameter use a context of the calling
+     *  thread.
+     *  @param  string_type     The type of query strings.
+     */
+    template <class string_type>
+    struct query_context : public base_type::context_type
+    {
+        /// The type of an n-gram.
+        typedef typename ngram_traits<ngram_generator_type, string_type>::ngram_type ngram_type;
+        /// The n-grams of the query.
+        std::vector<ngram_type> ngrams;
+        /// The SIDs retrieved from a segment.
+        typename base_type::results_type results;
+        /// The key of the cache.
+        std::string key;
+        /// The strings retrieved by top-k and sorted scored queries.
+        std::vector<result_view<typename string_type::value_type> > views;
+    };
+
 protected:
     int m_ngram_unit;
     bool m_be;
+    bool m_utf8;
     int m_char_size;
 
-    /// The content of the master file.
-    std::vector<char> m_strings;
+    /// The memory image of the master file.
+    memory_mapped_file m_image;
+    /// The pointer to the content of the master file.
+    const char* m_strings;
+    /// The offsets of strings indexed by SIDs (FEATURE_LARGE), or \c NULL
+    /// if SIDs are the offsets themselves.
+    const uint64_t* m_offsets;
+    /// The cache of retrieved SIDs.
+    result_cache<uint32_t> m_cache;
+    /// The memory budget of the caches of all the segments.
+    size_t m_cache_budget;
+    /// The number of queries answered from the caches.
+    std::atomic<uint64_t> m_cache_hits;
+    /// The number of queries that missed the caches.
+    std::atomic<uint64_t> m_cache_misses;
+    /// The number of strings in the database.
+    uint32_t m_num_entries;
+    /// The offset to the first string in the master file.
+    size_t m_strings_begin;
+    /// The delta segments appended to the database, from the oldest one.
+    std::vector<reader_base*> m_segments;
+    /// The strings deleted by newer segments, which are hidden.
+    std::unordered_set<std::string> m_deleted;
+    /// The statistics of the queries.
+    reader_stats m_stats;
+    /// The lock of the statistics.
+    mutable std::mutex m_stats_mutex;
+
+    /// Nonzero to collect statistics of queries.
+    enum { STATS = stats_policy_type::enabled };
 
 public:
     /**
      * Constructs an object.
      */
-    reader()
+    reader_base()
+        : m_ngram_unit(0), m_be(false), m_utf8(false), m_char_size(0),
+        m_strings(NULL), m_offsets(NULL), m_cache_budget(0), m_cache_hits(0),
+        m_cache_misses(0), m_num_entries(0), m_strings_begin(0)
     {
     }
 
     /**
      * Destructs an object.
      */
-    virtual ~reader()
+    virtual ~reader_base()
     {
         close();
     }
 
     /**
      * Opens a SimString database.
+     *  The reader also opens the delta segments appended to the database
+     *  (see ::simstring::store_append), and retrieves strings from all of
+     *  them except for the deleted ones.
      *  @param  name        The name of the SimString database.
+     *  @param  flags       The flags for opening the database.
      *  @return bool        \c true if the database is successfully opened,
      *                      \c false otherwise.
+     *  @see    ::simstring::open_eager, ::simstring::open_willneed,
+     *          ::simstring::open_lock
      */
-    bool open(const std::string& name)
+    bool open(const std::string& name, int flags = 0)
+    {
+        close_segments();
+        // Errors of a previous database must not fail this one.
+        this->m_error.str("");
+        if (!this->open_segment(name, flags)) {
+            return false;
+        }
+
+        // Open the delta segments.
+        for (int k = 1;file_exists(segment_name(name, k));++k) {
+            const std::string seg_name = segment_name(name, k);
+            reader_base* seg = new reader_base;
+            m_segments.push_back(seg);
+            seg->set_thread_pool(this->m_pool);
+            if (!seg->open_segment(seg_name, flags)) {
+                // close() clears the error.
+                const std::string message = seg->error();
+                close();
+                this->m_error << message;
+                return false;
+            }
+            if (seg->m_char_size != m_char_size ||
+                seg->m_ngram_unit != m_ngram_unit ||
+                seg->m_be != m_be ||
+                seg->m_utf8 != m_utf8) {
+                close();
+                this->m_error << "Inconsistent parameters of the segment: " << seg_name;
+                return false;
+            }
+        }
+
+        // A string deleted in a segment is hidden in the older ones.
+        std::unordered_set<std::string> deleted;
+        for (size_t k = m_segments.size();0 < k;--k) {
+            m_segments[k-1]->m_deleted = deleted;
+            if (!read_deleted(segment_name(name, (int)k) + ".del", deleted)) {
+                const std::string message = this->error();
+                close();
+                this->m_error << message;
+                return false;
+            }
+        }
+        m_deleted.swap(deleted);
+        share_cache();
+        return true;
+    }
+
+protected:
+    bool open_segment(const std::string& name, int flags)
     {
         uint32_t num_entries, max_size;
 
-        // Open the master file.
-        std::ifstream ifs(name.c_str(), std::ios_base::in | std::ios_base::binary);
-        if (ifs.fail()) {
+        // Map the master file into memory instead of reading its content;
+        // processes opening the same database share the page cache.
+        m_image.close();
+        m_image.open(name, std::ios::in, mapping_advice(flags));
+        if (!m_image.is_open()) {
             this->m_error << "Failed to open the master file: " << name;
             return false;
         }
-
-        // Obtain the size of the master file.
-        ifs.seekg(0, std::ios_base::end);
-        size_t size = (size_t)ifs.tellg();
-        ifs.seekg(0, std::ios_base::beg);
-        
-        // Read the image of the master file.
-        m_strings.resize(size);
-        ifs.read(&m_strings[0], size);
-        ifs.close();
+        if ((flags & open_lock) && !m_image.advise(memory_mapped_file::advise_lock)) {
+            this->m_error << "Failed to lock the master file in memory: " << name;
+            m_image.close();
+            return false;
+        }
 
         // Check the file header.
-        const char* p = &m_strings[0];
-        if (size < 36 || std::strncmp(p, "SSDB", 4) != 0) {
+        size_t size = m_image.size();
+        const char* p = m_image.const_data();
+        if (size < 36 || p == NULL || std::strncmp(p, "SSDB", 4) != 0) {
             this->m_error << "Incorrect file format";
+            m_image.close();
             return false;
         }
         p += 4;
@@ -865,147 +3220,1306 @@ public:
         // Check the byte order.
         if (BYTEORDER_CHECK != read_uint32(p)) {
             this->m_error << "Incompatible byte order";
+            m_image.close();
             return false;
         }
         p += 4;
 
         // Check the version.
-        if (SIMSTRING_STREAM_VERSION != read_uint32(p)) {
+        uint32_t version = read_uint32(p);
+        if (version < SIMSTRING_STREAM_VERSION_MIN || SIMSTRING_STREAM_VERSION < version) {
             this->m_error << "Incompatible stream version";
+            m_image.close();
             return false;
         }
-        p += 4;
-
-        // Check the chunk size.
-        if (size != read_uint32(p)) {
-            this->m_error << "Inconsistent chunk size";
+        if (2 < version && size < 40) {
+            this->m_error << "Incorrect file format";
+            m_image.close();
             return false;
         }
         p += 4;
 
+        // The chunk size is checked after reading the features.
+        uint64_t chunk_size = read_uint32(p);
+        p += 4;
+
         // Read the unit of n-grams, begin/end flag.
         m_char_size = (int)read_uint32(p);
         p += 4;
         m_ngram_unit = (int)read_uint32(p);
         p += 4;
-        m_be = (read_uint32(p) != 0);
+        uint32_t ngram_flags = read_uint32(p);
+        m_be = ((ngram_flags & NGRAM_BE) != 0);
         p += 4;
 
-        // Read the number of enties.
-        num_entries = read_uint32(p);
-        p += 4;
+        // Check the n-gram representation.
+        if (((ngram_flags & NGRAM_HASHED) != 0) !=
+            (ngram_traits<ngram_generator_type, std::string>::hashed != 0)) {
+            this->m_error << "Incompatible n-gram generator";
+            m_image.close();
+            return false;
+        }
+
+        // Read the number of enties.
+        num_entries = read_uint32(p);
+        p += 4;
+
+        // Read the maximum size of strings in the database.
+        max_size = read_uint32(p);
+        p += 4;
+
+        // Read the features of the database format (version 3 or later).
+        uint32_t features = 0;
+        if (2 < version) {
+            features = read_uint32(p);
+            p += 4;
+        }
+        const uint32_t supported =
+            FEATURE_COMPRESSED | FEATURE_LARGE | FEATURE_INLINE_KEYS |
+            FEATURE_SINGLE_FILE | FEATURE_UTF8 | FEATURE_HASHED;
+        if (features & ~supported) {
+            this->m_error << "Unsupported features of the database format";
+            m_image.close();
+            return false;
+        }
+        m_utf8 = ((features & FEATURE_UTF8) != 0);
+        if (m_utf8 && m_char_size != 1) {
+            this->m_error << "Incorrect file format";
+            m_image.close();
+            return false;
+        }
+
+        // Read the 64-bit chunk size, the offset to the table of string
+        // offsets, and the offset to the directory of the indices.
+        uint64_t table_offset = 0, directory_offset = 0;
+        if (features & (FEATURE_LARGE | FEATURE_SINGLE_FILE)) {
+            const size_t header_size = 48 +
+                ((features & FEATURE_LARGE) ? 8 : 0) +
+                ((features & FEATURE_SINGLE_FILE) ? 8 : 0);
+            if (size < header_size) {
+                this->m_error << "Incorrect file format";
+                m_image.close();
+                return false;
+            }
+            chunk_size = read_uint64(p);
+            p += 8;
+            if (features & FEATURE_LARGE) {
+                table_offset = read_uint64(p);
+                p += 8;
+            }
+            if (features & FEATURE_SINGLE_FILE) {
+                directory_offset = read_uint64(p);
+                p += 8;
+            }
+        }
+
+        // Check the chunk size.
+        if (size != chunk_size) {
+            this->m_error << "Inconsistent chunk size";
+            m_image.close();
+            return false;
+        }
+
+        m_strings = m_image.const_data();
+        m_offsets = NULL;
+        if (features & FEATURE_LARGE) {
+            if (table_offset % sizeof(uint64_t) != 0 ||
+                size < table_offset ||
+                (size - table_offset) / sizeof(uint64_t) < num_entries) {
+                this->m_error << "Incorrect table of string offsets";
+                m_image.close();
+                return false;
+            }
+            m_offsets = reinterpret_cast<const uint64_t*>(m_strings + table_offset);
+        }
+
+        // Locate the indices in the master file.
+        const uint64_t* directory = NULL;
+        if (features & FEATURE_SINGLE_FILE) {
+            if (directory_offset % sizeof(uint64_t) != 0 ||
+                size < directory_offset ||
+                (size - directory_offset) / (2 * sizeof(uint64_t)) < max_size) {
+                this->m_error << "Incorrect directory of the indices";
+                m_image.close();
+                return false;
+            }
+            directory = reinterpret_cast<const uint64_t*>(m_strings + directory_offset);
+            for (uint32_t i = 0;i < max_size;++i) {
+                if (size < directory[2*i] || size - directory[2*i] < directory[2*i+1]) {
+                    this->m_error << "Incorrect directory of the indices";
+                    m_image.close();
+                    return false;
+                }
+            }
+        }
+
+        m_num_entries = num_entries;
+        m_strings_begin = (size_t)(p - m_strings);
+        base_type::open(
+            name, (int)max_size, flags, (int)features,
+            directory != NULL ? m_strings : NULL, directory);
+        return !this->fail();
+    }
+
+    bool read_deleted(const std::string& name, std::unordered_set<std::string>& deleted)
+    {
+        std::ifstream ifs(name.c_str(), std::ios::binary);
+        if (!ifs.is_open()) {
+            return true;
+        }
+
+        for (;;) {
+            uint32_t size = 0;
+            ifs.read(reinterpret_cast<char*>(&size), sizeof(size));
+            if (ifs.eof()) {
+                return true;
+            }
+            std::string str(size, '\0');
+            if (0 < size) {
+                ifs.read(&str[0], size);
+            }
+            if (ifs.fail()) {
+                this->m_error << "Failed to read the deleted strings: " << name;
+                return false;
+            }
+            deleted.insert(str);
+        }
+    }
+
+    void share_cache()
+    {
+        // Every segment has an equal share of the budget.
+        size_t share = m_cache_budget / (m_segments.size() + 1);
+        if (m_cache_budget != 0 && share == 0) {
+            share = 1;
+        }
+        m_cache.set_budget(share);
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->m_cache.set_budget(share);
+        }
+        m_cache_hits = 0;
+        m_cache_misses = 0;
+    }
+
+    void close_segments()
+    {
+        for (size_t k = 0;k < m_segments.size();++k) {
+            delete m_segments[k];
+        }
+        m_segments.clear();
+        m_deleted.clear();
+    }
+
+public:
+    /**
+     * Closes the database.
+     */
+    void close()
+    {
+        close_segments();
+        base_type::close();
+        m_image.close();
+        m_strings = NULL;
+        m_offsets = NULL;
+        m_num_entries = 0;
+        m_strings_begin = 0;
+        m_cache.clear();
+        m_cache_hits = 0;
+        m_cache_misses = 0;
+    }
+
+    /**
+     * Merges the delta segments into the database.
+     *  This function writes the strings of the database and its segments,
+     *  except for the deleted ones, into a new database in the same format
+     *  as the database, replaces the database with the new one, removes
+     *  the segments, and reopens the database. Other processes can keep
+     *  using the database opened before the compaction, but must not
+     *  append segments during the compaction.
+     *  @param  string_type     The type of strings in the database, whose
+     *                          characters have the size of char_size().
+     *  @return bool            \c true if the database is successfully
+     *                          compacted, \c false otherwise.
+     */
+    template <class string_type>
+    bool compact()
+    {
+        typedef writer_base<string_type, ngram_generator_type> writer_type;
+
+        if (m_char_size != (int)sizeof(typename string_type::value_type)) {
+            this->m_error << "Inconsistent character size for the compaction";
+            return false;
+        }
+
+        const std::string name = m_name;
+        const std::string temp = name + ".compact";
+        const int flags = m_flags;
+
+        // Keep the format of the database.
+        int store_flags = 0;
+        if (m_features & FEATURE_COMPRESSED) store_flags |= store_compressed;
+        if (m_features & FEATURE_LARGE) store_flags |= store_large;
+        if (m_features & FEATURE_INLINE_KEYS) store_flags |= store_inline_keys;
+        if (m_features & FEATURE_SINGLE_FILE) store_flags |= store_single_file;
+        if (this->ngram_filters()) store_flags |= store_ngram_filters;
+
+        // Write the strings to a new database.
+        ngram_generator_type gen(m_ngram_unit, m_be, m_utf8);
+        writer_type dbw(gen, temp, store_flags);
+        bool b = !dbw.fail();
+        this->for_each_string<string_type>([&](const string_type& str) {
+            b = b && dbw.insert(str);
+        });
+        b = b && dbw.close();
+        if (!b) {
+            this->m_error << dbw.error();
+            return false;
+        }
+
+        // Note the files of the database and the segments.
+        std::vector<std::pair<std::string, int> > dbs;
+        dbs.push_back(std::make_pair(name, m_max_size));
+        for (size_t k = 0;k < m_segments.size();++k) {
+            dbs.push_back(std::make_pair(m_segments[k]->m_name, m_segments[k]->m_max_size));
+        }
+        close();
+
+        // Replace the database, and remove the segments.
+        for (size_t k = 0;k < dbs.size();++k) {
+            for (int size = 1;size <= dbs[k].second;++size) {
+                std::stringstream ss;
+                ss << dbs[k].first << '.' << size << ".cdb";
+                std::remove(ss.str().c_str());
+            }
+            if (0 < k) {
+                std::remove(dbs[k].first.c_str());
+                std::remove((dbs[k].first + ".del").c_str());
+            }
+        }
+        int max_size = 0;
+        for (size_t k = 0;k < dbs.size();++k) {
+            max_size = std::max(max_size, dbs[k].second);
+        }
+        for (int size = 1;size <= max_size;++size) {
+            std::stringstream src, dst;
+            src << temp << '.' << size << ".cdb";
+            dst << name << '.' << size << ".cdb";
+            if (file_exists(src.str())) {
+                std::rename(src.str().c_str(), dst.str().c_str());
+            }
+        }
+        if (std::rename(temp.c_str(), name.c_str()) != 0) {
+            this->m_error << "Failed to replace the database: " << name;
+            return false;
+        }
+
+        return this->open(name, flags);
+    }
+
+    /**
+     * Enumerates the strings in the database in the order of insertion.
+     *  The strings in the delta segments follow those in the database, and
+     *  the deleted strings are skipped.
+     *  @param  string_type     The type of strings in the database, whose
+     *                          characters have the size of char_size().
+     *  @param  func            The function called with every string.
+     */
+    template <class string_type, class function_type>
+    void for_each_string(function_type func) const
+    {
+        typedef typename string_type::value_type char_type;
+
+        const char* p = m_strings + m_strings_begin;
+        for (uint32_t i = 0;i < m_num_entries;++i) {
+            const char_type* xstr = reinterpret_cast<const char_type*>(p);
+            size_t length = 0;
+            while (xstr[length] != 0) {
+                ++length;
+            }
+            if (!is_deleted(xstr, length)) {
+                func(string_type(xstr, length));
+            }
+            p += sizeof(char_type) * (length + 1);
+        }
+
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->template for_each_string<string_type>(func);
+        }
+    }
+
+    /**
+     * Enables the cache of retrieved results.
+     *  The cache stores the SIDs retrieved by retrieve() for each
+     *  combination of the query n-grams, the similarity measure, and the
+     *  threshold, and evicts the least recently used results when the
+     *  memory budget is exceeded. Queries whose n-grams are identical
+     *  except for their order share a cache entry. The cache can be used
+     *  by multiple threads calling retrieve() at the same time; this
+     *  function must not be called while queries are running. The
+     *  segments of the database share the budget equally.
+     *  @param  budget      The memory budget in bytes. Zero disables the
+     *                      cache (default).
+     */
+    void set_cache(size_t budget)
+    {
+        m_cache_budget = budget;
+        share_cache();
+    }
+
+    /**
+     * Runs the size buckets of a query in parallel with a thread pool.
+     *  The segments of the database share the thread pool. This function
+     *  must not be called while queries are running.
+     *  @param  pool        The thread pool, or \c NULL to search the sizes
+     *                      sequentially in the calling thread (default).
+     *  @see    ngramdb_reader_base::set_thread_pool()
+     */
+    void set_thread_pool(thread_pool* pool)
+    {
+        base_type::set_thread_pool(pool);
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->set_thread_pool(pool);
+        }
+    }
+
+    /**
+     * Returns the number of queries answered from the cache.
+     *  A query counts as a hit only if the caches of all the segments of
+     *  the database have its results.
+     */
+    uint64_t cache_hits() const
+    {
+        return m_cache_hits;
+    }
+
+    /**
+     * Returns the number of queries that missed the cache.
+     */
+    uint64_t cache_misses() const
+    {
+        return m_cache_misses;
+    }
+
+    /**
+     * Returns the statistics of the queries issued to this reader.
+     *  A reader collecting statistics (::simstring::collect_stats) adds
+     *  the statistics of every query to these; other readers return zeros.
+     *  The statistics of the last query of a context are in its member
+     *  stats (see context()).
+     */
+    reader_stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        return m_stats;
+    }
+
+    /**
+     * Resets the statistics of the queries issued to this reader.
+     */
+    void clear_stats()
+    {
+        std::lock_guard<std::mutex> lock(m_stats_mutex);
+        m_stats.clear();
+    }
+
+    int char_size() const
+    {
+        return m_char_size;
+    }
+
+    /**
+     * Returns whether the database stores strings in UTF-8 and indexes
+     * n-grams of code points (see ::simstring::FEATURE_UTF8).
+     */
+    bool utf8() const
+    {
+        return m_utf8;
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins
+        )
+    {
+        this->retrieve(query, measure, alpha, ins, context<string_type>());
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @param  ctx             The working memory of the query.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins,
+        query_context<string_type>& ctx
+        )
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve<simstring::measure::exact>(query, alpha, ins, ctx);
+            break;
+        case dice:
+            this->retrieve<simstring::measure::dice>(query, alpha, ins, ctx);
+            break;
+        case cosine:
+            this->retrieve<simstring::measure::cosine>(query, alpha, ins, ctx);
+            break;
+        case jaccard:
+            this->retrieve<simstring::measure::jaccard>(query, alpha, ins, ctx);
+            break;
+        case overlap:
+            this->retrieve<simstring::measure::overlap>(query, alpha, ins, ctx);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
+     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
+     *          ::simstring::measure::overlap
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        double alpha,
+        insert_iterator ins
+        )
+    {
+        this->retrieve<measure_type>(query, alpha, ins, context<string_type>());
+    }
+
+    /**
+     * Retrieves strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives retrieved
+     *                          strings.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve(
+        const string_type& query,
+        double alpha,
+        insert_iterator ins,
+        query_context<string_type>& ctx
+        )
+    {
+        typedef typename string_type::value_type char_type;
+        this->visit<measure_type>(
+            query, alpha, insert_visitor<char_type, insert_iterator>(ins), ctx);
+    }
+
+    /**
+     * Retrieves strings that are similar to the query with their scores.
+     *  The score of a string is computed from the number of n-grams that
+     *  the string shares with the query, which the overlap join has
+     *  counted; the strings thus need no verification afterwards. Unlike
+     *  retrieve(), this function does not use the cache of results.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score
+     *                          (std::pair<string_type, double>).
+     *  @param  sort            \c true to retrieve strings from the most
+     *                          similar one; strings of the same score
+     *                          appear in the order of insertion to the
+     *                          database. \c false to retrieve strings in
+     *                          ascending order of their sizes.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_scored(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins,
+        bool sort
+        )
+    {
+        this->retrieve_scored(query, measure, alpha, ins, sort, context<string_type>());
+    }
+
+    /**
+     * Retrieves strings that are similar to the query with their scores.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @param  sort            \c true to retrieve strings from the most
+     *                          similar one.
+     *  @param  ctx             The working memory of the query.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_scored(
+        const string_type& query,
+        int measure,
+        double alpha,
+        insert_iterator ins,
+        bool sort,
+        query_context<string_type>& ctx
+        )
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve_scored<simstring::measure::exact>(query, alpha, ins, sort, ctx);
+            break;
+        case dice:
+            this->retrieve_scored<simstring::measure::dice>(query, alpha, ins, sort, ctx);
+            break;
+        case cosine:
+            this->retrieve_scored<simstring::measure::cosine>(query, alpha, ins, sort, ctx);
+            break;
+        case jaccard:
+            this->retrieve_scored<simstring::measure::jaccard>(query, alpha, ins, sort, ctx);
+            break;
+        case overlap:
+            this->retrieve_scored<simstring::measure::overlap>(query, alpha, ins, sort, ctx);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves strings that are similar to the query with their scores.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @param  sort            \c true to retrieve strings from the most
+     *                          similar one.
+     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
+     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
+     *          ::simstring::measure::overlap
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_scored(
+        const string_type& query,
+        double alpha,
+        insert_iterator ins,
+        bool sort
+        )
+    {
+        this->retrieve_scored<measure_type>(query, alpha, ins, sort, context<string_type>());
+    }
+
+    /**
+     * Retrieves strings that are similar to the query with their scores.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @param  sort            \c true to retrieve strings from the most
+     *                          similar one.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_scored(
+        const string_type& query,
+        double alpha,
+        insert_iterator ins,
+        bool sort,
+        query_context<string_type>& ctx
+        )
+    {
+        this->visit_scored<measure_type>(
+            query, alpha, scored_insert_visitor<string_type, insert_iterator>(ins), sort, ctx);
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score
+     *                          (std::pair<string_type, double>), from the
+     *                          most similar one. Strings of the same score
+     *                          appear in the order of insertion to the
+     *                          database.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        insert_iterator ins
+        )
+    {
+        this->retrieve_topk(query, measure, k, ins, context<string_type>());
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @param  ctx             The working memory of the query.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        insert_iterator ins,
+        query_context<string_type>& ctx
+        )
+    {
+        switch (measure) {
+        case exact:
+            this->retrieve_topk<simstring::measure::exact>(query, k, ins, ctx);
+            break;
+        case dice:
+            this->retrieve_topk<simstring::measure::dice>(query, k, ins, ctx);
+            break;
+        case cosine:
+            this->retrieve_topk<simstring::measure::cosine>(query, k, ins, ctx);
+            break;
+        case jaccard:
+            this->retrieve_topk<simstring::measure::jaccard>(query, k, ins, ctx);
+            break;
+        case overlap:
+            this->retrieve_topk<simstring::measure::overlap>(query, k, ins, ctx);
+            break;
+        }
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
+     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
+     *          ::simstring::measure::overlap
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int k,
+        insert_iterator ins
+        )
+    {
+        this->retrieve_topk<measure_type>(query, k, ins, context<string_type>());
+    }
+
+    /**
+     * Retrieves the k strings most similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  ins             The insert iterator that receives pairs of
+     *                          a retrieved string and its similarity score.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class insert_iterator>
+    void retrieve_topk(
+        const string_type& query,
+        int k,
+        insert_iterator ins,
+        query_context<string_type>& ctx
+        )
+    {
+        this->visit_topk<measure_type>(
+            query, k, scored_insert_visitor<string_type, insert_iterator>(ins), ctx);
+    }
+
+    /**
+     * Visits strings that are similar to the query.
+     *  Unlike retrieve(), this function does not copy the retrieved
+     *  strings, but calls the visitor with a view of every string in the
+     *  memory image of the database (see ::simstring::result_view).
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view
+     *                          (const result_view<char_type>&) of every
+     *                          retrieved string.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class visitor_type>
+    void visit(
+        const string_type& query,
+        int measure,
+        double alpha,
+        visitor_type visitor
+        )
+    {
+        this->visit(query, measure, alpha, visitor, context<string_type>());
+    }
+
+    /**
+     * Visits strings that are similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string.
+     *  @param  ctx             The working memory of the query.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class visitor_type>
+    void visit(
+        const string_type& query,
+        int measure,
+        double alpha,
+        visitor_type visitor,
+        query_context<string_type>& ctx
+        )
+    {
+        switch (measure) {
+        case exact:
+            this->visit<simstring::measure::exact>(query, alpha, visitor, ctx);
+            break;
+        case dice:
+            this->visit<simstring::measure::dice>(query, alpha, visitor, ctx);
+            break;
+        case cosine:
+            this->visit<simstring::measure::cosine>(query, alpha, visitor, ctx);
+            break;
+        case jaccard:
+            this->visit<simstring::measure::jaccard>(query, alpha, visitor, ctx);
+            break;
+        case overlap:
+            this->visit<simstring::measure::overlap>(query, alpha, visitor, ctx);
+            break;
+        }
+    }
+
+    /**
+     * Visits strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string.
+     */
+    template <class measure_type, class string_type, class visitor_type>
+    void visit(
+        const string_type& query,
+        double alpha,
+        visitor_type visitor
+        )
+    {
+        this->visit<measure_type>(query, alpha, visitor, context<string_type>());
+    }
+
+    /**
+     * Visits strings that are similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class visitor_type>
+    void visit(
+        const string_type& query,
+        double alpha,
+        visitor_type visitor,
+        query_context<string_type>& ctx
+        )
+    {
+        typedef typename string_type::value_type char_type;
+
+        this->begin_query(ctx);
+        stopwatch<STATS> sw;
+        ngram_generator_type gen(m_ngram_unit, m_be, m_utf8);
+        gen.generate(query, ctx.ngrams);
+        sw.lap(ctx.stats.ngram_seconds);
+
+        bool hit = this->visit_segment<measure_type, char_type>(ctx.ngrams, alpha, visitor, 0, ctx);
+        for (size_t k = 0;k < m_segments.size();++k) {
+            hit &= m_segments[k]->template visit_segment<measure_type, char_type>(
+                ctx.ngrams, alpha, visitor, (int)k + 1, ctx);
+        }
+        if (m_cache.enabled()) {
+            ++(hit ? m_cache_hits : m_cache_misses);
+        }
+        this->end_query(ctx);
+    }
+
+    /**
+     * Visits strings that are similar to the query with their scores.
+     *  This function calls the visitor with the views of the strings that
+     *  visit() finds, whose scores (result_view::score) are computed from
+     *  the numbers of matches counted by the overlap join (see
+     *  retrieve_scored()).
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view
+     *                          (const result_view<char_type>&) of every
+     *                          retrieved string with its score.
+     *  @param  sort            \c true to visit strings from the most
+     *                          similar one.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class visitor_type>
+    void visit_scored(
+        const string_type& query,
+        int measure,
+        double alpha,
+        visitor_type visitor,
+        bool sort
+        )
+    {
+        this->visit_scored(query, measure, alpha, visitor, sort, context<string_type>());
+    }
+
+    /**
+     * Visits strings that are similar to the query with their scores.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
+     *  @param  sort            \c true to visit strings from the most
+     *                          similar one.
+     *  @param  ctx             The working memory of the query.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type, class visitor_type>
+    void visit_scored(
+        const string_type& query,
+        int measure,
+        double alpha,
+        visitor_type visitor,
+        bool sort,
+        query_context<string_type>& ctx
+        )
+    {
+        switch (measure) {
+        case exact:
+            this->visit_scored<simstring::measure::exact>(query, alpha, visitor, sort, ctx);
+            break;
+        case dice:
+            this->visit_scored<simstring::measure::dice>(query, alpha, visitor, sort, ctx);
+            break;
+        case cosine:
+            this->visit_scored<simstring::measure::cosine>(query, alpha, visitor, sort, ctx);
+            break;
+        case jaccard:
+            this->visit_scored<simstring::measure::jaccard>(query, alpha, visitor, sort, ctx);
+            break;
+        case overlap:
+            this->visit_scored<simstring::measure::overlap>(query, alpha, visitor, sort, ctx);
+            break;
+        }
+    }
+
+    /**
+     * Visits strings that are similar to the query with their scores.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
+     *  @param  sort            \c true to visit strings from the most
+     *                          similar one.
+     */
+    template <class measure_type, class string_type, class visitor_type>
+    void visit_scored(
+        const string_type& query,
+        double alpha,
+        visitor_type visitor,
+        bool sort
+        )
+    {
+        this->visit_scored<measure_type>(query, alpha, visitor, sort, context<string_type>());
+    }
+
+    /**
+     * Visits strings that are similar to the query with their scores.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
+     *  @param  sort            \c true to visit strings from the most
+     *                          similar one.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class visitor_type>
+    void visit_scored(
+        const string_type& query,
+        double alpha,
+        visitor_type visitor,
+        bool sort,
+        query_context<string_type>& ctx
+        )
+    {
+        typedef typename string_type::value_type char_type;
+        typedef result_view<char_type> view_type;
+
+        this->begin_query(ctx);
+        stopwatch<STATS> sw;
+        ngram_generator_type gen(m_ngram_unit, m_be, m_utf8);
+        gen.generate(query, ctx.ngrams);
+        sw.lap(ctx.stats.ngram_seconds);
+
+        if (!sort) {
+            this->scored_segment<measure_type, char_type>(ctx.ngrams, alpha, visitor, 0, ctx);
+            for (size_t k = 0;k < m_segments.size();++k) {
+                m_segments[k]->template scored_segment<measure_type, char_type>(
+                    ctx.ngrams, alpha, visitor, (int)k + 1, ctx);
+            }
+            this->end_query(ctx);
+            return;
+        }
+
+        // Collect the views of all the segments to sort them.
+        std::vector<view_type>& views = ctx.views;
+        views.clear();
+        auto collect = [&views](const view_type& r) {
+            views.push_back(r);
+        };
+        this->scored_segment<measure_type, char_type>(ctx.ngrams, alpha, collect, 0, ctx);
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->template scored_segment<measure_type, char_type>(
+                ctx.ngrams, alpha, collect, (int)k + 1, ctx);
+        }
 
-        // Read the maximum size of strings in the database.
-        max_size = read_uint32(p);
+        // Ties are in the order of insertion: older segments, then SIDs.
+        std::sort(
+            views.begin(), views.end(),
+            [](const view_type& x, const view_type& y) {
+                if (x.score != y.score) {
+                    return x.score > y.score;
+                }
+                return (x.segment < y.segment || (x.segment == y.segment && x.sid < y.sid));
+            });
 
-        base_type::open(name, (int)max_size);
-        return true;
+        typename std::vector<view_type>::const_iterator it;
+        for (it = views.begin();it != views.end();++it) {
+            visitor(*it);
+        }
+        this->end_query(ctx);
     }
 
     /**
-     * Closes the database.
+     * Visits the k strings most similar to the query.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  visitor         The function object called with a view
+     *                          (const result_view<char_type>&) of every
+     *                          retrieved string with its score, from the
+     *                          most similar one (see retrieve_topk()).
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
      */
-    void close()
-    {
-        base_type::close();
-    }
-
-    int char_size() const
+    template <class string_type, class visitor_type>
+    void visit_topk(
+        const string_type& query,
+        int measure,
+        int k,
+        visitor_type visitor
+        )
     {
-        return m_char_size;
+        this->visit_topk(query, measure, k, visitor, context<string_type>());
     }
 
     /**
-     * Retrieves strings that are similar to the query.
+     * Visits the k strings most similar to the query.
      *  @param  query           The query string.
      *  @param  measure         The similarity measure.
-     *  @param  alpha           The threshold for approximate string matching.
-     *  @param  ins             The insert iterator that receives retrieved
-     *                          strings.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
+     *  @param  ctx             The working memory of the query.
      *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
      *          ::simstring::jaccard, ::simstring::overlap
      */
-    template <class string_type, class insert_iterator>
-    void retrieve(
+    template <class string_type, class visitor_type>
+    void visit_topk(
         const string_type& query,
         int measure,
-        double alpha,
-        insert_iterator ins
+        int k,
+        visitor_type visitor,
+        query_context<string_type>& ctx
         )
     {
         switch (measure) {
         case exact:
-            this->retrieve<simstring::measure::exact>(query, alpha, ins);
+            this->visit_topk<simstring::measure::exact>(query, k, visitor, ctx);
             break;
         case dice:
-            this->retrieve<simstring::measure::dice>(query, alpha, ins);
+            this->visit_topk<simstring::measure::dice>(query, k, visitor, ctx);
             break;
         case cosine:
-            this->retrieve<simstring::measure::cosine>(query, alpha, ins);
+            this->visit_topk<simstring::measure::cosine>(query, k, visitor, ctx);
             break;
         case jaccard:
-            this->retrieve<simstring::measure::jaccard>(query, alpha, ins);
+            this->visit_topk<simstring::measure::jaccard>(query, k, visitor, ctx);
             break;
         case overlap:
-            this->retrieve<simstring::measure::overlap>(query, alpha, ins);
+            this->visit_topk<simstring::measure::overlap>(query, k, visitor, ctx);
             break;
         }
     }
 
     /**
-     * Retrieves strings that are similar to the query.
+     * Visits the k strings most similar to the query.
      *  @param  measure_type    The similarity measure.
      *  @param  query           The query string.
-     *  @param  alpha           The threshold for approximate string matching.
-     *  @param  ins             The insert iterator that receives retrieved
-     *                          strings.
-     *  @see    ::simstring::measure::exact, ::simstring::measure::dice,
-     *          ::simstring::measure::cosine, ::simstring::measure::jaccard,
-     *          ::simstring::measure::overlap
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
      */
-    template <class measure_type, class string_type, class insert_iterator>
-    void retrieve(
+    template <class measure_type, class string_type, class visitor_type>
+    void visit_topk(
         const string_type& query,
-        double alpha,
-        insert_iterator ins
+        int k,
+        visitor_type visitor
+        )
+    {
+        this->visit_topk<measure_type>(query, k, visitor, context<string_type>());
+    }
+
+    /**
+     * Visits the k strings most similar to the query.
+     *  @param  measure_type    The similarity measure.
+     *  @param  query           The query string.
+     *  @param  k               The number of strings to be retrieved.
+     *  @param  visitor         The function object called with a view of
+     *                          every retrieved string with its score.
+     *  @param  ctx             The working memory of the query.
+     */
+    template <class measure_type, class string_type, class visitor_type>
+    void visit_topk(
+        const string_type& query,
+        int k,
+        visitor_type visitor,
+        query_context<string_type>& ctx
         )
     {
-        typedef std::vector<string_type> ngrams_type;
         typedef typename string_type::value_type char_type;
+        typedef result_view<char_type> view_type;
+
+        this->begin_query(ctx);
+        stopwatch<STATS> sw;
+        ngram_generator_type gen(m_ngram_unit, m_be, m_utf8);
+        gen.generate(query, ctx.ngrams);
+        sw.lap(ctx.stats.ngram_seconds);
+
+        std::vector<view_type>& views = ctx.views;
+        views.clear();
+        this->topk_segment<measure_type, char_type>(ctx.ngrams, k, views, 0, ctx);
+        if (!m_segments.empty()) {
+            for (size_t i = 0;i < m_segments.size();++i) {
+                m_segments[i]->template topk_segment<measure_type, char_type>(
+                    ctx.ngrams, k, views, (int)i + 1, ctx);
+            }
 
-        ngram_generator_type gen(m_ngram_unit, m_be);
-        ngrams_type ngrams;
-        gen(query, std::back_inserter(ngrams));
+            // Older segments win ties.
+            std::stable_sort(
+                views.begin(), views.end(),
+                [](const view_type& x, const view_type& y) {
+                    return x.score > y.score;
+                });
+            if (0 <= k && k < (int)views.size()) {
+                views.resize(k);
+            }
+        }
 
-        typename base_type::results_type results;
-        base_type::overlapjoin<measure_type>(ngrams, alpha, results, false);
+        typename std::vector<view_type>::const_iterator it;
+        for (it = views.begin();it != views.end();++it) {
+            visitor(*it);
+        }
+        this->end_query(ctx);
+    }
 
-        typename base_type::results_type::const_iterator it;
-        const char* strings = &m_strings[0];
-        for (it = results.begin();it != results.end();++it) {
-            const char_type* xstr = reinterpret_cast<const char_type*>(strings + *it);
-            *ins = xstr;
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  The queries are processed in parallel by the workers of the thread
+     *  pool. Because the cost of a query varies with its length, queries
+     *  are split into small tasks that idle workers steal from busy ones.
+     *  If the database was not opened with ::simstring::open_eager, this
+     *  function opens all the indices before processing the queries.
+     *  @param  queries         The query strings.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  results         The vector that receives the strings
+     *                          retrieved for each query, in the same order
+     *                          as the queries.
+     *  @param  pool            The thread pool processing the queries.
+     *  @see    ::simstring::exact, ::simstring::dice, ::simstring::cosine,
+     *          ::simstring::jaccard, ::simstring::overlap
+     */
+    template <class string_type>
+    void retrieve_batch(
+        const std::vector<string_type>& queries,
+        int measure,
+        double alpha,
+        std::vector<std::vector<string_type> >& results,
+        thread_pool& pool
+        )
+    {
+        // Queries must not open indices while sharing the reader.
+        this->open_indices();
+
+        results.clear();
+        results.resize(queries.size());
+        parallel_for(pool, queries.size(), 16, [&](size_t i) {
+            this->retrieve(
+                queries[i], measure, alpha, std::back_inserter(results[i]));
+        });
+    }
+
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  This function creates a thread pool for processing the batch.
+     *  @param  queries         The query strings.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @param  results         The vector that receives the strings
+     *                          retrieved for each query, in the same order
+     *                          as the queries.
+     *  @param  num_threads     The number of threads. Zero uses the number
+     *                          of hardware threads.
+     */
+    template <class string_type>
+    void retrieve_batch(
+        const std::vector<string_type>& queries,
+        int measure,
+        double alpha,
+        std::vector<std::vector<string_type> >& results,
+        int num_threads = 0
+        )
+    {
+        thread_pool pool(num_threads);
+        this->retrieve_batch(queries, measure, alpha, results, pool);
+    }
+
+    /**
+     * Loads the whole database into memory.
+     *  This function opens all the indices (see retrieve_batch()) and reads
+     *  every page of the master file and the indices with the workers of
+     *  the thread pool, so that the first queries after opening the
+     *  database do not wait for page faults.
+     *  @param  pool            The thread pool reading the database.
+     */
+    void warmup(thread_pool& pool)
+    {
+        enum { CHUNK_SIZE = 0x400000 };
+
+        // Queries must not open indices while sharing the reader.
+        this->open_indices();
+
+        // Split the memory images into chunks read in parallel.
+        std::vector<const memory_mapped_file*> images;
+        std::vector<std::pair<const memory_mapped_file*, size_t> > chunks;
+        this->get_images(images);
+        for (size_t i = 0;i < images.size();++i) {
+            for (size_t offset = 0;offset < images[i]->size();offset += CHUNK_SIZE) {
+                chunks.push_back(std::make_pair(images[i], offset));
+            }
         }
+        parallel_for(pool, chunks.size(), 1, [&](size_t i) {
+            chunks[i].first->warmup(chunks[i].second, chunks[i].second + CHUNK_SIZE);
+        });
+    }
+
+    /**
+     * Loads the whole database into memory.
+     *  This function creates a thread pool for reading the database.
+     *  @param  num_threads     The number of threads. Zero uses the number
+     *                          of hardware threads.
+     */
+    void warmup(int num_threads = 0)
+    {
+        thread_pool pool(num_threads);
+        this->warmup(pool);
     }
 
+    /**
+     * Checks whether the database has a string similar to the query.
+     *  With the filters of a database built with
+     *  ::simstring::store_ngram_filters, most queries without a similar
+     *  string are answered before looking up n-grams in the indices.
+     *  @param  query           The query string.
+     *  @param  measure         The similarity measure.
+     *  @param  alpha           The threshold for approximate string matching.
+     *  @return bool            \c true if a similar string is found.
+     */
     template <class string_type>
     bool check(
         const string_type& query,
         int measure,
         double alpha
         )
+    {
+        return this->check(query, measure, alpha, context<string_type>());
+    }
+
+    template <class string_type>
+    bool check(
+        const string_type& query,
+        int measure,
+        double alpha,
+        query_context<string_type>& ctx
+        )
     {
         switch (measure) {
         case exact:
-            return this->check<simstring::measure::exact>(query, alpha);
+            return this->check<simstring::measure::exact>(query, alpha, ctx);
         case dice:
-            return this->check<simstring::measure::dice>(query, alpha);
+            return this->check<simstring::measure::dice>(query, alpha, ctx);
         case cosine:
-            return this->check<simstring::measure::cosine>(query, alpha);
+            return this->check<simstring::measure::cosine>(query, alpha, ctx);
         case jaccard:
-            return this->check<simstring::measure::jaccard>(query, alpha);
+            return this->check<simstring::measure::jaccard>(query, alpha, ctx);
         case overlap:
-            return this->check<simstring::measure::overlap>(query, alpha);
+            return this->check<simstring::measure::overlap>(query, alpha, ctx);
         }
         return false;
     }
@@ -1016,24 +4530,353 @@ public:
         double alpha
         )
     {
-        typedef std::vector<string_type> ngrams_type;
+        return this->check<measure_type>(query, alpha, context<string_type>());
+    }
+
+    template <class measure_type, class string_type>
+    bool check(
+        const string_type& query,
+        double alpha,
+        query_context<string_type>& ctx
+        )
+    {
         typedef typename string_type::value_type char_type;
 
-        ngram_generator_type gen(m_ngram_unit, m_be);
-        ngrams_type ngrams;
-        gen(query, std::back_inserter(ngrams));
+        this->begin_query(ctx);
+        stopwatch<STATS> sw;
+        ngram_generator_type gen(m_ngram_unit, m_be, m_utf8);
+        gen.generate(query, ctx.ngrams);
+        sw.lap(ctx.stats.ngram_seconds);
 
-        typename base_type::results_type results;
-        return base_type::overlapjoin<measure_type>(ngrams, alpha, results, true);
+        bool found = this->check_segment<measure_type, char_type>(ctx.ngrams, alpha, ctx);
+        for (size_t k = 0;k < m_segments.size() && !found;++k) {
+            found = m_segments[k]->template check_segment<measure_type, char_type>(
+                ctx.ngrams, alpha, ctx);
+        }
+        this->end_query(ctx);
+        return found;
+    }
+
+    /**
+     * Returns the query context of the calling thread for a string type.
+     */
+    template <class string_type>
+    static query_context<string_type>& context()
+    {
+        static thread_local query_context<string_type> instance;
+        return instance;
     }
 
 protected:
+    /**
+     * Starts collecting the statistics of a query.
+     */
+    void begin_query(base_type::context_type& ctx)
+    {
+        if (STATS) {
+            ctx.stats.clear();
+        }
+    }
+
+    /**
+     * Adds the statistics of a query to the statistics of the reader.
+     */
+    void end_query(base_type::context_type& ctx)
+    {
+        if (STATS) {
+            ctx.stats.queries = 1;
+            std::lock_guard<std::mutex> lock(m_stats_mutex);
+            m_stats += ctx.stats;
+        }
+    }
+
+    /**
+     * Puts retrieved strings to an insert iterator.
+     */
+    template <class char_type, class insert_iterator>
+    struct insert_visitor
+    {
+        insert_iterator ins;
+
+        insert_visitor(insert_iterator i) : ins(i)
+        {
+        }
+
+        void operator()(const result_view<char_type>& r)
+        {
+            *ins = r.data;
+        }
+    };
+
+    /**
+     * Puts retrieved strings and their scores to an insert iterator.
+     */
+    template <class string_type, class insert_iterator>
+    struct scored_insert_visitor
+    {
+        typedef typename string_type::value_type char_type;
+        insert_iterator ins;
+
+        scored_insert_visitor(insert_iterator i) : ins(i)
+        {
+        }
+
+        void operator()(const result_view<char_type>& r)
+        {
+            *ins = std::pair<string_type, double>(string_type(r.data, r.length), r.score);
+        }
+    };
+
+    /**
+     * Visits strings similar to the query n-grams in this segment, and
+     * returns \c true if the results are found in the cache.
+     */
+    template <class measure_type, class char_type, class ngrams_type, class visitor_type, class query_context_type>
+    bool visit_segment(
+        const ngrams_type& ngrams,
+        double alpha,
+        visitor_type& visitor,
+        int segment,
+        query_context_type& ctx
+        )
+    {
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        bool hit = false;
+        if (m_cache.enabled()) {
+            std::string& key = ctx.key;
+            cache_key<measure_type>(ngrams, alpha, key);
+            hit = m_cache.find(key, results);
+            if (!hit) {
+                base_type::overlapjoin<measure_type, stats_policy_type>(ngrams, alpha, results, false, ctx);
+                m_cache.insert(key, results);
+            }
+        } else {
+            base_type::overlapjoin<measure_type, stats_policy_type>(ngrams, alpha, results, false, ctx);
+        }
+
+        result_view<char_type> r;
+        r.segment = segment;
+        r.score = 0.;
+        typename base_type::results_type::const_iterator it;
+        for (it = results.begin();it != results.end();++it) {
+            r.sid = *it;
+            r.data = reinterpret_cast<const char_type*>(get_string(*it));
+            r.length = string_length(r.data);
+            if (m_deleted.empty() || !is_deleted(r.data, r.length)) {
+                visitor(r);
+            }
+        }
+        return hit;
+    }
+
+    /**
+     * Visits strings similar to the query n-grams in this segment with
+     * their scores, in ascending order of sizes and SIDs.
+     */
+    template <class measure_type, class char_type, class ngrams_type, class visitor_type, class query_context_type>
+    void scored_segment(
+        const ngrams_type& ngrams,
+        double alpha,
+        visitor_type& visitor,
+        int segment,
+        query_context_type& ctx
+        )
+    {
+        typename base_type::scored_results_type& scored = ctx.scored;
+        scored.clear();
+        base_type::overlapjoin<measure_type, stats_policy_type>(ngrams, alpha, scored, false, ctx);
+
+        result_view<char_type> r;
+        r.segment = segment;
+        typename base_type::scored_results_type::const_iterator it;
+        for (it = scored.begin();it != scored.end();++it) {
+            r.sid = it->value;
+            r.data = reinterpret_cast<const char_type*>(get_string(it->value));
+            r.length = string_length(r.data);
+            r.score = it->score;
+            if (m_deleted.empty() || !is_deleted(r.data, r.length)) {
+                visitor(r);
+            }
+        }
+    }
+
+    /**
+     * Finds the k strings of this segment most similar to the query
+     * n-grams, and appends their views to an array.
+     */
+    template <class measure_type, class char_type, class ngrams_type, class query_context_type>
+    void topk_segment(
+        const ngrams_type& ngrams,
+        int k,
+        std::vector<result_view<char_type> >& views,
+        int segment,
+        query_context_type& ctx
+        )
+    {
+        // Ask for more strings when some of them can be deleted.
+        const size_t begin = views.size();
+        int kk = (k < 0) ? k : k + (int)m_deleted.size();
+        for (;;) {
+            typename base_type::scored_results_type& scored = ctx.scored;
+            base_type::overlapjoin_topk<measure_type, stats_policy_type>(ngrams, kk, scored, ctx);
+
+            int n = 0;
+            result_view<char_type> r;
+            r.segment = segment;
+            typename base_type::scored_results_type::const_iterator it;
+            for (it = scored.begin();it != scored.end() && (k < 0 || n < k);++it) {
+                r.sid = it->value;
+                r.data = reinterpret_cast<const char_type*>(get_string(it->value));
+                r.length = string_length(r.data);
+                r.score = it->score;
+                if (m_deleted.empty() || !is_deleted(r.data, r.length)) {
+                    views.push_back(r);
+                    ++n;
+                }
+            }
+
+            if (k < 0 || n == k || (int)scored.size() < kk) {
+                break;
+            }
+            views.resize(begin);
+            kk *= 2;
+        }
+    }
+
+    /**
+     * Checks whether this segment has a string similar to the query n-grams.
+     */
+    template <class measure_type, class char_type, class ngrams_type, class query_context_type>
+    bool check_segment(const ngrams_type& ngrams, double alpha, query_context_type& ctx)
+    {
+        typename base_type::results_type& results = ctx.results;
+        results.clear();
+        if (m_deleted.empty()) {
+            return base_type::overlapjoin<measure_type, stats_policy_type>(ngrams, alpha, results, true, ctx);
+        }
+
+        // Find a string that is not deleted.
+        base_type::overlapjoin<measure_type, stats_policy_type>(ngrams, alpha, results, false, ctx);
+        typename base_type::results_type::const_iterator it;
+        for (it = results.begin();it != results.end();++it) {
+            if (!is_deleted(reinterpret_cast<const char_type*>(get_string(*it)))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Opens all the indices of the database and the segments.
+     */
+    void open_indices()
+    {
+        if (!(m_flags & open_eager)) {
+            for (int size = 1;size <= m_max_size;++size) {
+                open_index(m_name, size);
+            }
+            m_flags |= open_eager;
+        }
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->open_indices();
+        }
+    }
+
+    /**
+     * Collects the memory images of the database and the segments.
+     */
+    void get_images(std::vector<const memory_mapped_file*>& images) const
+    {
+        images.push_back(&m_image);
+        for (size_t i = 0;i < m_indices.size();++i) {
+            if (m_indices[i].image.is_open()) {
+                images.push_back(&m_indices[i].image);
+            }
+        }
+        for (size_t k = 0;k < m_segments.size();++k) {
+            m_segments[k]->get_images(images);
+        }
+    }
+
+    /**
+     * Checks whether a string of this segment is deleted.
+     */
+    template <class char_type>
+    bool is_deleted(const char_type* xstr, size_t length) const
+    {
+        if (m_deleted.empty()) {
+            return false;
+        }
+        std::string key(
+            reinterpret_cast<const char*>(xstr), sizeof(char_type) * length);
+        return (m_deleted.find(key) != m_deleted.end());
+    }
+
+    template <class char_type>
+    bool is_deleted(const char_type* xstr) const
+    {
+        return is_deleted(xstr, string_length(xstr));
+    }
+
+    /**
+     * Returns the length of a null-terminated string.
+     */
+    template <class char_type>
+    static size_t string_length(const char_type* xstr)
+    {
+        size_t length = 0;
+        while (xstr[length] != 0) {
+            ++length;
+        }
+        return length;
+    }
+
+    /**
+     * Returns the pointer to the string of a SID in the master file.
+     */
+    inline const char* get_string(uint32_t sid) const
+    {
+        return m_strings + (m_offsets != NULL ? m_offsets[sid] : (uint64_t)sid);
+    }
+
+    /**
+     * Builds the key of the result cache for a query.
+     *  @param  ngrams      The query n-grams.
+     *  @param  alpha       The threshold.
+     *  @param  key         The string receiving the key.
+     */
+    template <class measure_type, class ngrams_type>
+    static void cache_key(const ngrams_type& ngrams, double alpha, std::string& key)
+    {
+        ngrams_type sorted(ngrams);
+        std::sort(sorted.begin(), sorted.end());
+
+        key = typeid(measure_type).name();
+        key.append(1, '\0');
+        key.append(reinterpret_cast<const char*>(&alpha), sizeof(alpha));
+        typename ngrams_type::const_iterator it;
+        for (it = sorted.begin();it != sorted.end();++it) {
+            uint32_t size = (uint32_t)ngram_key_size(*it);
+            key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+            key.append(reinterpret_cast<const char*>(ngram_key_data(*it)), size);
+        }
+    }
+
     inline uint32_t read_uint32(const char* p) const
     {
         return *reinterpret_cast<const uint32_t*>(p);
     }
+
+    inline uint64_t read_uint64(const char* p) const
+    {
+        return *reinterpret_cast<const uint64_t*>(p);
+    }
 };
 
+/// SimString database reader with the standard n-gram generator.
+typedef reader_base<ngram_generator> reader;
+
 };
 
 /** @} */
@@ -0,0 +1,179 @@
+/*
+ *      Statistics of queries.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_STATS_H__
+#define __SIMSTRING_STATS_H__
+
+#include <stdint.h>
+#include <chrono>
+
+namespace simstring
+{
+
+/**
+ * Statistics of queries.
+ *  A reader collecting statistics (see ::simstring::collect_stats) fills
+ *  this structure for every query in its context, and adds it to the
+ *  statistics of the reader. The counters of the steps of the overlap join
+ *  tell why a query is slow: many size buckets come from low thresholds,
+ *  many candidates from frequent n-grams, and few prunes from thresholds
+ *  that are too low for the n-gram size.
+ */
+struct reader_stats
+{
+    /// The number of queries.
+    uint64_t queries;
+    /// The number of string sizes (indices) searched.
+    uint64_t buckets;
+    /// The number of look-ups of query n-grams in the indices.
+    uint64_t lookups;
+    /// The number of query n-grams rejected by the filters of the indices
+    /// without look-ups (see ::simstring::store_ngram_filters).
+    uint64_t filtered;
+    /// The number of string sizes skipped because the filters rejected
+    /// too many query n-grams.
+    uint64_t skipped;
+    /// The number of SIDs in the postings merged in Step 1.
+    uint64_t postings;
+    /// The number of candidates found in Step 1.
+    uint64_t candidates;
+    /// The number of candidates looked up in the postings in Step 2.
+    uint64_t probes;
+    /// The number of candidates pruned in Step 2.
+    uint64_t pruned;
+    /// The number of SIDs retrieved, including deleted strings.
+    uint64_t results;
+    /// The seconds spent generating n-grams.
+    double ngram_seconds;
+    /// The seconds spent looking up n-grams in the indices.
+    double lookup_seconds;
+    /// The seconds spent merging postings into candidates (Step 1).
+    double merge_seconds;
+    /// The seconds spent verifying candidates (Step 2).
+    double verify_seconds;
+
+    reader_stats()
+    {
+        clear();
+    }
+
+    /**
+     * Resets the statistics.
+     */
+    void clear()
+    {
+        queries = buckets = lookups = filtered = skipped = postings = 0;
+        candidates = probes = pruned = results = 0;
+        ngram_seconds = lookup_seconds = merge_seconds = verify_seconds = 0.;
+    }
+
+    /**
+     * Adds statistics.
+     */
+    reader_stats& operator+=(const reader_stats& x)
+    {
+        queries += x.queries;
+        buckets += x.buckets;
+        lookups += x.lookups;
+        filtered += x.filtered;
+        skipped += x.skipped;
+        postings += x.postings;
+        candidates += x.candidates;
+        probes += x.probes;
+        pruned += x.pruned;
+        results += x.results;
+        ngram_seconds += x.ngram_seconds;
+        lookup_seconds += x.lookup_seconds;
+        merge_seconds += x.merge_seconds;
+        verify_seconds += x.verify_seconds;
+        return *this;
+    }
+};
+
+/**
+ * The policy of readers not collecting statistics of queries (default).
+ */
+struct no_stats
+{
+    enum { enabled = 0 };
+};
+
+/**
+ * The policy of readers collecting statistics of queries.
+ *  The counters and timers cost a few clock readings per size bucket.
+ */
+struct collect_stats
+{
+    enum { enabled = 1 };
+};
+
+/**
+ * A stopwatch accumulating the seconds of the steps of queries.
+ *  The stopwatch for readers not collecting statistics does nothing, and
+ *  is removed by compilers.
+ *  @param  enabled     \c true to measure the time.
+ */
+template <bool enabled>
+class stopwatch
+{
+public:
+    /**
+     * Adds the time since the previous lap to a timer.
+     */
+    void lap(double& seconds)
+    {
+    }
+};
+
+template <>
+class stopwatch<true>
+{
+protected:
+    typedef std::chrono::steady_clock clock_type;
+    clock_type::time_point m_last;
+
+public:
+    stopwatch() : m_last(clock_type::now())
+    {
+    }
+
+    void lap(double& seconds)
+    {
+        const clock_type::time_point now = clock_type::now();
+        seconds += std::chrono::duration<double>(now - m_last).count();
+        m_last = now;
+    }
+};
+
+};
+
+#endif/*__SIMSTRING_STATS_H__*/
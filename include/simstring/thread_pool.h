@@ -0,0 +1,390 @@
+/*
+ *      Thread pool with work stealing.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_THREAD_POOL_H__
+#define __SIMSTRING_THREAD_POOL_H__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace simstring
+{
+
+/**
+ * A pool of worker threads with work stealing.
+ *
+ *  Every worker owns a task queue. A worker takes tasks from the back of
+ *  its own queue, and steals tasks from the front of the other queues
+ *  when its queue is empty; tasks of uneven costs are thus balanced
+ *  among the workers without a central queue.
+ */
+class thread_pool
+{
+public:
+    /// The type of a task.
+    typedef std::function<void()> task_type;
+
+protected:
+    // A task queue owned by a worker.
+    struct queue_type
+    {
+        std::mutex              mutex;
+        std::deque<task_type>   tasks;
+    };
+
+    // The task queues.
+    std::vector<std::unique_ptr<queue_type> > m_queues;
+    // The worker threads.
+    std::vector<std::thread> m_threads;
+    // The number of tasks in the queues.
+    std::atomic<size_t> m_pending;
+    // The queue receiving the next task submitted from outside the pool.
+    std::atomic<size_t> m_next;
+    // The flag for stopping the workers.
+    bool m_stop;
+    // The mutex and condition variable for idle workers.
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+public:
+    /**
+     * Constructs a thread pool.
+     *  @param  num_threads The number of worker threads. Zero uses the
+     *                      number of hardware threads.
+     */
+    explicit thread_pool(int num_threads = 0)
+        : m_pending(0), m_next(0), m_stop(false)
+    {
+        if (num_threads <= 0) {
+            num_threads = (int)std::thread::hardware_concurrency();
+        }
+        if (num_threads <= 0) {
+            num_threads = 1;
+        }
+
+        for (int i = 0;i < num_threads;++i) {
+            m_queues.push_back(std::unique_ptr<queue_type>(new queue_type));
+        }
+        for (int i = 0;i < num_threads;++i) {
+            m_threads.push_back(std::thread(&thread_pool::work, this, i));
+        }
+    }
+
+    /**
+     * Destructs the thread pool.
+     *  The destructor waits for the workers to finish the queued tasks.
+     */
+    virtual ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        for (size_t i = 0;i < m_threads.size();++i) {
+            m_threads[i].join();
+        }
+    }
+
+    /**
+     * Returns the number of worker threads.
+     *  @return int     The number of worker threads.
+     */
+    int size() const
+    {
+        return (int)m_threads.size();
+    }
+
+    /**
+     * Submits a task.
+     *  A task submitted by a worker goes to the queue of the worker;
+     *  other tasks are distributed to the queues in a round-robin manner.
+     *  @param  task    The task.
+     */
+    void submit(task_type task)
+    {
+        size_t i = (current() == this) ?
+            (size_t)current_index() : m_next++ % m_queues.size();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_queues[i]->mutex);
+            m_queues[i]->tasks.push_back(task);
+        }
+        m_cond.notify_one();
+    }
+
+    /**
+     * Runs a queued task in the calling thread.
+     *  A thread waiting for tasks calls this function to help the workers
+     *  instead of blocking them.
+     *  @return bool    \c true if a task was run, \c false if no task is
+     *                  queued.
+     */
+    bool run_pending()
+    {
+        task_type task;
+        int i = (current() == this) ? current_index() : 0;
+        if (!pop(i, task)) {
+            return false;
+        }
+        task();
+        return true;
+    }
+
+protected:
+    void work(int i)
+    {
+        current() = this;
+        current_index() = i;
+
+        for (;;) {
+            task_type task;
+            if (pop(i, task)) {
+                task();
+                continue;
+            }
+
+            // Sleep until a task is submitted.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_stop || 0 < m_pending; });
+            if (m_stop && m_pending == 0) {
+                break;
+            }
+        }
+    }
+
+    bool pop(int i, task_type& task)
+    {
+        const size_t n = m_queues.size();
+
+        // Take the newest task from the own queue.
+        {
+            queue_type& q = *m_queues[i];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = q.tasks.back();
+                q.tasks.pop_back();
+                --m_pending;
+                return true;
+            }
+        }
+
+        // Steal the oldest task from another queue.
+        for (size_t k = 1;k < n;++k) {
+            queue_type& q = *m_queues[(i + k) % n];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.tasks.empty()) {
+                task = q.tasks.front();
+                q.tasks.pop_front();
+                --m_pending;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    static thread_pool*& current()
+    {
+        static thread_local thread_pool* pool = NULL;
+        return pool;
+    }
+
+    static int& current_index()
+    {
+        static thread_local int index = 0;
+        return index;
+    }
+};
+
+/**
+ * A group of tasks that can be waited for.
+ *
+ *  A thread waiting for the group runs the queued tasks of the group, so
+ *  that tasks of the pool may also wait for their own groups. The thread
+ *  never runs tasks of other groups or of the pool while it waits: a
+ *  query waiting for its size buckets would otherwise run another query
+ *  that reuses the query context of the thread.
+ */
+class task_group
+{
+protected:
+    // The state shared with the tasks submitted to the pool, which may
+    // outlive the group after its tasks have been run by waiting threads.
+    struct state_type
+    {
+        std::mutex mutex;
+        std::condition_variable cond;
+        // The tasks not taken by any thread yet.
+        std::deque<std::function<void()> > tasks;
+        // The number of tasks not finished yet.
+        size_t count;
+        std::exception_ptr error;
+
+        state_type() : count(0)
+        {
+        }
+    };
+
+    thread_pool& m_pool;
+    std::shared_ptr<state_type> m_state;
+
+public:
+    /**
+     * Constructs a task group.
+     *  @param  pool    The thread pool running the tasks.
+     */
+    task_group(thread_pool& pool) : m_pool(pool), m_state(new state_type)
+    {
+    }
+
+    /**
+     * Destructs the task group after waiting for the tasks.
+     */
+    virtual ~task_group()
+    {
+        try {
+            wait();
+        } catch (...) {
+        }
+    }
+
+    /**
+     * Runs a task in the pool as a member of the group.
+     *  @param  task    The task.
+     */
+    template <class function_type>
+    void run(function_type task)
+    {
+        std::shared_ptr<state_type> state = m_state;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->tasks.push_back(task);
+            ++state->count;
+        }
+        m_pool.submit([state] {
+            run_one(*state);
+        });
+    }
+
+    /**
+     * Waits for the tasks in the group.
+     *  If a task threw an exception, this function rethrows the first one.
+     */
+    void wait()
+    {
+        state_type& state = *m_state;
+        while (run_one(state)) {
+        }
+
+        // The remaining tasks are running on the workers.
+        std::exception_ptr error;
+        {
+            std::unique_lock<std::mutex> lock(state.mutex);
+            state.cond.wait(lock, [&state] { return state.count == 0; });
+            std::swap(error, state.error);
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+protected:
+    static bool run_one(state_type& state)
+    {
+        std::function<void()> task;
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.tasks.empty()) {
+                return false;
+            }
+            task.swap(state.tasks.front());
+            state.tasks.pop_front();
+        }
+
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (!state.error) {
+                state.error = std::current_exception();
+            }
+        }
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (--state.count == 0) {
+            state.cond.notify_all();
+        }
+        return true;
+    }
+};
+
+/**
+ * Calls a function for every index in a range in parallel.
+ *  The range is split into chunks of \c grain indices, each of which is
+ *  a task of the pool.
+ *  @param  pool    The thread pool.
+ *  @param  n       The number of indices, [0, n).
+ *  @param  grain   The number of indices processed by a task.
+ *  @param  func    The function called with an index.
+ */
+template <class function_type>
+void parallel_for(thread_pool& pool, size_t n, size_t grain, function_type func)
+{
+    task_group group(pool);
+    if (grain == 0) {
+        grain = 1;
+    }
+    for (size_t first = 0;first < n;first += grain) {
+        size_t last = std::min(first + grain, n);
+        group.run([first, last, &func] {
+            for (size_t i = first;i < last;++i) {
+                func(i);
+            }
+        });
+    }
+    group.wait();
+}
+
+};
+
+#endif/*__SIMSTRING_THREAD_POOL_H__*/
@@ -0,0 +1,200 @@
+/*
+ *      UTF-8 decoder.
+ *
+ * Copyright (c) 2009,2010 Naoaki Okazaki
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of the authors nor the names of its contributors may
+ *       be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* $Id$ */
+
+#ifndef __SIMSTRING_UTF8_H__
+#define __SIMSTRING_UTF8_H__
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+// The detection of SIMD instructions (SIMSTRING_SSE2, SIMSTRING_NEON).
+#include "intersect.h"
+
+namespace simstring
+{
+
+/**
+ * \addtogroup utf8 UTF-8 decoder
+ * @{
+ *
+ *  The functions in this group decode UTF-8 strings into Unicode code
+ *  points for generating n-grams of letters. Runs of ASCII characters,
+ *  which dominate most texts, are validated with SIMD instructions and
+ *  copied without decoding. A byte that does not start a valid sequence
+ *  (including overlong forms, surrogates, and values beyond U+10FFFF) is
+ *  decoded as a letter of its own, U+DC80 to U+DCFF as in the
+ *  "surrogateescape" scheme, so that any byte string has n-grams.
+ */
+
+/**
+ * Returns the length of the ASCII prefix of a byte string.
+ *  @param  str     The pointer to the string.
+ *  @param  len     The length of the string in bytes.
+ *  @return size_t  The number of leading bytes smaller than 0x80.
+ */
+inline size_t utf8_ascii_prefix(const char* str, size_t len)
+{
+    size_t i = 0;
+#if     defined(SIMSTRING_SSE2)
+    for (;i + 16 <= len;i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(str + i));
+        int mask = _mm_movemask_epi8(x);
+        if (mask != 0) {
+            // The lowest set bit is the first non-ASCII byte.
+            int k = 0;
+            while (!(mask & (1 << k))) {
+                ++k;
+            }
+            return i + k;
+        }
+    }
+#elif   defined(SIMSTRING_NEON)
+    for (;i + 16 <= len;i += 16) {
+        uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t*>(str + i));
+        uint64x2_t y = vreinterpretq_u64_u8(vandq_u8(x, vdupq_n_u8(0x80)));
+        if (vgetq_lane_u64(y, 0) | vgetq_lane_u64(y, 1)) {
+            break;
+        }
+    }
+#endif
+    // Eight bytes at a time, then bytewise.
+    for (;i + 8 <= len;i += 8) {
+        uint64_t x;
+        std::memcpy(&x, str + i, sizeof(x));
+        if (x & 0x8080808080808080ULL) {
+            break;
+        }
+    }
+    for (;i < len;++i) {
+        if ((unsigned char)str[i] & 0x80) {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * Decodes a multi-byte sequence of UTF-8.
+ *  @param  str     The pointer to the sequence, whose first byte is not
+ *                  ASCII.
+ *  @param  len     The number of bytes available.
+ *  @param  cp      The code point decoded.
+ *  @return size_t  The number of bytes consumed (one for an invalid
+ *                  sequence, whose byte is decoded as U+DC80 to U+DCFF).
+ */
+inline size_t utf8_decode_one(const char* str, size_t len, uint32_t& cp)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(str);
+    const unsigned char c = p[0];
+    size_t n = 0;
+    uint32_t v = 0, min = 0;
+    if ((c & 0xE0) == 0xC0) {
+        n = 2;
+        v = c & 0x1F;
+        min = 0x80;
+    } else if ((c & 0xF0) == 0xE0) {
+        n = 3;
+        v = c & 0x0F;
+        min = 0x800;
+    } else if ((c & 0xF8) == 0xF0) {
+        n = 4;
+        v = c & 0x07;
+        min = 0x10000;
+    }
+
+    if (n != 0 && n <= len) {
+        size_t i = 1;
+        for (;i < n && (p[i] & 0xC0) == 0x80;++i) {
+            v = (v << 6) | (p[i] & 0x3F);
+        }
+        if (i == n && min <= v && v <= 0x10FFFF && (v < 0xD800 || 0xDFFF < v)) {
+            cp = v;
+            return n;
+        }
+    }
+
+    cp = 0xDC00 | c;
+    return 1;
+}
+
+/**
+ * Decodes a UTF-8 string into code points.
+ *  @param  str     The pointer to the string.
+ *  @param  len     The length of the string in bytes.
+ *  @param  cps     The buffer receiving the code points, or \c NULL. The
+ *                  buffer must have space for \c len elements.
+ *  @param  offsets The buffer receiving the byte offsets of the code
+ *                  points followed by \c len, or \c NULL. The buffer
+ *                  must have space for \c len + 1 elements.
+ *  @return size_t  The number of code points.
+ */
+inline size_t utf8_decode(const char* str, size_t len, uint32_t* cps, size_t* offsets)
+{
+    size_t i = 0, m = 0;
+    while (i < len) {
+        // Copy a run of ASCII characters.
+        const size_t end = i + utf8_ascii_prefix(str + i, len - i);
+        for (;i < end;++i, ++m) {
+            if (cps != NULL) {
+                cps[m] = (unsigned char)str[i];
+            }
+            if (offsets != NULL) {
+                offsets[m] = i;
+            }
+        }
+        if (len <= i) {
+            break;
+        }
+
+        uint32_t cp;
+        const size_t n = utf8_decode_one(str + i, len - i, cp);
+        if (cps != NULL) {
+            cps[m] = cp;
+        }
+        if (offsets != NULL) {
+            offsets[m] = i;
+        }
+        i += n;
+        ++m;
+    }
+    if (offsets != NULL) {
+        offsets[m] = len;
+    }
+    return m;
+}
+
+/** @} */
+
+};
+
+#endif/*__SIMSTRING_UTF8_H__*/
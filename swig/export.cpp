@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <map>
 #include <string>
 #include <stdexcept>
 #include <vector>
@@ -22,14 +24,13 @@
 #define ICONV_CONST
 #endif/*ICONV_CONST*/
 
-template <class source_type, class destination_type>
-bool iconv_convert(iconv_t cd, const source_type& src, destination_type& dst)
+template <class source_char_type, class destination_type>
+bool iconv_convert(iconv_t cd, const source_char_type* src, size_t length, destination_type& dst)
 {
-    typedef typename source_type::value_type source_char_type;
     typedef typename destination_type::value_type destination_char_type;
     
-    const char *inbuf = reinterpret_cast<const char *>(src.c_str());
-    size_t inbytesleft = sizeof(source_char_type) * src.length();
+    const char *inbuf = reinterpret_cast<const char *>(src);
+    size_t inbytesleft = sizeof(source_char_type) * length;
     while (inbytesleft > 0) {
         char buffer[1024];
     char *p = buffer;
@@ -46,6 +47,58 @@ bool iconv_convert(iconv_t cd, const source_type& src, destination_type& dst)
     return true;
 }
 
+template <class source_type, class destination_type>
+bool iconv_convert(iconv_t cd, const source_type& src, destination_type& dst)
+{
+    return iconv_convert(cd, src.c_str(), src.length(), dst);
+}
+
+/**
+ * Conversion descriptors of iconv kept open for reuse.
+ */
+class iconv_cache
+{
+protected:
+    typedef std::map<std::pair<std::string, std::string>, iconv_t> descriptors_type;
+    descriptors_type m_cds;
+
+public:
+    ~iconv_cache()
+    {
+        for (descriptors_type::iterator it = m_cds.begin();it != m_cds.end();++it) {
+            iconv_close(it->second);
+        }
+    }
+
+    iconv_t get(const char *tocode, const char *fromcode)
+    {
+        std::pair<std::string, std::string> key(tocode, fromcode);
+        descriptors_type::iterator it = m_cds.find(key);
+        if (it == m_cds.end()) {
+            iconv_t cd = iconv_open(tocode, fromcode);
+            if (cd == (iconv_t)-1) {
+                return cd;
+            }
+            it = m_cds.insert(descriptors_type::value_type(key, cd)).first;
+        }
+
+        // Reset the shift state left by the previous conversion.
+        iconv(it->second, NULL, NULL, NULL, NULL);
+        return it->second;
+    }
+};
+
+/**
+ * Returns a conversion descriptor of iconv for the calling thread.
+ *  The descriptor is opened on the first use in a thread, and closed when
+ *  the thread exits.
+ */
+iconv_t iconv_get(const char *tocode, const char *fromcode)
+{
+    static thread_local iconv_cache cache;
+    return cache.get(tocode, fromcode);
+}
+
 int translate_measure(int measure)
 {
     switch (measure) {
@@ -68,14 +121,24 @@ int translate_measure(int measure)
 typedef simstring::ngram_generator ngram_generator_type;
 typedef simstring::writer_base<std::string, ngram_generator_type> writer_type;
 typedef simstring::writer_base<std::wstring, ngram_generator_type> uwriter_type;
-typedef simstring::reader reader_type;
+typedef simstring::reader_base<ngram_generator_type, simstring::collect_stats> reader_type;
 
-writer::writer(const char *filename, int n, bool be, bool unicode)
-    : m_dbw(NULL), m_gen(NULL), m_unicode(unicode)
+writer::writer(const char *filename, int n, bool be, bool unicode, bool compress, bool large, bool utf8, bool filters)
+    : m_dbw(NULL), m_gen(NULL), m_unicode(unicode && !utf8)
 {
-    ngram_generator_type *gen = new ngram_generator_type(n, be);
-    if (unicode) {
-        uwriter_type *dbw = new uwriter_type(*gen, filename);
+    ngram_generator_type *gen = new ngram_generator_type(n, be, utf8);
+    int flags = 0;
+    if (compress) {
+        flags |= simstring::store_compressed;
+    }
+    if (large) {
+        flags |= simstring::store_large;
+    }
+    if (filters) {
+        flags |= simstring::store_ngram_filters;
+    }
+    if (m_unicode) {
+        uwriter_type *dbw = new uwriter_type(*gen, filename, flags);
         if (dbw->fail()) {
             std::string message = dbw->error();
             delete dbw;
@@ -86,7 +149,7 @@ writer::writer(const char *filename, int n, bool be, bool unicode)
     m_gen = gen;
 
     } else {
-        writer_type *dbw = new writer_type(*gen, filename);
+        writer_type *dbw = new writer_type(*gen, filename, flags);
         if (dbw->fail()) {
             std::string message = dbw->error();
             delete dbw;
@@ -136,9 +199,7 @@ void writer::insert(const char *string)
         uwriter_type* dbw = reinterpret_cast<uwriter_type*>(m_dbw);
 
     std::wstring str;
-    iconv_t cd = iconv_open("WCHAR_T", "UTF-8");
-    iconv_convert(cd, std::string(string), str);
-    iconv_close(cd);
+    iconv_convert(iconv_get("WCHAR_T", "UTF-8"), std::string(string), str);
 
     dbw->insert(str);
     if (dbw->fail()) {
@@ -154,6 +215,50 @@ void writer::insert(const char *string)
     }
 }
 
+void writer::insert_many(const std::vector<std::string>& strings)
+{
+    if (m_unicode) {
+        uwriter_type* dbw = reinterpret_cast<uwriter_type*>(m_dbw);
+
+    // Convert all the strings with one conversion descriptor.
+    iconv_t cd = iconv_get("WCHAR_T", "UTF-8");
+    std::vector<std::wstring> strs(strings.size());
+    for (size_t i = 0;i < strings.size();++i) {
+        iconv_convert(cd, strings[i], strs[i]);
+    }
+
+    dbw->insert_many(strs.begin(), strs.end());
+    if (dbw->fail()) {
+            throw std::runtime_error(dbw->error());
+    }
+
+    } else {
+        writer_type* dbw = reinterpret_cast<writer_type*>(m_dbw);
+    dbw->insert_many(strings.begin(), strings.end());
+    if (dbw->fail()) {
+            throw std::runtime_error(dbw->error());
+    }
+    }
+}
+
+void writer::set_num_threads(int num_threads)
+{
+    if (m_unicode) {
+        uwriter_type* dbw = reinterpret_cast<uwriter_type*>(m_dbw);
+        dbw->set_num_threads(num_threads);
+        if (dbw->fail()) {
+            throw std::runtime_error(dbw->error());
+        }
+
+    } else {
+        writer_type* dbw = reinterpret_cast<writer_type*>(m_dbw);
+        dbw->set_num_threads(num_threads);
+        if (dbw->fail()) {
+            throw std::runtime_error(dbw->error());
+        }
+    }
+}
+
 void writer::close()
 {
     if (m_unicode) {
@@ -174,12 +279,44 @@ void writer::close()
 
 
 
+result_buffer::result_buffer()
+{
+    m_offsets.push_back(0);
+}
+
+int result_buffer::size() const
+{
+    return (int)(m_offsets.size() - 1);
+}
+
+std::string result_buffer::get(int i) const
+{
+    if (i < 0 || size() <= i) {
+        throw std::out_of_range("Index out of range");
+    }
+    return m_data.substr(m_offsets[i], m_offsets[i+1] - m_offsets[i]);
+}
+
+void result_buffer::clear()
+{
+    m_data.clear();
+    m_offsets.resize(1);
+}
+
+void result_buffer::append(const char *str, size_t length)
+{
+    m_data.append(str, length);
+    m_offsets.push_back(m_data.size());
+}
+
+
+
 reader::reader(const char *filename)
-    : m_dbr(NULL), measure(cosine), threshold(0.7)
+    : m_dbr(NULL), m_pool(NULL), m_pool_threads(0), measure(cosine), threshold(0.7), num_threads(0)
 {
     reader_type *dbr = new reader_type;
 
-    if (!dbr->open(filename)) {
+    if (!dbr->open(filename, simstring::open_eager)) {
         delete dbr;
         throw std::invalid_argument("Failed to open the database");
     }
@@ -190,102 +327,146 @@ reader::reader(const char *filename)
 reader::~reader()
 {
     this->close();
+    delete reinterpret_cast<simstring::thread_pool*>(m_pool);
     delete reinterpret_cast<reader_type*>(m_dbr);
 }
 
-template <class insert_iterator_type>
+/**
+ * Collects retrieved strings in UTF-8 into an array of strings.
+ */
+struct vector_sink
+{
+    std::vector<std::string>& strs;
+
+    vector_sink(std::vector<std::string>& v) : strs(v)
+    {
+    }
+
+    void operator()(const char *str, size_t length)
+    {
+        strs.push_back(std::string(str, length));
+    }
+};
+
+/**
+ * Collects retrieved strings in UTF-8 into a result buffer.
+ */
+struct buffer_sink
+{
+    result_buffer& buffer;
+
+    buffer_sink(result_buffer& b) : buffer(b)
+    {
+    }
+
+    void operator()(const char *str, size_t length)
+    {
+        buffer.append(str, length);
+    }
+};
+
+template <class sink_type>
 void retrieve_thru(
     reader_type& dbr,
     const std::string& query,
     int measure,
     double threshold,
-    insert_iterator_type ins
+    sink_type& sink
     )
 {
-    switch (measure) {
-    case exact:
-        dbr.retrieve<simstring::measure::exact>(query, threshold, ins);
-        break;
-    case dice:
-        dbr.retrieve<simstring::measure::dice>(query, threshold, ins);
-        break;
-    case cosine:
-        dbr.retrieve<simstring::measure::cosine>(query, threshold, ins);
-        break;
-    case jaccard:
-        dbr.retrieve<simstring::measure::jaccard>(query, threshold, ins);
-        break;
-    case overlap:
-        dbr.retrieve<simstring::measure::overlap>(query, threshold, ins);
-        break;
-    }
+    // The strings are passed to the sink from the memory image.
+    dbr.visit(query, translate_measure(measure), threshold,
+        [&](const simstring::result_view<char>& r) {
+            sink(r.data, r.length);
+        });
 }
 
-template <class char_type, class insert_iterator_type>
+template <class char_type, class sink_type>
 void retrieve_iconv(
     reader_type& dbr,
     const std::string& query,
     const char *encoding,
     int measure,
     double threshold,
-    insert_iterator_type ins
+    sink_type& sink
     )
 {
     typedef std::basic_string<char_type> string_type;
-    typedef std::vector<string_type> strings_type;
 
     // Translate the character encoding of the query string from UTF-8 to the target encoding.
     string_type qstr;
-    iconv_t fwd = iconv_open(encoding, "UTF-8");
-    iconv_convert(fwd, query, qstr);
-    iconv_close(fwd);
-    
-    strings_type xstrs;
-    switch (measure) {
-    case exact:
-        dbr.retrieve<simstring::measure::exact>(qstr, threshold, std::back_inserter(xstrs));
-        break;
-    case dice:
-        dbr.retrieve<simstring::measure::dice>(qstr, threshold, std::back_inserter(xstrs));
-        break;
-    case cosine:
-        dbr.retrieve<simstring::measure::cosine>(qstr, threshold, std::back_inserter(xstrs));
+    iconv_convert(iconv_get(encoding, "UTF-8"), query, qstr);
+
+    // Translate back the character encoding of retrieved strings into
+    // UTF-8 directly from the memory image, reusing the buffer.
+    std::string dst;
+    iconv_t bwd = iconv_get("UTF-8", encoding);
+    dbr.visit(qstr, translate_measure(measure), threshold,
+        [&](const simstring::result_view<char_type>& r) {
+            dst.clear();
+            iconv_convert(bwd, r.data, r.length, dst);
+            sink(dst.data(), dst.size());
+        });
+}
+
+template <class sink_type>
+void retrieve_any(
+    reader_type& dbr,
+    const std::string& query,
+    int measure,
+    double threshold,
+    sink_type& sink
+    )
+{
+    switch (dbr.char_size()) {
+    case 1:
+        retrieve_thru(dbr, query, measure, threshold, sink);
         break;
-    case jaccard:
-        dbr.retrieve<simstring::measure::jaccard>(qstr, threshold, std::back_inserter(xstrs));
+    case 2:
+        retrieve_iconv<uint16_t>(dbr, query, UTF16, measure, threshold, sink);
         break;
-    case overlap:
-        dbr.retrieve<simstring::measure::overlap>(qstr, threshold, std::back_inserter(xstrs));
+    case 4:
+        retrieve_iconv<uint32_t>(dbr, query, UTF32, measure, threshold, sink);
         break;
     }
-
-    // Translate back the character encoding of retrieved strings into UTF-8.
-    iconv_t bwd = iconv_open("UTF-8", encoding);
-    for (typename strings_type::const_iterator it = xstrs.begin();it != xstrs.end();++it) {
-        std::string dst;
-    iconv_convert(bwd, *it, dst);
-    *ins = dst;
-    }
-    iconv_close(bwd);
 }
 
 std::vector<std::string> reader::retrieve(const char *query)
 {
     reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
     std::vector<std::string> ret;
+    vector_sink sink(ret);
+    retrieve_any(dbr, query, this->measure, this->threshold, sink);
+    return ret;
+}
 
-    switch (dbr.char_size()) {
-    case 1:
-        retrieve_thru(dbr, query, this->measure, this->threshold, std::back_inserter(ret));
-        break;
-    case 2:
-        retrieve_iconv<uint16_t>(dbr, query, UTF16, this->measure, this->threshold, std::back_inserter(ret));
-        break;
-    case 4:
-        retrieve_iconv<uint32_t>(dbr, query, UTF32, this->measure, this->threshold, std::back_inserter(ret));
-        break;
+void reader::retrieve_into(const char *query, result_buffer& results)
+{
+    reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
+    buffer_sink sink(results);
+    results.clear();
+    retrieve_any(dbr, query, this->measure, this->threshold, sink);
+}
+
+std::vector<std::vector<std::string> > reader::retrieve_batch(const std::vector<std::string>& queries)
+{
+    reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
+    std::vector<std::vector<std::string> > ret(queries.size());
+
+    // Keep the thread pool unless the number of threads changes.
+    if (m_pool == NULL || m_pool_threads != this->num_threads) {
+        delete reinterpret_cast<simstring::thread_pool*>(m_pool);
+        m_pool = NULL;
+        m_pool = new simstring::thread_pool(this->num_threads);
+        m_pool_threads = this->num_threads;
     }
+    simstring::thread_pool& pool = *reinterpret_cast<simstring::thread_pool*>(m_pool);
 
+    // The reader was opened with open_eager, so that queries can share it.
+    simstring::parallel_for(pool, queries.size(), 16, [&](size_t i) {
+        vector_sink sink(ret[i]);
+        retrieve_any(dbr, queries[i], this->measure, this->threshold, sink);
+    });
     return ret;
 }
 
@@ -298,21 +479,79 @@ bool reader::check(const char *query)
         return dbr.check(qstr, translate_measure(this->measure), this->threshold);
     } else if (dbr.char_size() == 2) {
         std::basic_string<uint16_t> qstr;
-        iconv_t fwd = iconv_open(UTF16, "UTF-8");
-        iconv_convert(fwd, std::string(query), qstr);
-        iconv_close(fwd);
+        iconv_convert(iconv_get(UTF16, "UTF-8"), std::string(query), qstr);
         return dbr.check(qstr, translate_measure(this->measure), this->threshold);
     } else if (dbr.char_size() == 4) {
         std::basic_string<uint32_t> qstr;
-        iconv_t fwd = iconv_open(UTF32, "UTF-8");
-        iconv_convert(fwd, std::string(query), qstr);
-        iconv_close(fwd);
+        iconv_convert(iconv_get(UTF32, "UTF-8"), std::string(query), qstr);
         return dbr.check(qstr, translate_measure(this->measure), this->threshold);
     }
     
     return false;
 }
 
+void reader::set_cache(int megabytes)
+{
+    reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
+    dbr.set_cache((size_t)std::max(megabytes, 0) * 1024 * 1024);
+}
+
+long long reader::cache_hits() const
+{
+    const reader_type& dbr = *reinterpret_cast<const reader_type*>(m_dbr);
+    return (long long)dbr.cache_hits();
+}
+
+long long reader::cache_misses() const
+{
+    const reader_type& dbr = *reinterpret_cast<const reader_type*>(m_dbr);
+    return (long long)dbr.cache_misses();
+}
+
+static stats translate_stats(const simstring::reader_stats& src)
+{
+    stats dst;
+    dst.queries = (long long)src.queries;
+    dst.buckets = (long long)src.buckets;
+    dst.lookups = (long long)src.lookups;
+    dst.filtered = (long long)src.filtered;
+    dst.skipped = (long long)src.skipped;
+    dst.postings = (long long)src.postings;
+    dst.candidates = (long long)src.candidates;
+    dst.probes = (long long)src.probes;
+    dst.pruned = (long long)src.pruned;
+    dst.results = (long long)src.results;
+    dst.ngram_seconds = src.ngram_seconds;
+    dst.lookup_seconds = src.lookup_seconds;
+    dst.merge_seconds = src.merge_seconds;
+    dst.verify_seconds = src.verify_seconds;
+    return dst;
+}
+
+stats reader::get_stats() const
+{
+    const reader_type& dbr = *reinterpret_cast<const reader_type*>(m_dbr);
+    return translate_stats(dbr.stats());
+}
+
+stats reader::last_stats() const
+{
+    const reader_type& dbr = *reinterpret_cast<const reader_type*>(m_dbr);
+    switch (dbr.char_size()) {
+    case 2:
+        return translate_stats(reader_type::context<std::basic_string<uint16_t> >().stats);
+    case 4:
+        return translate_stats(reader_type::context<std::basic_string<uint32_t> >().stats);
+    }
+    return translate_stats(reader_type::context<std::string>().stats);
+}
+
+void reader::reset_stats()
+{
+    reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
+    dbr.clear_stats();
+}
+
 void reader::close()
 {
     reader_type& dbr = *reinterpret_cast<reader_type*>(m_dbr);
@@ -50,9 +50,18 @@ public:
      *                      in character n-grams.
      *  @param  unicode     \c true to use Unicode mode. In Unicode mode,
      *                      wide (\c wchar_t) characters are used in n-grams.
+     *  @param  compress    \c true to compress posting lists in the indices.
+     *  @param  large       \c true to allow the database to exceed 4 GB.
+     *  @param  utf8        \c true to store strings in UTF-8 as they are, and
+     *                      to use code points in n-grams. This mode, which
+     *                      supersedes Unicode mode, needs no conversion of
+     *                      strings in writers and readers.
+     *  @param  filters     \c true to store filters of n-grams in the
+     *                      indices, with which readers skip look-ups of
+     *                      missing n-grams.
      *  @throw  SWIG_IOError
      */
-    writer(const char *filename, int n = 3, bool be = false, bool unicode = false);
+    writer(const char *filename, int n = 3, bool be = false, bool unicode = false, bool compress = false, bool large = false, bool utf8 = false, bool filters = false);
     
     /**
      * Destructs the writer.
@@ -71,6 +80,29 @@ public:
      *  @throw  SWIG_IOError
      */
     void insert(const char *string);
+
+    /**
+     * Inserts strings into the database.
+     *  This function inserts the strings in the same way as insert(), with
+     *  less overhead per string. The Python module releases the global
+     *  interpreter lock during the insertion.
+     *  @param  strings     The strings to be inserted; see insert() for the
+     *                      encoding.
+     *  @throw  SWIG_IOError
+     */
+    void insert_many(const std::vector<std::string>& strings);
+
+    /**
+     * Sets the number of threads for building the database.
+     *  With multiple threads, n-grams of the inserted strings are generated
+     *  in parallel. The database is identical to the one built with a
+     *  single thread.
+     *  @param  num_threads The number of threads. Zero uses the number of
+     *                      hardware threads; one disables the threads
+     *                      (default).
+     *  @throw  SWIG_IOError
+     */
+    void set_num_threads(int num_threads);
     
     /**
      * Closes the database.
@@ -81,6 +113,83 @@ public:
     void close();
 };
 
+/**
+ * A buffer of retrieved strings.
+ *  reader::retrieve_into() stores the retrieved strings in the buffer,
+ *  which keeps its memory for later queries. This avoids the allocation
+ *  of an array and a string for every retrieved string of a query.
+ */
+class result_buffer
+{
+protected:
+    std::string m_data;
+    std::vector<size_t> m_offsets;
+
+public:
+    /**
+     * Constructs an empty buffer.
+     */
+    result_buffer();
+
+    /**
+     * Returns the number of strings in the buffer.
+     */
+    int size() const;
+
+    /**
+     * Returns a string in the buffer.
+     *  @param  i           The index of the string.
+     *  @return             The string.
+     *  @throw  SWIG_IndexError
+     */
+    std::string get(int i) const;
+
+    /**
+     * Removes the strings in the buffer, keeping its memory.
+     */
+    void clear();
+
+#ifndef SWIG
+    void append(const char *str, size_t length);
+#endif/*SWIG*/
+};
+
+/**
+ * Statistics of queries.
+ *  The counters and seconds are summed over queries.
+ */
+struct stats
+{
+    /// The number of queries.
+    long long queries;
+    /// The number of string sizes (indices) searched.
+    long long buckets;
+    /// The number of look-ups of query n-grams in the indices.
+    long long lookups;
+    /// The number of query n-grams rejected by the filters of the indices.
+    long long filtered;
+    /// The number of string sizes skipped by the filters of the indices.
+    long long skipped;
+    /// The number of string IDs in the posting lists merged into candidates.
+    long long postings;
+    /// The number of candidates.
+    long long candidates;
+    /// The number of candidates looked up in the remaining posting lists.
+    long long probes;
+    /// The number of candidates pruned.
+    long long pruned;
+    /// The number of strings retrieved.
+    long long results;
+    /// The seconds spent generating n-grams.
+    double ngram_seconds;
+    /// The seconds spent looking up n-grams in the indices.
+    double lookup_seconds;
+    /// The seconds spent merging posting lists into candidates.
+    double merge_seconds;
+    /// The seconds spent verifying candidates.
+    double verify_seconds;
+};
+
 /**
  * SimString database reader.
  */
@@ -88,6 +197,9 @@ class reader
 {
 protected:
     void *m_dbr;
+    // The thread pool of retrieve_batch(), and its number of threads.
+    void *m_pool;
+    int m_pool_threads;
 
 public:
     /**
@@ -126,6 +238,18 @@ public:
      *  @see    threshold   The similarity value used by this function.
      */
     std::vector<std::string> retrieve(const char *query);
+
+    /**
+     * Retrieves strings that are similar to the query string into a buffer.
+     *  This function is identical to retrieve() except that it stores the
+     *  strings into a buffer, whose memory is reused by later queries.
+     *
+     *  @param  query       The query string; see retrieve() for the
+     *                      encoding.
+     *  @param  results     The buffer receiving the strings retrieved for
+     *                      the query. The previous content is removed.
+     */
+    void retrieve_into(const char *query, result_buffer& results);
     
     /**
      * Checks the existence of a string that is similar to the query string.
@@ -146,6 +270,63 @@ public:
      */
      bool check(const char *query);
 
+    /**
+     * Retrieves strings that are similar to each query in a batch.
+     *  This function processes the queries in parallel with \ref num_threads
+     *  threads, and returns the results in the same order as the queries.
+     *  The Python module releases the global interpreter lock during the
+     *  retrieval.
+     *
+     *  @param  queries     The query strings; see retrieve() for the
+     *                      encoding.
+     *  @return             The array of the arrays of strings retrieved for
+     *                      the queries.
+     *  @see    measure     The similarity function used by this function.
+     *  @see    threshold   The similarity value used by this function.
+     *  @see    num_threads The number of threads used by this function.
+     */
+    std::vector<std::vector<std::string> > retrieve_batch(const std::vector<std::string>& queries);
+
+    /**
+     * Enables the cache of retrieved results.
+     *  The reader keeps the results of recent queries, and answers
+     *  repeated queries (with the same measure and threshold) without
+     *  searching the database. The cache is used by retrieve() and
+     *  retrieve_batch().
+     *
+     *  @param  megabytes   The memory budget of the cache in megabytes.
+     *                      Zero disables the cache (default).
+     */
+    void set_cache(int megabytes);
+
+    /**
+     * Returns the number of queries answered from the cache.
+     */
+    long long cache_hits() const;
+
+    /**
+     * Returns the number of queries that missed the cache.
+     */
+    long long cache_misses() const;
+
+    /**
+     * Returns the statistics of the queries issued to the reader.
+     *  The statistics cover retrieve(), check(), and retrieve_batch()
+     *  since the database was opened or reset_stats() was called.
+     */
+    stats get_stats() const;
+
+    /**
+     * Returns the statistics of the last query of the calling thread,
+     *  issued by retrieve() or check().
+     */
+    stats last_stats() const;
+
+    /**
+     * Resets the statistics of the queries issued to the reader.
+     */
+    void reset_stats();
+
     /**
      * Closes a database.
      */
@@ -166,6 +347,13 @@ public:
      *  retrieve() function.
      */
     double threshold;
+
+    /**
+     * Number of threads.
+     *  Specify the number of threads used by retrieve_batch() function.
+     *  Zero (default) uses the number of hardware threads.
+     */
+    int num_threads;
 };
 
 /** @} */
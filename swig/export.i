@@ -1,4 +1,4 @@
-%module simstring
+%module(threads="1") simstring
 
 %{
 #include "export.h"
@@ -10,11 +10,20 @@
 
 namespace std {
     %template(StringVector) vector<std::string>;
+    %template(StringVectorVector) vector<vector<std::string> >;
 }
 
+// Hold the global interpreter lock except in functions that do not touch
+// Python objects while running for a long time.
+%nothread;
+%thread reader::retrieve_batch;
+%thread writer::insert_many;
+
 %exception {
     try {
         $action
+    } catch(const std::out_of_range& e) {
+        SWIG_exception(SWIG_IndexError, e.what());
     } catch(const std::invalid_argument& e) {
         SWIG_exception(SWIG_IOError, e.what());
     } catch(const std::runtime_error& e) {